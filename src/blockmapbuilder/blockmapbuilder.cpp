@@ -19,14 +19,20 @@
 */
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <memory>
 
 #include "framework/zdray.h"
 #include "framework/templates.h"
 #include "framework/tarray.h"
+#include "framework/threadpool.h"
 #include "blockmapbuilder/blockmapbuilder.h"
 
 #undef BLOCK_TEST
 
+static const unsigned int MIN_PARALLEL_LINES = 8192;	// Fewest lines worth spreading over a thread pool
+static const unsigned int LINES_PER_TASK = 2048;
+
 FBlockmapBuilder::FBlockmapBuilder (FLevel &level)
 	: Level (level)
 {
@@ -170,13 +176,165 @@ notest:
 	return &BlockMap[0];
 }
 
+// Calls visit with the index of every cell the line passes through, walking
+// from its first vertex to its second. Some lines visit a cell more than once.
+
+template<class Visit>
+static void RasterizeLine (const FLevel &level, unsigned int line, int minx, int miny, int bmapwidth, Visit &&visit)
+{
+	int x1 = level.Vertices[level.Lines[line].v1].x >> FRACBITS;
+	int y1 = level.Vertices[level.Lines[line].v1].y >> FRACBITS;
+	int x2 = level.Vertices[level.Lines[line].v2].x >> FRACBITS;
+	int y2 = level.Vertices[level.Lines[line].v2].y >> FRACBITS;
+	int dx = x2 - x1;
+	int dy = y2 - y1;
+	int bx = (x1 - minx) >> BLOCKBITS;
+	int by = (y1 - miny) >> BLOCKBITS;
+	int bx2 = (x2 - minx) >> BLOCKBITS;
+	int by2 = (y2 - miny) >> BLOCKBITS;
+
+	int block = bx + by * bmapwidth;
+	int endblock = bx2 + by2 * bmapwidth;
+
+	if (block == endblock)	// Single block
+	{
+		visit (block);
+	}
+	else if (by == by2)		// Horizontal line
+	{
+		if (bx > bx2)
+		{
+			std::swap (block, endblock);
+		}
+		do
+		{
+			visit (block);
+			block += 1;
+		} while (block <= endblock);
+	}
+	else if (bx == bx2)	// Vertical line
+	{
+		if (by > by2)
+		{
+			std::swap (block, endblock);
+		}
+		do
+		{
+			visit (block);
+			block += bmapwidth;
+		} while (block <= endblock);
+	}
+	else				// Diagonal line
+	{
+		int xchange = (dx < 0) ? -1 : 1;
+		int ychange = (dy < 0) ? -1 : 1;
+		int ymove = ychange * bmapwidth;
+		int adx = abs (dx);
+		int ady = abs (dy);
+
+		if (adx == ady)		// 45 degrees
+		{
+			int xb = (x1 - minx) & (BLOCKSIZE-1);
+			int yb = (y1 - miny) & (BLOCKSIZE-1);
+			if (dx < 0)
+			{
+				xb = BLOCKSIZE-xb;
+			}
+			if (dy < 0)
+			{
+				yb = BLOCKSIZE-yb;
+			}
+			if (xb < yb)
+				adx--;
+		}
+		if (adx >= ady)		// X-major
+		{
+			int yadd = dy < 0 ? -1 : BLOCKSIZE;
+			do
+			{
+				int stop = (Scale ((by << BLOCKBITS) + yadd - (y1 - miny), dx, dy) + (x1 - minx)) >> BLOCKBITS;
+				while (bx != stop)
+				{
+					visit (block);
+					block += xchange;
+					bx += xchange;
+				}
+				visit (block);
+				block += ymove;
+				by += ychange;
+			} while (by != by2);
+			while (block != endblock)
+			{
+				visit (block);
+				block += xchange;
+			}
+			visit (block);
+		}
+		else					// Y-major
+		{
+			int xadd = dx < 0 ? -1 : BLOCKSIZE;
+			do
+			{
+				int stop = (Scale ((bx << BLOCKBITS) + xadd - (x1 - minx), dy, dx) + (y1 - miny)) >> BLOCKBITS;
+				while (by != stop)
+				{
+					visit (block);
+					block += ymove;
+					by += ychange;
+				}
+				visit (block);
+				block += xchange;
+				bx += xchange;
+			} while (bx != bx2);
+			while (block != endblock)
+			{
+				visit (block);
+				block += ymove;
+			}
+			visit (block);
+		}
+	}
+}
+
+// Calls func for every line. With a pool, runs of lines are handed out as
+// separate tasks, so func must only touch what belongs to the line it is given.
+
+template<class Func>
+static void ForEachLine (ThreadPool *pool, unsigned int numlines, Func &&func)
+{
+	if (pool == nullptr)
+	{
+		for (unsigned int line = 0; line < numlines; ++line)
+		{
+			func (line);
+		}
+		return;
+	}
+
+	unsigned int numtasks = (numlines + LINES_PER_TASK - 1) / LINES_PER_TASK;
+	std::atomic<unsigned int> remaining (numtasks);
+
+	for (unsigned int start = 0; start < numlines; start += LINES_PER_TASK)
+	{
+		unsigned int end = MIN (start + LINES_PER_TASK, numlines);
+
+		pool->Submit ([&func, &remaining, start, end]()
+		{
+			for (unsigned int line = start; line < end; ++line)
+			{
+				func (line);
+			}
+			remaining--;
+		});
+	}
+	pool->WaitUntil ([&remaining]() { return remaining == 0; });
+}
+
 void FBlockmapBuilder::BuildBlockmap ()
 {
-	TArray<uint16_t> *BlockLists, *block, *endblock;
 	uint16_t adder;
 	int bmapwidth, bmapheight;
 	int minx, maxx, miny, maxy;
-	uint16_t line;
 
 	if (Level.NumVertices <= 0)
 		return;
@@ -208,132 +366,77 @@ void FBlockmapBuilder::BuildBlockmap ()
 	adder = uint16_t(bmapwidth);	BlockMap.Push (adder);
 	adder = uint16_t(bmapheight);	BlockMap.Push (adder);
 
-	BlockLists = new TArray<uint16_t>[bmapwidth * bmapheight];
+	// The cells are filled in two passes over the lines: The first counts how
+	// many cells each line touches, and the second writes them out. Since every
+	// line knows where its cells go before the second pass starts, both passes
+	// can work on many lines at once.
+	unsigned int numlines = Level.NumLines();
+	int numcells = bmapwidth * bmapheight;
+	int threads = ThreadPool::GetThreadCount (NumThreads);
+	std::unique_ptr<ThreadPool> pool;
+	TArray<unsigned int> linestart, hits, fill;
+	FCellLists cells;
+
+	if (threads > 1 && numlines >= MIN_PARALLEL_LINES)
+	{
+		pool.reset (new ThreadPool (threads - 1));
+	}
 
-	for (line = 0; line < Level.NumLines(); ++line)
+	linestart.Resize (numlines + 1);
+	ForEachLine (pool.get(), numlines, [&](unsigned int line)
 	{
-		int x1 = Level.Vertices[Level.Lines[line].v1].x >> FRACBITS;
-		int y1 = Level.Vertices[Level.Lines[line].v1].y >> FRACBITS;
-		int x2 = Level.Vertices[Level.Lines[line].v2].x >> FRACBITS;
-		int y2 = Level.Vertices[Level.Lines[line].v2].y >> FRACBITS;
-		int dx = x2 - x1;
-		int dy = y2 - y1;
-		int bx = (x1 - minx) >> BLOCKBITS;
-		int by = (y1 - miny) >> BLOCKBITS;
-		int bx2 = (x2 - minx) >> BLOCKBITS;
-		int by2 = (y2 - miny) >> BLOCKBITS;
-
-		block = &BlockLists[bx + by * bmapwidth];
-		endblock = &BlockLists[bx2 + by2 * bmapwidth];
-
-		if (block == endblock)	// Single block
-		{
-			block->Push (line);
-		}
-		else if (by == by2)		// Horizontal line
-		{
-			if (bx > bx2)
-			{
-				std::swap (block, endblock);
-			}
-			do
-			{
-				block->Push (line);
-				block += 1;
-			} while (block <= endblock);
-		}
-		else if (bx == bx2)	// Vertical line
-		{
-			if (by > by2)
-			{
-				std::swap (block, endblock);
-			}
-			do
-			{
-				block->Push (line);
-				block += bmapwidth;
-			} while (block <= endblock);
-		}
-		else				// Diagonal line
-		{
-			int xchange = (dx < 0) ? -1 : 1;
-			int ychange = (dy < 0) ? -1 : 1;
-			int ymove = ychange * bmapwidth;
-			int adx = abs (dx);
-			int ady = abs (dy);
+		unsigned int count = 0;
+		RasterizeLine (Level, line, minx, miny, bmapwidth, [&count](int) { count++; });
+		linestart[line] = count;
+	});
 
-			if (adx == ady)		// 45 degrees
-			{
-				int xb = (x1 - minx) & (BLOCKSIZE-1);
-				int yb = (y1 - miny) & (BLOCKSIZE-1);
-				if (dx < 0)
-				{
-					xb = BLOCKSIZE-xb;
-				}
-				if (dy < 0)
-				{
-					yb = BLOCKSIZE-yb;
-				}
-				if (xb < yb)
-					adx--;
-			}
-			if (adx >= ady)		// X-major
-			{
-				int yadd = dy < 0 ? -1 : BLOCKSIZE;
-				do
-				{
-					int stop = (Scale ((by << BLOCKBITS) + yadd - (y1 - miny), dx, dy) + (x1 - minx)) >> BLOCKBITS;
-					while (bx != stop)
-					{
-						block->Push (line);
-						block += xchange;
-						bx += xchange;
-					}
-					block->Push (line);
-					block += ymove;
-					by += ychange;
-				} while (by != by2);
-				while (block != endblock)
-				{
-					block->Push (line);
-					block += xchange;
-				}
-				block->Push (line);
-			}
-			else					// Y-major
-			{
-				int xadd = dx < 0 ? -1 : BLOCKSIZE;
-				do
-				{
-					int stop = (Scale ((bx << BLOCKBITS) + xadd - (x1 - minx), dy, dx) + (y1 - miny)) >> BLOCKBITS;
-					while (by != stop)
-					{
-						block->Push (line);
-						block += ymove;
-						by += ychange;
-					}
-					block->Push (line);
-					block += xchange;
-					bx += xchange;
-				} while (bx != bx2);
-				while (block != endblock)
-				{
-					block->Push (line);
-					block += ymove;
-				}
-				block->Push (line);
-			}
+	unsigned int numhits = 0;
+	for (unsigned int line = 0; line < numlines; ++line)
+	{
+		unsigned int count = linestart[line];
+		linestart[line] = numhits;
+		numhits += count;
+	}
+	linestart[numlines] = numhits;
+
+	hits.Resize (numhits);
+	ForEachLine (pool.get(), numlines, [&](unsigned int line)
+	{
+		unsigned int *hit = hits.Data() + linestart[line];
+		RasterizeLine (Level, line, minx, miny, bmapwidth, [&hit](int block) { *hit++ = block; });
+	});
+	pool.reset ();
+
+	// Group the hits by cell. Going through them in line order keeps each
+	// cell's lines in the same order as a line-by-line build would.
+	cells.Offsets.Resize (numcells + 1);
+	memset (&cells.Offsets[0], 0, (numcells + 1) * sizeof(unsigned int));
+	for (unsigned int i = 0; i < numhits; ++i)
+	{
+		cells.Offsets[hits[i] + 1]++;
+	}
+	for (int i = 0; i < numcells; ++i)
+	{
+		cells.Offsets[i + 1] += cells.Offsets[i];
+	}
+
+	fill.Resize (numcells);
+	memcpy (&fill[0], &cells.Offsets[0], numcells * sizeof(unsigned int));
+	cells.Lines.Resize (numhits);
+	for (unsigned int line = 0; line < numlines; ++line)
+	{
+		for (unsigned int i = linestart[line]; i < linestart[line + 1]; ++i)
+		{
+			cells.Lines[fill[hits[i]]++] = uint16_t(line);
 		}
 	}
 
-	BlockMap.Reserve (bmapwidth * bmapheight);
-	CreatePackedBlockmap (BlockLists, bmapwidth, bmapheight);
-	delete[] BlockLists;
+	BlockMap.Reserve (numcells);
+	CreatePackedBlockmap (cells, bmapwidth, bmapheight);
 }
 
-void FBlockmapBuilder::CreateUnpackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight)
+void FBlockmapBuilder::CreateUnpackedBlockmap (const FCellLists &cells, int bmapwidth, int bmapheight)
 {
-	TArray<uint16_t> *block;
 	uint16_t zero = 0;
 	uint16_t terminator = 0xffff;
 
@@ -341,102 +444,82 @@ void FBlockmapBuilder::CreateUnpackedBlockmap (TArray<uint16_t> *blocks, int bma
 	{
 		BlockMap[4+i] = uint16_t(BlockMap.Size());
 		BlockMap.Push (zero);
-		block = &blocks[i];
-		for (unsigned int j = 0; j < block->Size(); ++j)
+		for (unsigned int j = cells.Offsets[i]; j < cells.Offsets[i+1]; ++j)
 		{
-			BlockMap.Push ((*block)[j]);
+			BlockMap.Push (cells.Lines[j]);
 		}
 		BlockMap.Push (terminator);
 	}
 }
 
-static unsigned int BlockHash (TArray<uint16_t> *block)
+static unsigned int BlockHash (const uint16_t *ar, unsigned int size)
 {
-	int hash = 0;
-	uint16_t *ar = &(*block)[0];
-	for (size_t i = 0; i < block->Size(); ++i)
+	unsigned int hash = 0;
+	for (unsigned int i = 0; i < size; ++i)
 	{
 		hash = hash * 12235 + ar[i];
 	}
-	return hash & 0x7fffffff;
+	return hash;
 }
 
-static bool BlockCompare (TArray<uint16_t> *block1, TArray<uint16_t> *block2)
-{
-	size_t size = block1->Size();
-
-	if (size != block2->Size())
-	{
-		return false;
-	}
-	if (size == 0)
-	{
-		return true;
-	}
-	uint16_t *ar1 = &(*block1)[0];
-	uint16_t *ar2 = &(*block2)[0];
-	for (size_t i = 0; i < size; ++i)
-	{
-		if (ar1[i] != ar2[i])
-		{
-			return false;
-		}
-	}
-	return true;
-}
+// Cells that have exactly the same lines share one list in the lump. The
+// table holds the first cell with each list, and is kept at most half full.
 
-void FBlockmapBuilder::CreatePackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight)
+void FBlockmapBuilder::CreatePackedBlockmap (const FCellLists &cells, int bmapwidth, int bmapheight)
 {
-	uint16_t buckets[4096];
-	uint16_t *hashes, hashblock;
-	TArray<uint16_t> *block;
+	TArray<int> table;
 	uint16_t zero = 0;
 	uint16_t terminator = 0xffff;
-	uint16_t *array;
-	int i, hash;
+	int numcells = bmapwidth * bmapheight;
+	int tablebits = 1;
 	int hashed = 0, nothashed = 0;
 
-	hashes = new uint16_t[bmapwidth * bmapheight];
+	while ((1 << tablebits) < numcells * 2)
+	{
+		tablebits++;
+	}
+	unsigned int mask = (1u << tablebits) - 1;
 
-	memset (hashes, 0xff, sizeof(uint16_t)*bmapwidth*bmapheight);
-	memset (buckets, 0xff, sizeof(buckets));
+	table.Resize (mask + 1);
+	memset (&table[0], 0xff, table.Size() * sizeof(int));
 
-	for (i = 0; i < bmapwidth * bmapheight; ++i)
+	for (int i = 0; i < numcells; ++i)
 	{
-		block = &blocks[i];
-		hash = BlockHash (block) % 4096;
-		hashblock = buckets[hash];
-		while (hashblock != 0xffff)
+		unsigned int start = cells.Offsets[i];
+		unsigned int size = cells.Offsets[i+1] - start;
+		const uint16_t *lines = cells.Lines.Data() + start;
+		unsigned int slot = (BlockHash (lines, size) * 0x9E3779B9u) >> (32 - tablebits);
+		int match;
+
+		while ((match = table[slot]) >= 0)
 		{
-			if (BlockCompare (block, &blocks[hashblock]))
+			unsigned int matchstart = cells.Offsets[match];
+			if (cells.Offsets[match+1] - matchstart == size &&
+				(size == 0 || memcmp (cells.Lines.Data() + matchstart, lines, size * sizeof(uint16_t)) == 0))
 			{
 				break;
 			}
-			hashblock = hashes[hashblock];
+			slot = (slot + 1) & mask;
 		}
-		if (hashblock != 0xffff)
+		if (match >= 0)
 		{
-			BlockMap[4+i] = BlockMap[4+hashblock];
+			BlockMap[4+i] = BlockMap[4+match];
 			hashed++;
 		}
 		else
 		{
-			hashes[i] = buckets[hash];
-			buckets[hash] = uint16_t(i);
+			table[slot] = i;
 			BlockMap[4+i] = uint16_t(BlockMap.Size());
-			BlockMap.Push (zero);
-			array = &(*block)[0];
-			for (size_t j = 0; j < block->Size(); ++j)
+			unsigned int pos = BlockMap.Reserve (size + 2);
+			BlockMap[pos] = zero;
+			if (size > 0)
 			{
-				BlockMap.Push (array[j]);
+				memcpy (&BlockMap[pos+1], lines, size * sizeof(uint16_t));
 			}
-			BlockMap.Push (terminator);
+			BlockMap[pos+size+1] = terminator;
 			nothashed++;
 		}
 	}
 
-	delete[] hashes;
-
 //	printf ("%d blocks written, %d blocks saved\n", nothashed, hashed);
 }
-
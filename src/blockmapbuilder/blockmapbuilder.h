@@ -1,4 +1,3 @@
-
 #pragma once
 
 #include "level/doomdata.h"
@@ -12,10 +11,18 @@ public:
 	uint16_t *GetBlockmap (int &size);
 
 private:
+	// Every cell's lines, stored back to back. Cell i's lines are
+	// Lines[Offsets[i]] up to, but not including, Lines[Offsets[i+1]].
+	struct FCellLists
+	{
+		TArray<unsigned int> Offsets;
+		TArray<uint16_t> Lines;
+	};
+
 	FLevel &Level;
 	TArray<uint16_t> BlockMap;
 
 	void BuildBlockmap ();
-	void CreateUnpackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight);
-	void CreatePackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight);
+	void CreateUnpackedBlockmap (const FCellLists &cells, int bmapwidth, int bmapheight);
+	void CreatePackedBlockmap (const FCellLists &cells, int bmapwidth, int bmapheight);
 };
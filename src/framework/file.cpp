@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #ifndef PATH_MAX
 #define PATH_MAX 1024
 #endif
@@ -272,6 +274,32 @@ bool File::try_remove(const std::string& filename)
 
 /////////////////////////////////////////////////////////////////////////////
 
+#ifndef WIN32
+// Lists the entries matching a search pattern such as "maps/*.wad", like FindFirstFile does on Windows
+static std::vector<std::string> find_entries(const std::string& search, bool directories)
+{
+	std::string path = FilePath::remove_last_component(search);
+	std::string pattern = FilePath::last_component(search);
+
+	DIR* dir = opendir(path.empty() ? "." : path.c_str());
+	if (!dir)
+		return {};
+
+	std::vector<std::string> entries;
+	while (dirent* entry = readdir(dir))
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || fnmatch(pattern.c_str(), entry->d_name, 0) != 0)
+			continue;
+
+		struct stat info;
+		if (stat(FilePath::combine(path, entry->d_name).c_str(), &info) == 0 && S_ISDIR(info.st_mode) == directories)
+			entries.push_back(entry->d_name);
+	}
+	closedir(dir);
+	return entries;
+}
+#endif
+
 std::vector<std::string> Directory::files(const std::string& filename)
 {
 #ifdef WIN32
@@ -300,7 +328,7 @@ std::vector<std::string> Directory::files(const std::string& filename)
 
 	return files;
 #else
-	throw std::runtime_error("Directory::files not implemented");
+	return find_entries(filename, false);
 #endif
 }
 
@@ -336,7 +364,7 @@ std::vector<std::string> Directory::folders(const std::string& filename)
 
 	return files;
 #else
-	throw std::runtime_error("Directory::folders not implemented");
+	return find_entries(filename, true);
 #endif
 }
 
@@ -232,6 +232,14 @@ void FFileSystem::AddWadSource(const FString& filename)
 	Sources.push_back(std::make_unique<WadFileSystemSource>(filename));
 }
 
+int FFileSystem::GetFileCount() const
+{
+	int count = 0;
+	for (auto& source : Sources)
+		count += source->GetLumpCount();
+	return count;
+}
+
 int FFileSystem::CheckNumForFullName(const FString& fullname)
 {
 	int pos = 0;
@@ -30,6 +30,7 @@ public:
 	void AddFolderSource(const FString& foldername);
 	void AddWadSource(const FString& filename);
 
+	int GetFileCount() const;
 	int CheckNumForFullName(const FString& fullname);
 	int FileLength(int lump);
 	FileData ReadFile(int lump);
@@ -0,0 +1,131 @@
+
+#include "profiler.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stdio.h>
+#include <vector>
+
+namespace
+{
+	struct ProfileEvent
+	{
+		const char *Name;
+		std::string Detail;
+		int64_t Start;
+		int64_t End;
+	};
+
+	// A thread's buffer is kept after the thread exits, so its zones still get written.
+	struct ThreadEvents
+	{
+		int ThreadID;
+		std::string Name;
+		std::vector<ProfileEvent> Events;
+	};
+}
+
+std::atomic<bool> Profiler::Active;
+
+static std::mutex ThreadsMutex;
+static std::vector<std::unique_ptr<ThreadEvents>> Threads;
+static thread_local ThreadEvents *CurrentThread;
+static std::chrono::steady_clock::time_point StartTime;
+
+static ThreadEvents *GetThreadEvents()
+{
+	if (!CurrentThread)
+	{
+		std::unique_lock<std::mutex> lock(ThreadsMutex);
+		Threads.push_back(std::make_unique<ThreadEvents>());
+		CurrentThread = Threads.back().get();
+		CurrentThread->ThreadID = (int)Threads.size();
+	}
+	return CurrentThread;
+}
+
+static void WriteString(FILE *file, const std::string &str)
+{
+	fputc('"', file);
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if ((unsigned char)c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+void Profiler::Start()
+{
+	std::unique_lock<std::mutex> lock(ThreadsMutex);
+	for (auto &thread : Threads)
+		thread->Events.clear();
+	StartTime = std::chrono::steady_clock::now();
+	Active = true;
+}
+
+void Profiler::Stop(const char *filename)
+{
+	Active = false;
+
+	std::unique_lock<std::mutex> lock(ThreadsMutex);
+
+	FILE *file = fopen(filename, "w");
+	if (!file)
+		throw std::runtime_error("Could not write the profile");
+
+	// Complete ("X") events take microseconds. One metadata ("M") event per thread names it.
+	bool first = true;
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (const auto &thread : Threads)
+	{
+		if (thread->Events.empty())
+			continue;
+
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", thread->ThreadID);
+		WriteString(file, thread->Name.empty() ? "Thread " + std::to_string(thread->ThreadID) : thread->Name);
+		fprintf(file, "}}");
+		first = false;
+
+		for (const ProfileEvent &event : thread->Events)
+		{
+			fprintf(file, ",\n{\"name\":");
+			WriteString(file, event.Name);
+			fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", thread->ThreadID, event.Start / 1000.0, (event.End - event.Start) / 1000.0);
+			if (!event.Detail.empty())
+			{
+				fprintf(file, ",\"args\":{\"detail\":");
+				WriteString(file, event.Detail);
+				fprintf(file, "}");
+			}
+			fprintf(file, "}");
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+}
+
+void Profiler::SetThreadName(const char *name)
+{
+	if (!IsActive())
+		return;
+
+	ThreadEvents *thread = GetThreadEvents();
+	std::unique_lock<std::mutex> lock(ThreadsMutex);
+	thread->Name = name;
+}
+
+int64_t Profiler::Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - StartTime).count();
+}
+
+void Profiler::AddZone(const char *name, const std::string &detail, int64_t start, int64_t end)
+{
+	GetThreadEvents()->Events.push_back({ name, detail, start, end });
+}
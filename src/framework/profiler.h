@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// Records how long named zones of code take, and on which thread, and writes
+// them out as a trace that chrome://tracing and Perfetto can open.
+//
+// PROFILE_ZONE("name") times the rest of the enclosing block. Until Start is
+// called a zone costs a single flag test. Every thread records into a buffer of
+// its own, so zones can be used anywhere, but Stop must not be called while other
+// threads are still inside one.
+class Profiler
+{
+public:
+	static void Start();
+
+	// Writes every zone recorded since Start to filename and stops recording.
+	static void Stop(const char *filename);
+
+	static bool IsActive() { return Active.load(std::memory_order_relaxed); }
+
+	// Names the calling thread in the trace. Threads without a name are shown by
+	// number. Does nothing unless recording, so short-lived threads cost nothing.
+	static void SetThreadName(const char *name);
+
+	// Nanoseconds since Start.
+	static int64_t Now();
+
+	static void AddZone(const char *name, const std::string &detail, int64_t start, int64_t end);
+
+private:
+	static std::atomic<bool> Active;
+};
+
+class ProfileZone
+{
+public:
+	// The name must be a string that outlives the profiler, such as a literal.
+	// The detail, such as a map name, is copied and shown with the zone.
+	ProfileZone(const char *name, const char *detail = nullptr) : Name(Profiler::IsActive() ? name : nullptr)
+	{
+		if (Name)
+		{
+			if (detail)
+				Detail = detail;
+			Start = Profiler::Now();
+		}
+	}
+
+	~ProfileZone()
+	{
+		if (Name)
+			Profiler::AddZone(Name, Detail, Start, Profiler::Now());
+	}
+
+private:
+	ProfileZone(const ProfileZone &) = delete;
+	ProfileZone &operator=(const ProfileZone &) = delete;
+
+	const char *Name;
+	std::string Detail;
+	int64_t Start = 0;
+};
+
+#define PROFILE_ZONE_NAME2(line) profileZone##line
+#define PROFILE_ZONE_NAME(line) PROFILE_ZONE_NAME2(line)
+#define PROFILE_ZONE(...) ProfileZone PROFILE_ZONE_NAME(__LINE__)(__VA_ARGS__)
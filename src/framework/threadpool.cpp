@@ -0,0 +1,143 @@
+
+#include "threadpool.h"
+#include "profiler.h"
+
+static thread_local const ThreadPool *CurrentPool;
+static thread_local int CurrentSlot;
+
+ThreadPool::ThreadPool(int numWorkers)
+{
+	if (numWorkers < 1)
+		numWorkers = 1;
+
+	for (int i = 0; i <= numWorkers; i++)
+		Queues.push_back(std::make_unique<TaskQueue>());
+
+	for (int i = 1; i <= numWorkers; i++)
+		Workers.push_back(std::thread([=]() { WorkerMain(i); }));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(SleepMutex);
+		Stopping = true;
+	}
+	WorkAvailable.notify_all();
+
+	for (std::thread& worker : Workers)
+		worker.join();
+}
+
+int ThreadPool::GetThreadCount(int requested)
+{
+	if (requested > 0)
+		return requested;
+	int count = (int)std::thread::hardware_concurrency();
+	return count > 0 ? count : 1;
+}
+
+int ThreadPool::GetCurrentSlot() const
+{
+	return CurrentPool == this ? CurrentSlot : 0;
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	TaskQueue& queue = *Queues[GetCurrentSlot()];
+	{
+		std::unique_lock<std::mutex> lock(queue.Mutex);
+		queue.Tasks.push_back(std::move(task));
+	}
+	{
+		std::unique_lock<std::mutex> lock(SleepMutex);
+		QueuedTasks++;
+	}
+	WorkAvailable.notify_one();
+}
+
+bool ThreadPool::PopTask(int slot, std::function<void()>& task)
+{
+	// Newest task from our own queue first, as it is the most likely to still be in the cache.
+	if (slot != 0)
+	{
+		TaskQueue& queue = *Queues[slot];
+		std::unique_lock<std::mutex> lock(queue.Mutex);
+		if (!queue.Tasks.empty())
+		{
+			task = std::move(queue.Tasks.back());
+			queue.Tasks.pop_back();
+			return true;
+		}
+	}
+
+	// Steal the oldest task from someone else. Start at a different queue every time to spread the contention.
+	int count = (int)Queues.size();
+	int start = (int)(StealStart++ % (unsigned int)count);
+	for (int i = 0; i < count; i++)
+	{
+		int victim = (start + i) % count;
+		if (victim == slot && slot != 0)
+			continue;
+
+		TaskQueue& queue = *Queues[victim];
+		std::unique_lock<std::mutex> lock(queue.Mutex);
+		if (!queue.Tasks.empty())
+		{
+			task = std::move(queue.Tasks.front());
+			queue.Tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::RunOneTask()
+{
+	std::function<void()> task;
+	if (!PopTask(GetCurrentSlot(), task))
+		return false;
+
+	QueuedTasks--;
+	task();
+	FinishTask();
+	return true;
+}
+
+void ThreadPool::FinishTask()
+{
+	{
+		std::unique_lock<std::mutex> lock(SleepMutex);
+	}
+	TaskFinished.notify_all();
+}
+
+void ThreadPool::WaitUntil(const std::function<bool()>& done)
+{
+	while (!done())
+	{
+		if (RunOneTask())
+			continue;
+
+		std::unique_lock<std::mutex> lock(SleepMutex);
+		TaskFinished.wait(lock, [&]() { return QueuedTasks > 0 || done(); });
+	}
+}
+
+void ThreadPool::WorkerMain(int slot)
+{
+	CurrentPool = this;
+	CurrentSlot = slot;
+	Profiler::SetThreadName(("Worker " + std::to_string(slot)).c_str());
+
+	while (true)
+	{
+		if (RunOneTask())
+			continue;
+
+		std::unique_lock<std::mutex> lock(SleepMutex);
+		WorkAvailable.wait(lock, [&]() { return QueuedTasks > 0 || Stopping; });
+		if (Stopping && QueuedTasks <= 0)
+			break;
+	}
+}
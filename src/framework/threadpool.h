@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool.
+//
+// Every worker owns a deque of tasks. A worker pops its own tasks from the back
+// and, once it runs dry, steals from the front of the shared deque and the other
+// workers' deques. Threads outside the pool queue their tasks on the shared deque.
+// A thread waiting for a result should use WaitUntil so it keeps running queued
+// tasks instead of blocking.
+class ThreadPool
+{
+public:
+	ThreadPool(int numWorkers);
+	~ThreadPool();
+
+	// Number of threads to use for a --threads value. Zero or less means one per hardware thread.
+	static int GetThreadCount(int requested);
+
+	int GetWorkerCount() const { return (int)Workers.size(); }
+
+	// 1 to GetWorkerCount() when called from one of this pool's workers, 0 from any other thread.
+	// Useful for indexing per-thread scratch space.
+	int GetCurrentSlot() const;
+
+	void Submit(std::function<void()> task);
+
+	// Runs one queued task on the calling thread. Returns false if none was available.
+	bool RunOneTask();
+
+	// Runs queued tasks on the calling thread until done returns true.
+	void WaitUntil(const std::function<bool()> &done);
+
+private:
+	struct TaskQueue
+	{
+		std::mutex Mutex;
+		std::deque<std::function<void()>> Tasks;
+	};
+
+	void WorkerMain(int slot);
+	bool PopTask(int slot, std::function<void()> &task);
+	void FinishTask();
+
+	std::vector<std::thread> Workers;
+	std::vector<std::unique_ptr<TaskQueue>> Queues;	// [0] is the shared queue, [slot] belongs to a worker
+	std::atomic<unsigned int> StealStart = { 0 };
+
+	std::mutex SleepMutex;
+	std::condition_variable WorkAvailable;
+	std::condition_variable TaskFinished;
+	std::atomic<int> QueuedTasks = { 0 };
+	bool Stopping = false;
+};
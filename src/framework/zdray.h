@@ -22,20 +22,34 @@ enum ERejectMode
 	ERM_Rebuild
 };
 
+enum ESplitterMode
+{
+	ESM_Thorough,
+	ESM_Fast
+};
+
 extern const char		*Map;
 extern const char		*InName;
 extern const char		*OutName;
+extern const char		*NodeCacheFile;
+extern const char		*UDMFCacheDir;
 extern bool				 BuildNodes, BuildGLNodes, ConformNodes, GLOnly, WriteComments;
 extern bool				 NoPrune;
+extern bool				 NoTiming;
 extern EBlockmapMode	 BlockmapMode;
 extern ERejectMode		 RejectMode;
+extern ESplitterMode	 SplitterMode;
+extern bool				 ExactSides;
 extern int				 MaxSegs;
 extern int				 SplitCost;
 extern int				 AAPreference;
 extern bool				 CheckPolyobjs;
 extern bool				 CompressNodes, CompressGLNodes, ForceCompression, V5GLNodes;
-extern bool				 HaveSSE1, HaveSSE2;
+extern bool				 HaveSSE1, HaveSSE2, HaveAVX2;
 extern int				 SSELevel;
+extern int				 NumThreads;
+extern bool				 BuildGLPVS;
+extern double			 PVSMaxDistance, PVSTimeLimit;
 
 
 #define FIXED_MAX		INT_MAX
@@ -10,6 +10,7 @@
 #include <memory>
 #include <cmath>
 #include <optional>
+#include <string_view>
 #undef MIN
 #undef MAX
 #undef min
@@ -23,10 +24,58 @@ enum
 	BOXTOP, BOXBOTTOM, BOXLEFT, BOXRIGHT
 };
 
+#define DEFINE_UDMFKEY(name) UDMF_##name,
+
+enum EUDMFKey
+{
+#include "udmfkeys.h"
+	NUM_UDMF_KEYS	// keys that are not in the list get atoms from here up
+};
+#undef DEFINE_UDMFKEY
+
+// Returns the atom for a key, which is the same for every map
+int InternUDMFKey(std::string_view key);
+
 struct UDMFKey
 {
 	const char *key;
 	const char *value;
+	int atom;
+};
+
+// The UDMF properties of a map object, in the order they were read.
+class UDMFProps
+{
+public:
+	void Push(const UDMFKey &key)
+	{
+		Present |= 1ull << (key.atom & 63);
+		Keys.Push(key);
+	}
+
+	// Returns the last property with this key, or nullptr. Present has a bit
+	// for every atom in the list, modulo 64, so most keys an object does not
+	// have are rejected without looking at its properties at all.
+	const UDMFKey *Find(int atom) const
+	{
+		if (Present & (1ull << (atom & 63)))
+		{
+			for (unsigned int i = Keys.Size(); i-- > 0; )
+			{
+				if (Keys[i].atom == atom) return &Keys[i];
+			}
+		}
+		return nullptr;
+	}
+
+	unsigned int Size() const { return Keys.Size(); }
+	const UDMFKey &operator[](unsigned int index) const { return Keys[index]; }
+	auto begin() const { return Keys.begin(); }
+	auto end() const { return Keys.end(); }
+
+private:
+	TArray<UDMFKey> Keys;
+	uint64_t Present = 0;
 };
 
 struct MapVertex
@@ -97,7 +146,7 @@ struct IntSideDef
 	IntLineDef *line;
 
 	SideDefSampleProps sampling;
-	TArray<UDMFKey> props;
+	UDMFProps props;
 
 	FTextureID GetTexture(WallPart part)
 	{
@@ -161,7 +210,7 @@ struct IntLineDef
 	int args[5] = {};
 	uint32_t sidenum[2] = {NO_INDEX, NO_INDEX};
 
-	TArray<UDMFKey> props;
+	UDMFProps props;
 	TArray<int> ids;
 
 	IntSideDef* sidedef[2] = { nullptr, nullptr };
@@ -229,7 +278,7 @@ struct IntSector
 		struct { bool skyFloor, skyCeiling; };
 	};
 
-	TArray<UDMFKey> props;
+	UDMFProps props;
 
 	TArray<IntLineDef*> lines;
 	TArray<IntLineDef*> portals;
@@ -395,12 +444,12 @@ struct IntThing
 	float height = 0; // UDMF
 	float alpha = 1.0;
 
-	TArray<UDMFKey> props;
+	UDMFProps props;
 };
 
 struct IntVertex
 {
-	TArray<UDMFKey> props;
+	UDMFProps props;
 	double zfloor = 100000, zceiling = 100000;
 
 	inline bool HasZFloor() const { return zfloor != 100000; }
@@ -604,7 +653,7 @@ struct FLevel
 
 	fixed_t MinX, MinY, MaxX, MaxY;
 
-	TArray<UDMFKey> props;
+	UDMFProps props;
 
 	TArray<ThingLight> ThingLights;
 
@@ -20,8 +20,12 @@
 
 #include "level/level.h"
 #include "lightmapper/gpuraytracer.h"
-//#include "rejectbuilder.h"
+#include "framework/profiler.h"
+#include "rejectbuilder/rejectbuilder.h"
+#include "pvsbuilder/pvsbuilder.h"
 #include <memory>
+#include <thread>
+#include <exception>
 
 #ifdef _MSC_VER
 #pragma warning(disable: 4267) // warning C4267: 'argument': conversion from 'size_t' to 'int', possible loss of data
@@ -66,9 +70,9 @@ FLevel::~FLevel ()
 	if (OrgSectorMap)	delete[] OrgSectorMap;
 }
 
-FProcessor::FProcessor (FWadReader &inwad, int lump)
+FProcessor::FProcessor (FWadReader &inwad, int lump, FNodeCache *nodeCache)
 :
-  Wad (inwad), Lump (lump)
+  Wad (inwad), Lump (lump), NodeCache (nodeCache)
 {
 	printf ("----%s----\n", Wad.LumpName (Lump));
 
@@ -743,35 +747,59 @@ void FLevel::PostLoadInitialization()
 
 void FProcessor::BuildNodes()
 {
+	PROFILE_ZONE("BuildNodes", Wad.LumpName(Lump));
 	NodesBuilt = true;
 
 	FNodeBuilder *builder = nullptr;
+	FNodeBuilder *normalBuilder = nullptr;
+	FLevel normalLevel;
+	std::thread normalThread;
+	std::exception_ptr normalError;
+	unsigned int eventAllocations = 0;
+	unsigned int numSets = 0, cacheHits = 0;
+	int threads = ThreadPool::GetThreadCount(NumThreads);
+	int normalThreads = 0;
 
 	// ZDoom's UDMF spec requires compressed GL nodes.
 	// No other UDMF spec has defined anything regarding nodes yet.
-	if (isUDMF)
-	{
-		BuildGLNodes = true;
-		ConformNodes = false;
-		GLOnly = true;
-		CompressGLNodes = true;
-	}
+	// Decide that here instead of changing the options, since the next map
+	// might not be UDMF, and other maps might be building at the same time.
+	const bool buildGL = BuildGLNodes || isUDMF;
+	const bool conform = ConformNodes && !isUDMF;
+	const bool glOnly = GLOnly || isUDMF;
 
 	try
 	{
-		if (HaveSSE2)
-		{
-			SSELevel = 2;
-		}
-		else if (HaveSSE1)
-		{
-			SSELevel = 1;
-		}
-		else
-		{
-			SSELevel = 0;
+		if (buildGL && !glOnly && !conform && threads > 1)
+		{
+			// The regular nodes do not depend on the GL nodes, so build them on
+			// another thread at the same time. That thread gets its own copy of
+			// the vertices and lines, since the node builder renumbers them. It
+			// numbers them the same way both times, so the lines still match.
+			// The two builders split the threads between them.
+			normalThreads = threads / 2;
+			threads -= normalThreads;
+			normalLevel.Vertices = new WideVertex[Level.NumVertices];
+			normalLevel.NumVertices = Level.NumVertices;
+			memcpy(normalLevel.Vertices, Level.Vertices, Level.NumVertices * sizeof(WideVertex));
+			normalLevel.Lines = Level.Lines;
+			normalLevel.Sides = Level.Sides;
+
+			const char *name = Wad.LumpName(Lump);
+			normalThread = std::thread([&, name]() {
+				Profiler::SetThreadName("Regular nodes");
+				try
+				{
+					normalBuilder = new FNodeBuilder(normalLevel, PolyStarts, PolyAnchors, name, false, NodeCache, normalThreads);
+				}
+				catch (...)
+				{
+					normalError = std::current_exception();
+				}
+			});
 		}
-		builder = new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), BuildGLNodes);
+
+		builder = new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), buildGL, NodeCache, threads);
 		if (builder == nullptr)
 		{
 			throw std::runtime_error("   Not enough memory to build nodes!");
@@ -780,7 +808,7 @@ void FProcessor::BuildNodes()
 		delete[] Level.Vertices;
 		builder->GetVertices(Level.Vertices, Level.NumVertices);
 
-		if (ConformNodes)
+		if (conform)
 		{
 			// When the nodes are "conformed", the normal and GL nodes use the same
 			// basic information. This creates normal nodes that are less "good" than
@@ -792,34 +820,77 @@ void FProcessor::BuildNodes()
 		}
 		else
 		{
-			if (BuildGLNodes)
+			if (buildGL)
 			{
 				builder->GetVertices(Level.GLVertices, Level.NumGLVertices);
 				builder->GetGLNodes(Level.GLNodes, Level.NumGLNodes, Level.GLSegs, Level.NumGLSegs, Level.GLSubsectors, Level.NumGLSubsectors);
 
-				if (!GLOnly)
+				if (!glOnly)
 				{
 					// Now repeat the process to obtain regular nodes
+					eventAllocations += builder->GetEventAllocations();
+					numSets += builder->GetNumSets();
+					cacheHits += builder->GetCacheHits();
 					delete builder;
-					builder = new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), false);
-					if (builder == nullptr)
+					builder = nullptr;
+					if (normalThread.joinable())
 					{
-						throw std::runtime_error("   Not enough memory to build regular nodes!");
+						normalThread.join();
+						if (normalError)
+						{
+							std::rethrow_exception(normalError);
+						}
+						builder = normalBuilder;
+						normalBuilder = nullptr;
+
+						// GetNodes looks up vertices in the level it was built from.
+						delete[] normalLevel.Vertices;
+						builder->GetVertices(normalLevel.Vertices, normalLevel.NumVertices);
+					}
+					else
+					{
+						builder = new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), false, NodeCache);
+						if (builder == nullptr)
+						{
+							throw std::runtime_error("   Not enough memory to build regular nodes!");
+						}
 					}
 					delete[] Level.Vertices;
 					builder->GetVertices(Level.Vertices, Level.NumVertices);
 				}
 			}
-			if (!GLOnly)
+			if (!glOnly)
 			{
 				builder->GetNodes(Level.Nodes, Level.NumNodes, Level.Segs, Level.NumSegs, Level.Subsectors, Level.NumSubsectors);
 			}
 		}
+		eventAllocations += builder->GetEventAllocations();
+		numSets += builder->GetNumSets();
+		cacheHits += builder->GetCacheHits();
 		delete builder;
 		builder = nullptr;
+
+		if (NodeCache != nullptr)
+		{
+			NodeCache->Commit();
+			printf ("   Reused %u of %u splitter choices from the node cache.\n", cacheHits, numSets);
+		}
+
+		if (!NoTiming)
+		{
+			printf ("   %u node builder event allocations.\n", eventAllocations);
+		}
 	}
 	catch (...)
 	{
+		if (normalThread.joinable())
+		{
+			normalThread.join();
+		}
+		if (normalBuilder != nullptr)
+		{
+			delete normalBuilder;
+		}
 		if (builder != nullptr)
 		{
 			delete builder;
@@ -830,6 +901,7 @@ void FProcessor::BuildNodes()
 
 void FProcessor::BuildLightmaps()
 {
+	PROFILE_ZONE("BuildLightmaps", Wad.LumpName(Lump));
 	Level.PostLoadInitialization();
 
 	SpawnSlopeMakers(&Level.Things[0], &Level.Things[Level.Things.Size()], nullptr);
@@ -841,8 +913,11 @@ void FProcessor::BuildLightmaps()
 
 	printf("   Creating level mesh\n");
 	LightmapMesh = std::make_unique<DoomLevelMesh>(Level);
-	LightmapMesh->SetupTileTransforms();
-	LightmapMesh->PackLightmapAtlas(0);
+	{
+		PROFILE_ZONE("PackLightmapAtlas");
+		LightmapMesh->SetupTileTransforms();
+		LightmapMesh->PackLightmapAtlas(0);
+	}
 	LightmapMesh->BeginFrame(Level);
 	printf("   Surfaces: %d\n", LightmapMesh->GetSurfaceCount());
 	printf("   Tiles: %d\n", (int)LightmapMesh->LightmapTiles.Size());
@@ -863,65 +938,34 @@ void FProcessor::DumpMesh()
 	}
 }
 
-void FProcessor::Write (FWadWriter &out)
+bool FProcessor::IsEmpty () const
 {
-	if (Level.NumLines() == 0 || Level.NumSides() == 0 || Level.NumSectors() == 0 || Level.NumVertices == 0)
-	{
-		if (!isUDMF)
-		{
-			// Map is empty, so just copy it as-is
-			out.CopyLump (Wad, Lump);
-			out.CopyLump (Wad, Wad.FindMapLump ("THINGS", Lump));
-			out.CopyLump (Wad, Wad.FindMapLump ("LINEDEFS", Lump));
-			out.CopyLump (Wad, Wad.FindMapLump ("SIDEDEFS", Lump));
-			out.CopyLump (Wad, Wad.FindMapLump ("VERTEXES", Lump));
-			out.CreateLabel ("SEGS");
-			out.CreateLabel ("SSECTORS");
-			out.CreateLabel ("NODES");
-			out.CopyLump (Wad, Wad.FindMapLump ("SECTORS", Lump));
-			out.CreateLabel ("REJECT");
-			out.CreateLabel ("BLOCKMAP");
-			if (Extended)
-			{
-				out.CopyLump (Wad, Wad.FindMapLump ("BEHAVIOR", Lump));
-				out.CopyLump (Wad, Wad.FindMapLump ("SCRIPTS", Lump));
-			}
-		}
-		else
-		{
-			for(int i=Lump; stricmp(Wad.LumpName(i), "ENDMAP") && i < Wad.NumLumps(); i++)
-			{
-				out.CopyLump(Wad, i);
-			}
-			out.CreateLabel("ENDMAP");
-		}
-		return;
-	}
+	return Level.NumLines() == 0 || Level.NumSides() == 0 || Level.NumSectors() == 0 || Level.NumVertices == 0;
+}
 
-	bool compress, compressGL, gl5 = false;
+// The blockmap, reject and GL_PVS only need the nodes, so they are built
+// here, apart from Write. Then they can be built on the same thread as the
+// nodes, while the lightmapper works on another map.
 
-#ifdef BLOCK_TEST
-	int size;
-	uint8_t *blockmap;
-	ReadLump<uint8_t> (Wad, Wad.FindMapLump ("BLOCKMAP", Lump), blockmap, size);
-	if (blockmap)
+void FProcessor::BuildTables ()
+{
+	PROFILE_ZONE ("BuildTables", Wad.LumpName (Lump));
+	TablesBuilt = true;
+
+	if (IsEmpty ())
 	{
-		FILE *f = fopen ("blockmap.lmp", "wb");
-		if (f)
-		{
-			fwrite (blockmap, 1, size, f);
-			fclose (f);
-		}
-		delete[] blockmap;
+		return;
 	}
-#endif
 
 	if (!isUDMF)
 	{
-		FBlockmapBuilder bbuilder (Level);
-		uint16_t *blocks = bbuilder.GetBlockmap (Level.BlockmapSize);
-		Level.Blockmap = new uint16_t[Level.BlockmapSize];
-		memcpy (Level.Blockmap, blocks, Level.BlockmapSize*sizeof(uint16_t));
+		{
+			PROFILE_ZONE ("Blockmap");
+			FBlockmapBuilder bbuilder (Level);
+			uint16_t *blocks = bbuilder.GetBlockmap (Level.BlockmapSize);
+			Level.Blockmap = new uint16_t[Level.BlockmapSize];
+			memcpy (Level.Blockmap, blocks, Level.BlockmapSize*sizeof(uint16_t));
+		}
 
 		Level.RejectSize = (Level.NumSectors()*Level.NumSectors() + 7) / 8;
 		Level.Reject = nullptr;
@@ -929,9 +973,14 @@ void FProcessor::Write (FWadWriter &out)
 		switch (RejectMode)
 		{
 		case ERM_Rebuild:
-			//FRejectBuilder reject (Level);
-			//Level.Reject = reject.GetReject ();
-			printf ("   Rebuilding the reject is unsupported.\n");
+			if (Level.GLSubsectors != nullptr)
+			{
+				PROFILE_ZONE ("Reject");
+				FRejectBuilder reject (Level);
+				Level.Reject = reject.GetReject ();
+				break;
+			}
+			printf ("   The reject can only be rebuilt along with GL nodes.\n");
 			// Intentional fall-through
 
 		case ERM_DontTouch:
@@ -974,6 +1023,81 @@ void FProcessor::Write (FWadWriter &out)
 		}
 	}
 
+	if (BuildGLPVS)
+	{
+		if (Level.GLSubsectors != nullptr)
+		{
+			PROFILE_ZONE ("GL_PVS");
+			FPVSBuilder pvs (Level, PVSMaxDistance, PVSTimeLimit);
+			Level.GLPVS = pvs.GetPVS (Level.GLPVSSize);
+		}
+		else
+		{
+			printf ("   The GL_PVS can only be built along with GL nodes.\n");
+		}
+	}
+}
+
+void FProcessor::Write (FWadWriter &out)
+{
+	PROFILE_ZONE ("Write", Wad.LumpName (Lump));
+
+	if (IsEmpty ())
+	{
+		if (!isUDMF)
+		{
+			// Map is empty, so just copy it as-is
+			out.CopyLump (Wad, Lump);
+			out.CopyLump (Wad, Wad.FindMapLump ("THINGS", Lump));
+			out.CopyLump (Wad, Wad.FindMapLump ("LINEDEFS", Lump));
+			out.CopyLump (Wad, Wad.FindMapLump ("SIDEDEFS", Lump));
+			out.CopyLump (Wad, Wad.FindMapLump ("VERTEXES", Lump));
+			out.CreateLabel ("SEGS");
+			out.CreateLabel ("SSECTORS");
+			out.CreateLabel ("NODES");
+			out.CopyLump (Wad, Wad.FindMapLump ("SECTORS", Lump));
+			out.CreateLabel ("REJECT");
+			out.CreateLabel ("BLOCKMAP");
+			if (Extended)
+			{
+				out.CopyLump (Wad, Wad.FindMapLump ("BEHAVIOR", Lump));
+				out.CopyLump (Wad, Wad.FindMapLump ("SCRIPTS", Lump));
+			}
+		}
+		else
+		{
+			for(int i=Lump; stricmp(Wad.LumpName(i), "ENDMAP") && i < Wad.NumLumps(); i++)
+			{
+				out.CopyLump(Wad, i);
+			}
+			out.CreateLabel("ENDMAP");
+		}
+		return;
+	}
+
+	bool compress, compressGL, gl5 = false;
+
+#ifdef BLOCK_TEST
+	int size;
+	uint8_t *blockmap;
+	ReadLump<uint8_t> (Wad, Wad.FindMapLump ("BLOCKMAP", Lump), blockmap, size);
+	if (blockmap)
+	{
+		FILE *f = fopen ("blockmap.lmp", "wb");
+		if (f)
+		{
+			fwrite (blockmap, 1, size, f);
+			fclose (f);
+		}
+		delete[] blockmap;
+	}
+#endif
+
+	if (!TablesBuilt)
+	{
+		BuildTables ();
+	}
+
 	if (!isUDMF)
 	{
 
@@ -1074,6 +1198,11 @@ void FProcessor::Write (FWadWriter &out)
 			WriteGLSegs (out, gl5);
 			WriteGLSSect (out, gl5);
 			WriteGLNodes (out, gl5);
+			WriteGLPVS (out, false);
+		}
+		else if (Level.GLPVS != nullptr)
+		{
+			printf ("   The GL_PVS can only be written along with uncompressed GL nodes (-Z).\n");
 		}
 	}
 	else
@@ -1615,6 +1744,30 @@ void FProcessor::WriteGLNodes (FWadWriter &out, bool v5)
 	}
 }
 
+// Binary maps get the table as it is, at the end of the GL nodes. UDMF maps
+// keep it in a map lump of its own, compressed the same way as ZNODES.
+
+void FProcessor::WriteGLPVS (FWadWriter &out, bool compress)
+{
+	if (Level.GLPVS == nullptr)
+	{
+		return;
+	}
+	if (!compress)
+	{
+		out.WriteLump ("GL_PVS", Level.GLPVS, Level.GLPVSSize);
+	}
+	else
+	{
+		ZLibOut zout (out);
+
+		out.StartWritingLump ("GL_PVS");
+		out.AddToLump ("ZPVS", 4);
+		zout << (uint32_t)Level.NumGLSubsectors;
+		zout.Write (Level.GLPVS, Level.GLPVSSize);
+	}
+}
+
 void FProcessor::WriteBSPZ (FWadWriter &out, const char *label)
 {
 	ZLibOut zout (out);
@@ -1638,7 +1791,7 @@ void FProcessor::WriteGLBSPZ (FWadWriter &out, const char *label)
 	bool fracsplitters = CheckForFracSplitters(Level.GLNodes, Level.NumGLNodes);
 	int nodever;
 
-	if (!CompressGLNodes)
+	if (!CompressGLNodes && !isUDMF)
 	{
 		printf ("   GL Nodes are so big that compression has been forced.\n");
 	}
@@ -1776,7 +1929,7 @@ void FProcessor::WriteGLBSPX (FWadWriter &out, const char *label)
 	bool fracsplitters = CheckForFracSplitters(Level.GLNodes, Level.NumGLNodes);
 	int nodever;
 
-	if (!CompressGLNodes)
+	if (!CompressGLNodes && !isUDMF)
 	{
 		printf ("   GL Nodes are so big that extended format has been forced.\n");
 	}
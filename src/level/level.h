@@ -8,7 +8,9 @@
 #include "nodebuilder/nodebuild.h"
 #include "blockmapbuilder/blockmapbuilder.h"
 #include "lightmapper/doom_levelmesh.h"
+#include "parse/udmfscanner.h"
 #include <miniz/miniz.h>
+#include <string>
 
 #define DEFINE_SPECIAL(name, num, min, max, map) name = num,
 
@@ -50,18 +52,105 @@ private:
 	FWadWriter &Out;
 };
 
+// Keeps the UDMF keys and values that the map's properties point to.
+class StringBuffer
+{
+	const static size_t BLOCK_SIZE = 100000;
+	const static size_t BLOCK_ALIGN = sizeof(size_t);
+
+	TArray<char *> blocks;
+	size_t currentindex;
+
+	char *Alloc(size_t size)
+	{
+		if (size >= BLOCK_SIZE)
+		{
+			// Too big to share a block.
+			char *bigblock = new char[size];
+			blocks.Insert(0, bigblock);
+			return bigblock;
+		}
+		if (currentindex + size >= BLOCK_SIZE)
+		{
+			// Block is full - get a new one!
+			char *newblock = new char[BLOCK_SIZE];
+			blocks.Push(newblock);
+			currentindex = 0;
+		}
+		size = (size + BLOCK_ALIGN-1) &~ (BLOCK_ALIGN-1);
+		char *p = blocks[blocks.Size()-1] + currentindex;
+		currentindex += size;
+		return p;
+	}
+public:
+
+	StringBuffer()
+	{
+		currentindex = BLOCK_SIZE;
+	}
+
+	~StringBuffer()
+	{
+		for (unsigned int i = 0; i < blocks.Size(); ++i)
+		{
+			delete[] blocks[i];
+		}
+	}
+
+	StringBuffer(const StringBuffer &) = delete;
+	StringBuffer &operator=(const StringBuffer &) = delete;
+
+	char * Copy(const char * p)
+	{
+		return p != nullptr? strcpy(Alloc(strlen(p)+1) , p) : nullptr;
+	}
+
+	char * Copy(std::string_view s)
+	{
+		char *p = Alloc(s.size()+1);
+		memcpy(p, s.data(), s.size());
+		p[s.size()] = 0;
+		return p;
+	}
+
+	// Takes over everything other holds, which stays valid, and leaves it empty.
+	void Adopt(StringBuffer &other)
+	{
+		// The block still being filled has to stay last.
+		for (unsigned int i = 0; i < other.blocks.Size(); ++i)
+		{
+			blocks.Insert(i, other.blocks[i]);
+		}
+		other.blocks.Clear();
+		other.currentindex = BLOCK_SIZE;
+	}
+};
+
+struct FTextMapChunk;
+
 class FProcessor
 {
 public:
-	FProcessor(FWadReader &inwad, int lump);
+	FProcessor(FWadReader &inwad, int lump, FNodeCache *nodeCache = nullptr);
 
 	void BuildNodes();
+	void BuildTables();
 	void BuildLightmaps();
 	void Write(FWadWriter &out);
 
 	void DumpMesh();
 
+	// For tools that run the node builder on the loaded map themselves
+	FLevel &GetLevel() { return Level; }
+	TArray<FNodeBuilder::FPolyStart> &GetPolyStarts() { return PolyStarts; }
+	TArray<FNodeBuilder::FPolyStart> &GetPolyAnchors() { return PolyAnchors; }
+
+	// A quick 64 bit hash of a lump's data, for the caches to key entries on.
+	static uint64_t HashLump(const void *data, int size);
+
 private:
+	bool IsEmpty() const;
+
 	void LoadUDMF();
 	void LoadThings();
 	void LoadLines();
@@ -102,6 +191,7 @@ private:
 	void WriteGLSegs5(FWadWriter &out);
 	void WriteGLSSect(FWadWriter &out, bool v5);
 	void WriteGLNodes(FWadWriter &out, bool v5);
+	void WriteGLPVS(FWadWriter &out, bool compress);
 
 	void WriteBSPZ(FWadWriter &out, const char *label);
 	void WriteGLBSPZ(FWadWriter &out, const char *label);
@@ -126,27 +216,31 @@ private:
 	void WriteNodes5(FWadWriter &out, const char *name, const MapNodeEx *zaNodes, int count) const;
 	void WriteSSectors5(FWadWriter &out, const char *name, const MapSubsectorEx *zaSubs, int count) const;
 
-	const char *ParseKey(const char *&value);
-	bool CheckKey(const char *&key, const char *&value);
-	void ParseThing(IntThing *th);
-	void ParseLinedef(IntLineDef *ld);
-	void ParseSidedef(IntSideDef *sd);
-	void ParseSector(IntSector *sec);
-	void ParseVertex(WideVertex *vt, IntVertex *vtp);
-	void ParseMapProperties();
+	int ParseKey(FUDMFScanner &sc, std::string_view &key, std::string_view &value);
+	UDMFKey MakeKey(StringBuffer &strings, int atom, std::string_view key, std::string_view value);
+	void ParseThing(FUDMFScanner &sc, StringBuffer &strings, IntThing *th);
+	void ParseLinedef(FUDMFScanner &sc, StringBuffer &strings, IntLineDef *ld);
+	void ParseSidedef(FUDMFScanner &sc, StringBuffer &strings, IntSideDef *sd);
+	void ParseSector(FUDMFScanner &sc, StringBuffer &strings, IntSector *sec);
+	void ParseVertex(FUDMFScanner &sc, StringBuffer &strings, WideVertex *vt, IntVertex *vtp);
+	void ParseBlocks(FUDMFScanner &sc, FTextMapChunk &chunk);
+	bool ParseChunks(const char *buffer, int buffersize, const TArray<size_t> &bounds);
 	void ParseTextMap(int lump);
-
-	void WriteProps(FWadWriter &out, TArray<UDMFKey> &props);
-	void WriteIntProp(FWadWriter &out, const char *key, int value);
-	void WriteThingUDMF(FWadWriter &out, IntThing *th, int num);
-	void WriteLinedefUDMF(FWadWriter &out, IntLineDef *ld, int num);
-	void WriteSidedefUDMF(FWadWriter &out, IntSideDef *sd, int num);
-	void WriteSectorUDMF(FWadWriter &out, IntSector *sec, int num);
-	void WriteVertexUDMF(FWadWriter &out, IntVertex *vt, int num);
+	bool LoadUDMFCache(uint64_t hash, int textsize);
+	void SaveUDMFCache(uint64_t hash, int textsize);
+
+	void WriteProps(std::string &out, const UDMFProps &props);
+	void WriteIntProp(std::string &out, const char *key, int value);
+	void WriteThingUDMF(std::string &out, IntThing *th, int num);
+	void WriteLinedefUDMF(std::string &out, IntLineDef *ld, int num);
+	void WriteSidedefUDMF(std::string &out, IntSideDef *sd, int num);
+	void WriteSectorUDMF(std::string &out, IntSector *sec, int num);
+	void WriteVertexUDMF(std::string &out, IntVertex *vt, int num);
 	void WriteTextMap(FWadWriter &out);
 	void WriteUDMF(FWadWriter &out);
 
 	FLevel Level;
+	StringBuffer Strings;
 
 	TArray<FNodeBuilder::FPolyStart> PolyStarts;
 	TArray<FNodeBuilder::FPolyStart> PolyAnchors;
@@ -156,7 +250,9 @@ private:
 
 	FWadReader &Wad;
 	int Lump;
+	FNodeCache *NodeCache;
 
 	bool NodesBuilt = false;
+	bool TablesBuilt = false;
 	std::unique_ptr<DoomLevelMesh> LightmapMesh;
 };
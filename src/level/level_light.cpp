@@ -27,6 +27,7 @@
 
 #include "framework/vectors.h"
 #include "level/level.h"
+#include "framework/profiler.h"
 #include <algorithm>
 #include <memory>
 
@@ -57,6 +58,8 @@ static int RoundPowerOfTwo(int x)
 
 void FLevel::SetupLights()
 {
+	PROFILE_ZONE("SetupLights");
+
 	// GG to whoever memset'ed FLevel
 	defaultSunColor = FVector3(1, 1, 1);
 	defaultSunDirection = FVector3(0.45f, 0.3f, 0.9f);
@@ -81,22 +84,17 @@ void FLevel::SetupLights()
 
 			printf("   Sun vector: %f, %f, %f\n", sundir.X, sundir.Y, sundir.Z);
 
-			for (unsigned int propIndex = 0; propIndex < thing->props.Size(); propIndex++)
+			if (const UDMFKey *key = thing->props.Find(UDMF_lm_suncolor))
 			{
-				const UDMFKey &key = thing->props[propIndex];
-
-				if (!stricmp(key.key, "lm_suncolor"))
-				{
-					lightcolor = atoi(key.value);
-					printf("   Sun color: %d (%X)\n", lightcolor, lightcolor);
-				}
-				else if (!stricmp(key.key, "lm_sampledist"))
-				{
-					DefaultSamples = atoi(key.value);
-					if (DefaultSamples < 8) DefaultSamples = 8;
-					if (DefaultSamples > 128) DefaultSamples = 128;
-					DefaultSamples = RoundPowerOfTwo(DefaultSamples);
-				}
+				lightcolor = atoi(key->value);
+				printf("   Sun color: %d (%X)\n", lightcolor, lightcolor);
+			}
+			if (const UDMFKey *key = thing->props.Find(UDMF_lm_sampledist))
+			{
+				DefaultSamples = atoi(key->value);
+				if (DefaultSamples < 8) DefaultSamples = 8;
+				if (DefaultSamples > 128) DefaultSamples = 128;
+				DefaultSamples = RoundPowerOfTwo(DefaultSamples);
 			}
 
 			if ((sundir | sundir) > 0.01f)
@@ -281,12 +279,9 @@ void FLevel::CreateLights()
 			outerAngleCos = std::cos((float)thing->args[2] * 3.14159265359f / 180.0f);
 		}
 
-		for (const auto& prop : thing->props)
+		if (const UDMFKey *prop = thing->props.Find(UDMF_light_softshadowradius))
 		{
-			if (!stricmp(prop.key, "light_softshadowradius"))
-			{
-				softshadowradius = atof(prop.value);
-			}
+			softshadowradius = atof(prop->value);
 		}
 
 		// this is known as "intensity" on dynamic lights (and in UDB) - what it actually is though, is the radius
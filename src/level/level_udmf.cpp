@@ -19,9 +19,15 @@
 */
 
 
-#include <float.h>
+#include <atomic>
+#include <charconv>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include "level/level.h"
-#include "parse/sc_man.h"
+#include "framework/threadpool.h"
 
 #include "framework/xs_Float.h"
 
@@ -30,18 +36,18 @@
 #pragma warning(disable: 4244) // warning C4244: '=': conversion from '__int64' to 'int', possible loss of data
 #endif
 
-static void CopyUDMFString(char *dest, int destlen, const char *udmfvalue)
+static void CopyUDMFString(char *dest, int destlen, std::string_view udmfvalue)
 {
 	destlen--;
 
 	char endchar = 0;
-	if (udmfvalue[0] == '"' || udmfvalue[0] == '\'')
+	if (udmfvalue.size() > 0 && (udmfvalue[0] == '"' || udmfvalue[0] == '\''))
 	{
 		endchar = udmfvalue[0];
-		udmfvalue++;
+		udmfvalue.remove_prefix(1);
 	}
 
-	for (int i = 0; i < destlen && udmfvalue[i] != 0 && udmfvalue[i] != endchar; i++)
+	for (int i = 0; i < destlen && i < (int)udmfvalue.size() && udmfvalue[i] != 0 && udmfvalue[i] != endchar; i++)
 	{
 		*(dest++) = udmfvalue[i];
 	}
@@ -49,184 +55,229 @@ static void CopyUDMFString(char *dest, int destlen, const char *udmfvalue)
 	*dest = 0;
 }
 
-class StringBuffer
+static inline bool Match(std::string_view token, const char *text)
 {
-	const static size_t BLOCK_SIZE = 100000;
-	const static size_t BLOCK_ALIGN = sizeof(size_t);
+	return FUDMFScanner::Compare(token, text);
+}
 
-	TDeletingArray<char *> blocks;
-	size_t currentindex;
+//===========================================================================
+//
+// Maps each distinct key to its atom. The keys from udmfkeys.h are
+// entered up front and never change, so they are looked up without a
+// lock. Other keys are shared by all maps being parsed, so entering or
+// finding one of them takes the lock.
+//
+//===========================================================================
 
-	char *Alloc(size_t size)
+class FUDMFKeyTable
+{
+public:
+	FUDMFKeyTable()
 	{
-		if (currentindex + size >= BLOCK_SIZE)
+		static const char *const names[] =
 		{
-			// Block is full - get a new one!
-			char *newblock = new char[BLOCK_SIZE];
-			blocks.Push(newblock);
-			currentindex = 0;
+#define DEFINE_UDMFKEY(name) #name,
+#include "udmfkeys.h"
+#undef DEFINE_UDMFKEY
+		};
+
+		memset(Known, 0, sizeof(Known));
+		for (int i = 0; i < NUM_UDMF_KEYS; i++)
+		{
+			size_t len = strlen(names[i]);
+			unsigned int slot = Hash(std::string_view(names[i], len)) & (TABLE_SIZE-1);
+			while (Known[slot].Name != nullptr)
+			{
+				slot = (slot + 1) & (TABLE_SIZE-1);
+			}
+			Known[slot].Name = names[i];
+			Known[slot].Length = len;
+			Known[slot].Atom = i;
 		}
-		size = (size + BLOCK_ALIGN-1) &~ (BLOCK_ALIGN-1);
-		char *p = blocks[blocks.Size()-1] + currentindex;
-		currentindex += size;
-		return p;
 	}
-public:
 
-	StringBuffer()
+	int Intern(std::string_view key)
 	{
-		currentindex = BLOCK_SIZE;
+		unsigned int hash = Hash(key);
+		for (unsigned int slot = hash & (TABLE_SIZE-1); Known[slot].Name != nullptr; slot = (slot + 1) & (TABLE_SIZE-1))
+		{
+			if (Known[slot].Length == key.size() && Match(key, Known[slot].Name))
+			{
+				return Known[slot].Atom;
+			}
+		}
+
+		std::string lower(key);
+		for (char &c : lower)
+		{
+			c = (char)tolower((unsigned char)c);
+		}
+		std::lock_guard<std::mutex> lock(OthersLock);
+		return Others.emplace(lower, NUM_UDMF_KEYS + (int)Others.size()).first->second;
 	}
 
-	char * Copy(const char * p)
+private:
+	enum { TABLE_SIZE = 256 };
+	static_assert(NUM_UDMF_KEYS * 2 <= TABLE_SIZE, "UDMF key table is too small");
+
+	static unsigned int Hash(std::string_view key)
 	{
-		return p != nullptr? strcpy(Alloc(strlen(p)+1) , p) : nullptr;
+		unsigned int hash = 2166136261u;
+		for (char c : key)
+		{
+			hash = (hash ^ (unsigned char)tolower((unsigned char)c)) * 16777619u;
+		}
+		return hash;
 	}
+
+	struct Entry
+	{
+		const char *Name;
+		size_t Length;
+		int Atom;
+	};
+	Entry Known[TABLE_SIZE];
+
+	std::mutex OthersLock;
+	std::unordered_map<std::string, int> Others;
 };
 
-StringBuffer stbuf;
+static FUDMFKeyTable UDMFKeys;
 
+int InternUDMFKey(std::string_view key)
+{
+	return UDMFKeys.Intern(key);
+}
 
 //===========================================================================
 //
-// Parses a 'key = value;' line of the map
+// Parses a 'key = value;' line of the map and returns the key's atom
 //
 //===========================================================================
 
-const char *FProcessor::ParseKey(const char *&value)
+int FProcessor::ParseKey(FUDMFScanner &sc, std::string_view &key, std::string_view &value)
 {
-	SC_MustGetString();
-	const char *key = stbuf.Copy(sc_String);
-	SC_MustGetStringName("=");
-
-	sc_Number = INT_MIN;
-	sc_Float = DBL_MIN;
-	if (!SC_CheckFloat())
-	{
-		SC_MustGetString();
-	}
-	value = stbuf.Copy(sc_String);
-	SC_MustGetStringName(";");
-	return key;
+	sc.MustGetToken(key);
+	sc.MustGetChar('=');
+	sc.MustGetToken(value);
+	sc.MustGetChar(';');
+	return UDMFKeys.Intern(key);
 }
 
-bool FProcessor::CheckKey(const char *&key, const char *&value)
+//===========================================================================
+//
+// Copies a key and its value into a string buffer so that they can
+// be written back out. Like sc_man did, control characters inside a
+// quoted value are dropped unless they are escaped.
+//
+//===========================================================================
+
+UDMFKey FProcessor::MakeKey(StringBuffer &strings, int atom, std::string_view key, std::string_view value)
 {
-	SC_SavePos();
-	SC_MustGetString();
-	if (SC_CheckString("="))
+	char *copy = strings.Copy(value);
+	if (value.size() > 0 && value[0] == '"')
 	{
-		SC_RestorePos();
-		key = ParseKey(value);
-		return true;
+		size_t out = 0;
+		for (size_t in = 0; in < value.size(); in++)
+		{
+			if (value[in] == '\\' && in + 1 < value.size())
+			{
+				copy[out++] = value[in++];
+			}
+			else if (value[in] >= 0 && value[in] < ' ')
+			{
+				continue;
+			}
+			copy[out++] = value[in];
+		}
+		copy[out] = 0;
 	}
-	SC_RestorePos();
-	return false;
+	UDMFKey k = { strings.Copy(key), copy, atom };
+	return k;
 }
 
-int CheckInt(const char *key)
+static int CheckInt(std::string_view value)
 {
-	if (sc_Number == INT_MIN)
-	{
-		SC_ScriptError("Integer value expected for key '%s'", key);
-	}
-	return sc_Number;
+	return (int)FUDMFScanner::ToFloat(value);
 }
 
-double CheckFloat(const char *key)
+static double CheckFloat(std::string_view value)
 {
-	if (sc_Float == DBL_MIN)
-	{
-		SC_ScriptError("Floating point value expected for key '%s'", key);
-	}
-	return sc_Float;
+	return FUDMFScanner::ToFloat(value);
 }
 
-fixed_t CheckFixed(const char *key)
+static fixed_t CheckFixed(FUDMFScanner &sc, std::string_view key, std::string_view value)
 {
-	double val = CheckFloat(key);
+	double val = CheckFloat(value);
 	if (val < -32768 || val > 32767)
 	{
-		SC_ScriptError("Fixed point value is out of range for key '%s'\n\t%.2f should be within [-32768,32767]", key, val / 65536);
+		sc.Error("Fixed point value is out of range for key '%.*s'\n\t%.2f should be within [-32768,32767]", (int)key.size(), key.data(), val / 65536);
 	}
 	return xs_Fix<16>::ToFix(val);
 }
 
 //===========================================================================
 //
-// Parse a thing block
+// Reads the numbers out of a moreids string
 //
 //===========================================================================
 
-void FProcessor::ParseThing(IntThing *th)
+static void ParseMoreIds(std::string_view value, int invalid, std::vector<int> &moreids)
 {
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	if (value.size() > 0 && value[0] == '"')
 	{
-		const char *value;
-		const char *key = ParseKey(value);
-
-		if (!stricmp(key, "x"))
-		{
-			th->x = CheckFixed(key);
-		}
-		else if (!stricmp(key, "y"))
-		{
-			th->y = CheckFixed(key);
-		}
-		if (!stricmp(key, "angle"))
-		{
-			th->angle = (short)CheckInt(key);
-		}
-		if (!stricmp(key, "pitch"))
-		{
-			th->pitch = (short)CheckInt(key);
-		}
-		if (!stricmp(key, "type"))
+		// skip the quotation mark. No strtok, other maps may be parsed at the same time.
+		std::string workstring(value.substr(1));
+		for (const char *token = workstring.c_str() + strspn(workstring.c_str(), " \""); *token; token += strspn(token, " \""))
 		{
-			th->type = (short)CheckInt(key);
-		}
-		if (!stricmp(key, "height"))
-		{
-			th->height = CheckInt(key);
-		}
-		if (!stricmp(key, "special"))
-		{
-			th->special = CheckInt(key);
-		}
-		if (!stricmp(key, "arg0"))
-		{
-			th->args[0] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg1"))
-		{
-			th->args[1] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg2"))
-		{
-			th->args[2] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg3"))
-		{
-			th->args[3] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg4"))
-		{
-			th->args[4] = CheckInt(key);
-		}
-		if (!stricmp(key, "alpha"))
-		{
-			th->alpha = CheckFloat(key);
+			auto tag = strtoll(token, nullptr, 0);
+			if (tag != invalid && (int)tag == tag)
+			{
+				moreids.push_back(tag);
+			}
+			token += strcspn(token, " \"");
 		}
-		if (!stricmp(key, "arg0str"))
-		{
-			th->arg0str = value;
+	}
+}
+
+//===========================================================================
+//
+// Parse a thing block
+//
+//===========================================================================
+
+void FProcessor::ParseThing(FUDMFScanner &sc, StringBuffer &strings, IntThing *th)
+{
+	sc.MustGetChar('{');
+	while (!sc.CheckChar('}'))
+	{
+		std::string_view key, value;
+		int atom = ParseKey(sc, key, value);
+
+		switch (atom)
+		{
+		case UDMF_x:		th->x = CheckFixed(sc, key, value); break;
+		case UDMF_y:		th->y = CheckFixed(sc, key, value); break;
+		case UDMF_angle:	th->angle = (short)CheckInt(value); break;
+		case UDMF_pitch:	th->pitch = (short)CheckInt(value); break;
+		case UDMF_type:		th->type = (short)CheckInt(value); break;
+		case UDMF_height:	th->height = CheckInt(value); break;
+		case UDMF_special:	th->special = CheckInt(value); break;
+		case UDMF_arg0:		th->args[0] = CheckInt(value); break;
+		case UDMF_arg1:		th->args[1] = CheckInt(value); break;
+		case UDMF_arg2:		th->args[2] = CheckInt(value); break;
+		case UDMF_arg3:		th->args[3] = CheckInt(value); break;
+		case UDMF_arg4:		th->args[4] = CheckInt(value); break;
+		case UDMF_alpha:	th->alpha = CheckFloat(value); break;
+
+		case UDMF_arg0str:
+			th->arg0str = FString(value.data(), value.size());
 			th->arg0str.StripChars("\"");
+			break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
-		th->props.Push(k);
+		th->props.Push(MakeKey(strings, atom, key, value));
 	}
 }
 
@@ -236,7 +287,7 @@ void FProcessor::ParseThing(IntThing *th)
 //
 //===========================================================================
 
-void FProcessor::ParseLinedef(IntLineDef *ld)
+void FProcessor::ParseLinedef(FUDMFScanner &sc, StringBuffer &strings, IntLineDef *ld)
 {
 	ld->sampling.SetGeneralSampleDistance(0);
 	ld->sampling.SetSampleDistance(WallPart::TOP, 0);
@@ -244,115 +295,54 @@ void FProcessor::ParseLinedef(IntLineDef *ld)
 	ld->sampling.SetSampleDistance(WallPart::BOTTOM, 0);
 
 	std::vector<int> moreids;
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetChar('{');
+	while (!sc.CheckChar('}'))
 	{
-		const char *value;
-		const char *key = ParseKey(value);
+		std::string_view key, value;
+		int atom = ParseKey(sc, key, value);
 
-		if (!stricmp(key, "v1"))
-		{
-			ld->v1 = CheckInt(key);
-			continue;	// do not store in props
-		}
-		else if (!stricmp(key, "v2"))
-		{
-			ld->v2 = CheckInt(key);
-			continue;	// do not store in props
-		}
-		else if (Extended && !stricmp(key, "special"))
-		{
-			ld->special = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg0"))
-		{
-			ld->args[0] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg1"))
-		{
-			ld->args[1] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg2"))
-		{
-			ld->args[2] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg3"))
-		{
-			ld->args[3] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg4"))
-		{
-			ld->args[4] = CheckInt(key);
-		}
-		else if (stricmp(key, "moreids") == 0)
+		switch (atom)
 		{
+		// these are not stored in props
+		case UDMF_v1:			ld->v1 = CheckInt(value); continue;
+		case UDMF_v2:			ld->v2 = CheckInt(value); continue;
+		case UDMF_sidefront:	ld->sidenum[0] = CheckInt(value); continue;
+		case UDMF_sideback:		ld->sidenum[1] = CheckInt(value); continue;
+
+		case UDMF_special:		if (Extended) ld->special = CheckInt(value); break;
+		case UDMF_arg0:			if (Extended) ld->args[0] = CheckInt(value); break;
+		case UDMF_arg1:			if (Extended) ld->args[1] = CheckInt(value); break;
+		case UDMF_arg2:			if (Extended) ld->args[2] = CheckInt(value); break;
+		case UDMF_arg3:			if (Extended) ld->args[3] = CheckInt(value); break;
+		case UDMF_arg4:			if (Extended) ld->args[4] = CheckInt(value); break;
+
+		case UDMF_moreids:
 			// delay parsing of the tag string until parsing of the sector is complete
 			// This ensures that the ID is always the first tag in the list.
-			auto tagstring = value;
-			if (tagstring != nullptr && *tagstring == '"')
+			ParseMoreIds(value, -1, moreids);
+			break;
+
+		case UDMF_blocking:			if (Match(value, "true")) ld->flags |= ML_BLOCKING; break;
+		case UDMF_blockmonsters:	if (Match(value, "true")) ld->flags |= ML_BLOCKMONSTERS; break;
+		case UDMF_twosided:			if (Match(value, "true")) ld->flags |= ML_TWOSIDED; break;
+
+		case UDMF_id:
+			if (Extended)
 			{
-				// skip the quotation mark
-				auto workstring = strdup(tagstring + 1);
-				for (char* token = strtok(workstring, " \""); token; token = strtok(nullptr, " \""))
-				{
-					auto tag = strtoll(token, nullptr, 0);
-					if (tag != -1 && (int)tag == tag)
-					{
-						moreids.push_back(tag);
-					}
-				}
-				free(workstring);
+				int id = CheckInt(value);
+				ld->ids.Clear();
+				if (id != -1) ld->ids.Push(id);
 			}
-		}
-		else if (!stricmp(key, "blocking") && !stricmp(value, "true"))
-		{
-			ld->flags |= ML_BLOCKING;
-		}
-		else if (!stricmp(key, "blockmonsters") && !stricmp(value, "true"))
-		{
-			ld->flags |= ML_BLOCKMONSTERS;
-		}
-		else if (!stricmp(key, "twosided") && !stricmp(value, "true"))
-		{
-			ld->flags |= ML_TWOSIDED;
-		}
-		else if (Extended && !stricmp(key, "id"))
-		{
-			int id = CheckInt(key);
-			ld->ids.Clear();
-			if (id != -1) ld->ids.Push(id);
-		}
-		else if (stricmp(key, "lm_sampledist") == 0)
-		{
-			ld->sampling.SetGeneralSampleDistance(CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_top") == 0)
-		{
-			ld->sampling.SetSampleDistance(WallPart::TOP, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_mid") == 0)
-		{
-			ld->sampling.SetSampleDistance(WallPart::MIDDLE, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_bot") == 0)
-		{
-			ld->sampling.SetSampleDistance(WallPart::BOTTOM, CheckInt(key));
-		}
+			break;
 
-		if (!stricmp(key, "sidefront"))
-		{
-			ld->sidenum[0] = CheckInt(key);
-			continue;	// do not store in props
-		}
-		else if (!stricmp(key, "sideback"))
-		{
-			ld->sidenum[1] = CheckInt(key);
-			continue;	// do not store in props
+		case UDMF_lm_sampledist:		ld->sampling.SetGeneralSampleDistance(CheckInt(value)); break;
+		case UDMF_lm_sampledist_top:	ld->sampling.SetSampleDistance(WallPart::TOP, CheckInt(value)); break;
+		case UDMF_lm_sampledist_mid:	ld->sampling.SetSampleDistance(WallPart::MIDDLE, CheckInt(value)); break;
+		case UDMF_lm_sampledist_bot:	ld->sampling.SetSampleDistance(WallPart::BOTTOM, CheckInt(value)); break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
-		ld->props.Push(k);
+		ld->props.Push(MakeKey(strings, atom, key, value));
 	}
 
 	for (int tag : moreids)
@@ -365,9 +355,9 @@ void FProcessor::ParseLinedef(IntLineDef *ld)
 //
 //===========================================================================
 
-void FProcessor::ParseSidedef(IntSideDef *sd)
+void FProcessor::ParseSidedef(FUDMFScanner &sc, StringBuffer &strings, IntSideDef *sd)
 {
-	SC_MustGetStringName("{");
+	sc.MustGetChar('{');
 	sd->sector = NO_INDEX;
 	sd->textureoffset = 0;
 	sd->rowoffset = 0;
@@ -381,57 +371,30 @@ void FProcessor::ParseSidedef(IntSideDef *sd)
 	sd->sampling.SetSampleDistance(WallPart::TOP, 0);
 	sd->sampling.SetSampleDistance(WallPart::MIDDLE, 0);
 	sd->sampling.SetSampleDistance(WallPart::BOTTOM, 0);
-	while (!SC_CheckString("}"))
+	while (!sc.CheckChar('}'))
 	{
-		const char *value;
-		const char *key = ParseKey(value);
+		std::string_view key, value;
+		int atom = ParseKey(sc, key, value);
 
-		if (!stricmp(key, "sector"))
+		switch (atom)
 		{
-			sd->sector = CheckInt(key);
+		case UDMF_sector:
+			sd->sector = CheckInt(value);
 			continue;	// do not store in props
-		}
 
-		if (stricmp(key, "texturetop") == 0)
-		{
-			CopyUDMFString(sd->toptexture, 64, value);
-		}
-		else if (stricmp(key, "texturemiddle") == 0)
-		{
-			CopyUDMFString(sd->midtexture, 64, value);
-		}
-		else if (stricmp(key, "texturebottom") == 0)
-		{
-			CopyUDMFString(sd->bottomtexture, 64, value);
-		}
-		else if (stricmp(key, "offsetx_mid") == 0)
-		{
-			sd->textureoffset = CheckInt(key);
-		}
-		else if (stricmp(key, "offsety_mid") == 0)
-		{
-			sd->rowoffset = CheckInt(key);
-		}
-		else if (stricmp(key, "lm_sampledist") == 0)
-		{
-			sd->sampling.SetGeneralSampleDistance(CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_top") == 0)
-		{
-			sd->sampling.SetSampleDistance(WallPart::TOP, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_mid") == 0)
-		{
-			sd->sampling.SetSampleDistance(WallPart::MIDDLE, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_bot") == 0)
-		{
-			sd->sampling.SetSampleDistance(WallPart::BOTTOM, CheckInt(key));
+		case UDMF_texturetop:			CopyUDMFString(sd->toptexture, 64, value); break;
+		case UDMF_texturemiddle:		CopyUDMFString(sd->midtexture, 64, value); break;
+		case UDMF_texturebottom:		CopyUDMFString(sd->bottomtexture, 64, value); break;
+		case UDMF_offsetx_mid:			sd->textureoffset = CheckInt(value); break;
+		case UDMF_offsety_mid:			sd->rowoffset = CheckInt(value); break;
+		case UDMF_lm_sampledist:		sd->sampling.SetGeneralSampleDistance(CheckInt(value)); break;
+		case UDMF_lm_sampledist_top:	sd->sampling.SetSampleDistance(WallPart::TOP, CheckInt(value)); break;
+		case UDMF_lm_sampledist_mid:	sd->sampling.SetSampleDistance(WallPart::MIDDLE, CheckInt(value)); break;
+		case UDMF_lm_sampledist_bot:	sd->sampling.SetSampleDistance(WallPart::BOTTOM, CheckInt(value)); break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
-		sd->props.Push(k);
+		sd->props.Push(MakeKey(strings, atom, key, value));
 	}
 }
 
@@ -441,7 +404,7 @@ void FProcessor::ParseSidedef(IntSideDef *sd)
 //
 //===========================================================================
 
-void FProcessor::ParseSector(IntSector *sec)
+void FProcessor::ParseSector(FUDMFScanner &sc, StringBuffer &strings, IntSector *sec)
 {
 	std::vector<int> moreids;
 	memset(&sec->data, 0, sizeof(sec->data));
@@ -450,132 +413,66 @@ void FProcessor::ParseSector(IntSector *sec)
 	sec->sampleDistanceFloor = 0;
 
 	int ceilingplane = 0, floorplane = 0;
-	bool floorTexZSet = false;
-	bool ceilingTexZSet = false;
 
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetChar('{');
+	while (!sc.CheckChar('}'))
 	{
-		const char *value;
-		const char *key = ParseKey(value);
+		std::string_view key, value;
+		int atom = ParseKey(sc, key, value);
 
-		if (stricmp(key, "heightfloor") == 0)
+		switch (atom)
 		{
-			sec->floorTexZ = CheckFloat(key);
-			floorTexZSet = true;
-		}
-		else if (stricmp(key, "heightceiling") == 0)
-		{
-			sec->ceilingTexZ = CheckFloat(key);
-			ceilingTexZSet = true;
-		}
-		if (stricmp(key, "textureceiling") == 0)
-		{
-			CopyUDMFString(sec->data.ceilingpic, 64, value);
-		}
-		else if (stricmp(key, "texturefloor") == 0)
-		{
-			CopyUDMFString(sec->data.floorpic, 64, value);
-		}
-		else if (stricmp(key, "heightceiling") == 0)
-		{
-			sec->data.ceilingheight = CheckFloat(key);
-			if (!ceilingTexZSet)
-				sec->ceilingTexZ = sec->data.ceilingheight;
-		}
-		else if (stricmp(key, "heightfloor") == 0)
+		case UDMF_heightfloor:
 		{
-			sec->data.floorheight = CheckFloat(key);
-			if (!floorTexZSet)
-				sec->floorTexZ = sec->data.floorheight;
+			double height = CheckFloat(value);
+			sec->floorTexZ = height;
+			sec->data.floorheight = height;
+			break;
 		}
-		else if (stricmp(key, "lightlevel") == 0)
-		{
-			sec->data.lightlevel = CheckInt(key);
-		}
-		else if (stricmp(key, "special") == 0)
+
+		case UDMF_heightceiling:
 		{
-			sec->data.special = CheckInt(key);
+			double height = CheckFloat(value);
+			sec->ceilingTexZ = height;
+			sec->data.ceilingheight = height;
+			break;
 		}
-		else if (stricmp(key, "id") == 0)
+
+		case UDMF_textureceiling:	CopyUDMFString(sec->data.ceilingpic, 64, value); break;
+		case UDMF_texturefloor:		CopyUDMFString(sec->data.floorpic, 64, value); break;
+		case UDMF_lightlevel:		sec->data.lightlevel = CheckInt(value); break;
+		case UDMF_special:			sec->data.special = CheckInt(value); break;
+
+		case UDMF_id:
 		{
-			int id = CheckInt(key);
+			int id = CheckInt(value);
 			sec->data.tag = (short)id;
 			sec->tags.Clear();
 			if (id != 0) sec->tags.Push(id);
+			break;
 		}
-		else if (stricmp(key, "ceilingplane_a") == 0)
-		{
-			ceilingplane|=1;
-			sec->ceilingplane.a = CheckFloat(key);
-		}
-		else if (stricmp(key, "ceilingplane_b") == 0)
-		{
-			ceilingplane|=2;
-			sec->ceilingplane.b = CheckFloat(key);
-		}
-		else if (stricmp(key, "ceilingplane_c") == 0)
-		{
-			ceilingplane|=4;
-			sec->ceilingplane.c = CheckFloat(key);
-		}
-		else if (stricmp(key, "ceilingplane_d") == 0)
-		{
-			ceilingplane|=8;
-			sec->ceilingplane.d = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_a") == 0)
-		{
-			floorplane|=1;
-			sec->floorplane.a = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_b") == 0)
-		{
-			floorplane|=2;
-			sec->floorplane.b = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_c") == 0)
-		{
-			floorplane|=4;
-			sec->floorplane.c = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_d") == 0)
-		{
-			floorplane|=8;
-			sec->floorplane.d = CheckFloat(key);
-		}
-		else if (stricmp(key, "moreids") == 0)
-		{
+
+		case UDMF_ceilingplane_a:	ceilingplane |= 1; sec->ceilingplane.a = CheckFloat(value); break;
+		case UDMF_ceilingplane_b:	ceilingplane |= 2; sec->ceilingplane.b = CheckFloat(value); break;
+		case UDMF_ceilingplane_c:	ceilingplane |= 4; sec->ceilingplane.c = CheckFloat(value); break;
+		case UDMF_ceilingplane_d:	ceilingplane |= 8; sec->ceilingplane.d = CheckFloat(value); break;
+		case UDMF_floorplane_a:		floorplane |= 1; sec->floorplane.a = CheckFloat(value); break;
+		case UDMF_floorplane_b:		floorplane |= 2; sec->floorplane.b = CheckFloat(value); break;
+		case UDMF_floorplane_c:		floorplane |= 4; sec->floorplane.c = CheckFloat(value); break;
+		case UDMF_floorplane_d:		floorplane |= 8; sec->floorplane.d = CheckFloat(value); break;
+
+		case UDMF_moreids:
 			// delay parsing of the tag string until parsing of the sector is complete
 			// This ensures that the ID is always the first tag in the list.
-			auto tagstring = value;
-			if (tagstring != nullptr && *tagstring == '"')
-			{
-				// skip the quotation mark
-				auto workstring = strdup(tagstring + 1);
-				for (char* token = strtok(workstring, " \""); token; token = strtok(nullptr, " \""))
-				{
-					auto tag = strtoll(token, nullptr, 0);
-					if (tag != 0 && (int)tag == tag)
-					{
-						moreids.push_back(tag);
-					}
-				}
-				free(workstring);
-			}
-		}
-		else if (stricmp(key, "lm_sampledist_floor") == 0)
-		{
-			sec->sampleDistanceFloor = CheckInt(key);
-		}
-		else if (stricmp(key, "lm_sampledist_ceiling") == 0)
-		{
-			sec->sampleDistanceCeiling = CheckInt(key);
+			ParseMoreIds(value, 0, moreids);
+			break;
+
+		case UDMF_lm_sampledist_floor:		sec->sampleDistanceFloor = CheckInt(value); break;
+		case UDMF_lm_sampledist_ceiling:	sec->sampleDistanceCeiling = CheckInt(value); break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
-		sec->props.Push(k);
+		sec->props.Push(MakeKey(strings, atom, key, value));
 	}
 
 	if (ceilingplane != 15)
@@ -622,66 +519,203 @@ void FProcessor::ParseSector(IntSector *sec)
 //
 //===========================================================================
 
-void FProcessor::ParseVertex(WideVertex *vt, IntVertex *vtp)
+void FProcessor::ParseVertex(FUDMFScanner &sc, StringBuffer &strings, WideVertex *vt, IntVertex *vtp)
 {
 	vt->x = vt->y = 0;
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetChar('{');
+	while (!sc.CheckChar('}'))
 	{
-		const char *value;
-		const char *key = ParseKey(value);
+		std::string_view key, value;
+		int atom = ParseKey(sc, key, value);
 
-		if (!stricmp(key, "x"))
+		switch (atom)
 		{
-			vt->x = CheckFixed(key);
+		case UDMF_x:		vt->x = CheckFixed(sc, key, value); break;
+		case UDMF_y:		vt->y = CheckFixed(sc, key, value); break;
+		case UDMF_zfloor:	vtp->zfloor = CheckFloat(value); break;
+		case UDMF_zceiling:	vtp->zceiling = CheckFloat(value); break;
 		}
-		else if (!stricmp(key, "y"))
+
+		// now store the key in its unprocessed form
+		vtp->props.Push(MakeKey(strings, atom, key, value));
+	}
+}
+
+
+//===========================================================================
+//
+// What parsing one run of a TEXTMAP's blocks gives. Big TEXTMAPs are
+// split into several runs that are parsed at the same time and then put
+// back together in file order, so everything keeps its index.
+//
+//===========================================================================
+
+static const size_t MIN_TEXTMAP_CHUNK = 1 << 20;	// Fewest bytes of blocks worth a thread of their own
+
+struct FTextMapChunk
+{
+	size_t Start = 0;	// offsets into the TEXTMAP
+	size_t End = 0;
+	size_t Stop = 0;	// where parsing actually stopped
+
+	TArray<IntThing> Things;
+	TArray<IntLineDef> Lines;
+	TArray<IntSideDef> Sides;
+	TArray<IntSector> Sectors;
+	TArray<WideVertex> Vertices;
+	TArray<IntVertex> VertexProps;
+	StringBuffer Strings;
+	std::exception_ptr Error;
+};
+
+template<class T>
+static void AppendChunk(TArray<T> &to, TArray<T> &from)
+{
+	if (to.Size() == 0)
+	{
+		to = std::move(from);
+	}
+	else
+	{
+		to.Append(std::move(from));
+	}
+}
+
+//===========================================================================
+//
+// Parses the blocks of one run. Vertices are numbered from the start
+// of the run.
+//
+//===========================================================================
+
+void FProcessor::ParseBlocks(FUDMFScanner &sc, FTextMapChunk &chunk)
+{
+	std::string_view token;
+
+	while (sc.GetOffset() < chunk.End && sc.GetToken(token))
+	{
+		if (Match(token, "thing"))
 		{
-			vt->y = CheckFixed(key);
+			IntThing *th = &chunk.Things[chunk.Things.Reserve(1)];
+			ParseThing(sc, chunk.Strings, th);
 		}
-		if (!stricmp(key, "zfloor"))
+		else if (Match(token, "linedef"))
 		{
-			vtp->zfloor = CheckFloat(key);
+			IntLineDef *ld = &chunk.Lines[chunk.Lines.Reserve(1)];
+			ParseLinedef(sc, chunk.Strings, ld);
 		}
-		else if (!stricmp(key, "zceiling"))
+		else if (Match(token, "sidedef"))
 		{
-			vtp->zceiling = CheckFloat(key);
+			IntSideDef *sd = &chunk.Sides[chunk.Sides.Reserve(1)];
+			ParseSidedef(sc, chunk.Strings, sd);
+		}
+		else if (Match(token, "sector"))
+		{
+			IntSector *sec = &chunk.Sectors[chunk.Sectors.Reserve(1)];
+			ParseSector(sc, chunk.Strings, sec);
+		}
+		else if (Match(token, "vertex"))
+		{
+			WideVertex *vt = &chunk.Vertices[chunk.Vertices.Reserve(1)];
+			IntVertex *vtp = &chunk.VertexProps[chunk.VertexProps.Reserve(1)];
+			vt->index = chunk.Vertices.Size();
+			ParseVertex(sc, chunk.Strings, vt, vtp);
 		}
-
-		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
-		vtp->props.Push(k);
 	}
+	chunk.Stop = sc.GetOffset();
 }
 
-
 //===========================================================================
 //
-// parses global map properties
+// Parses the runs of blocks between the given offsets and adds them to
+// the level. Returns false without touching the level if a run did not
+// end where the next one starts, which a value like 'x = };' can cause.
 //
 //===========================================================================
 
-void FProcessor::ParseMapProperties()
+bool FProcessor::ParseChunks(const char *buffer, int buffersize, const TArray<size_t> &bounds)
 {
-	const char *key, *value;
+	TArray<FTextMapChunk> chunks(bounds.Size() - 1, true);
 
-	// all global keys must come before the first map element.
+	auto parse = [&](FTextMapChunk &chunk)
+	{
+		try
+		{
+			FUDMFScanner sc(buffer, buffersize, chunk.Start);
+			ParseBlocks(sc, chunk);
+		}
+		catch (...)
+		{
+			chunk.Error = std::current_exception();
+		}
+	};
+
+	for (unsigned int i = 0; i < chunks.Size(); ++i)
+	{
+		chunks[i].Start = bounds[i];
+		chunks[i].End = bounds[i + 1];
+	}
+	if (chunks.Size() > 1)
+	{
+		ThreadPool pool(chunks.Size() - 1);
+		std::atomic<unsigned int> remaining(chunks.Size() - 1);
+
+		for (unsigned int i = 1; i < chunks.Size(); ++i)
+		{
+			pool.Submit([&, i]()
+			{
+				parse(chunks[i]);
+				remaining--;
+			});
+		}
+		parse(chunks[0]);
+		pool.WaitUntil([&remaining]() { return remaining == 0; });
+	}
+	else
+	{
+		parse(chunks[0]);
+	}
 
-	while (CheckKey(key, value))
+	// A run can only be trusted if all runs before it ended in the right
+	// place, so its error is the one parsing it all in one go would give.
+	unsigned int numvertices = 0;
+	for (unsigned int i = 0; i < chunks.Size(); ++i)
 	{
-		if (!stricmp(key, "namespace"))
+		if (chunks[i].Error)
 		{
-			// all unknown namespaces are assumed to be standard.
-			Extended = !stricmp(value, "\"ZDoom\"") || !stricmp(value, "\"Hexen\"") || !stricmp(value, "\"Vavoom\"");
+			std::rethrow_exception(chunks[i].Error);
 		}
+		if (chunks[i].Stop != chunks[i].End)
+		{
+			return false;
+		}
+		numvertices += chunks[i].Vertices.Size();
+	}
 
-		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
-		Level.props.Push(k);
+	Level.Vertices = new WideVertex[numvertices];
+	Level.NumVertices = numvertices;
+	numvertices = 0;
+	for (unsigned int i = 0; i < chunks.Size(); ++i)
+	{
+		FTextMapChunk &chunk = chunks[i];
+
+		for (unsigned int j = 0; j < chunk.Vertices.Size(); ++j)
+		{
+			Level.Vertices[numvertices + j] = chunk.Vertices[j];
+			Level.Vertices[numvertices + j].index += numvertices;
+		}
+		numvertices += chunk.Vertices.Size();
+
+		AppendChunk(Level.Things, chunk.Things);
+		AppendChunk(Level.Lines, chunk.Lines);
+		AppendChunk(Level.Sides, chunk.Sides);
+		AppendChunk(Level.Sectors, chunk.Sectors);
+		AppendChunk(Level.VertexProps, chunk.VertexProps);
+		Strings.Adopt(chunk.Strings);
 	}
+	return true;
 }
 
-
 //===========================================================================
 //
 // Main parsing function
@@ -690,51 +724,83 @@ void FProcessor::ParseMapProperties()
 
 void FProcessor::ParseTextMap(int lump)
 {
-	char *buffer;
 	int buffersize;
-	TArray<WideVertex> Vertices;
+	std::string_view token;
 
-	ReadLump<char> (Wad, lump, buffer, buffersize);
-	SC_OpenMem("TEXTMAP", buffer, buffersize);
+	const char *buffer = (const char *)Wad.LumpData(lump, buffersize);
+	uint64_t hash = 0;
 
-	SC_SetCMode(true);
-	ParseMapProperties();
-
-	while (SC_GetString())
+	if (UDMFCacheDir != nullptr)
 	{
-		if (SC_Compare("thing"))
-		{
-			IntThing *th = &Level.Things[Level.Things.Reserve(1)];
-			ParseThing(th);
-		}
-		else if (SC_Compare("linedef"))
+		hash = HashLump(buffer, buffersize);
+		if (LoadUDMFCache(hash, buffersize))
 		{
-			IntLineDef *ld = &Level.Lines[Level.Lines.Reserve(1)];
-			ParseLinedef(ld);
+			return;
 		}
-		else if (SC_Compare("sidedef"))
+	}
+
+	FUDMFScanner sc(buffer, buffersize);
+	size_t blockstart = buffersize;
+
+	// all global keys must come before the first map element.
+	while (sc.GetToken(token))
+	{
+		if (!sc.CheckChar('='))
 		{
-			IntSideDef *sd = &Level.Sides[Level.Sides.Reserve(1)];
-			ParseSidedef(sd);
+			blockstart = token.data() - buffer;
+			break;
 		}
-		else if (SC_Compare("sector"))
+
+		std::string_view value;
+
+		sc.MustGetToken(value);
+		sc.MustGetChar(';');
+		int atom = UDMFKeys.Intern(token);
+		if (atom == UDMF_namespace)
 		{
-			IntSector *sec = &Level.Sectors[Level.Sectors.Reserve(1)];
-			ParseSector(sec);
+			// all unknown namespaces are assumed to be standard.
+			Extended = Match(value, "\"ZDoom\"") || Match(value, "\"Hexen\"") || Match(value, "\"Vavoom\"");
 		}
-		else if (SC_Compare("vertex"))
+
+		// now store the key in its unprocessed form
+		Level.props.Push(MakeKey(Strings, atom, token, value));
+	}
+
+	// Split the blocks into runs of about the same size, each ending
+	// with a block's closing brace. Finding the braces only needs the
+	// tokens, which is far quicker than parsing.
+	TArray<size_t> bounds;
+	size_t blocksize = buffersize - blockstart;
+	size_t numchunks = ThreadPool::GetThreadCount(NumThreads);
+
+	if (numchunks > blocksize / MIN_TEXTMAP_CHUNK)
+	{
+		numchunks = blocksize / MIN_TEXTMAP_CHUNK;
+	}
+	bounds.Push(blockstart);
+	if (numchunks > 1)
+	{
+		FUDMFScanner split(buffer, buffersize, blockstart);
+
+		for (size_t i = 1; i < numchunks && split.SkipPastBlockEnd(blockstart + blocksize * i / numchunks); ++i)
 		{
-			WideVertex *vt = &Vertices[Vertices.Reserve(1)];
-			IntVertex *vtp = &Level.VertexProps[Level.VertexProps.Reserve(1)];
-			vt->index = Vertices.Size();
-			ParseVertex(vt, vtp);
+			bounds.Push(split.GetOffset());
 		}
 	}
-	Level.Vertices = new WideVertex[Vertices.Size()];
-	Level.NumVertices = Vertices.Size();
-	memcpy(Level.Vertices, &Vertices[0], Vertices.Size() * sizeof(WideVertex));
-	SC_Close();
-	delete[] buffer;
+	bounds.Push(buffersize);
+
+	if (!ParseChunks(buffer, buffersize, bounds))
+	{
+		bounds.Clear();
+		bounds.Push(blockstart);
+		bounds.Push(buffersize);
+		ParseChunks(buffer, buffersize, bounds);
+	}
+
+	if (UDMFCacheDir != nullptr)
+	{
+		SaveUDMFCache(hash, buffersize);
+	}
 }
 
 
@@ -755,14 +821,14 @@ void FProcessor::LoadUDMF()
 //
 //===========================================================================
 
-void FProcessor::WriteProps(FWadWriter &out, TArray<UDMFKey> &props)
+void FProcessor::WriteProps(std::string &out, const UDMFProps &props)
 {
-	for(unsigned i=0; i< props.Size(); i++)
+	for (const UDMFKey &prop : props)
 	{
-		out.AddToLump(props[i].key, (int)strlen(props[i].key));
-		out.AddToLump(" = ", 3);
-		out.AddToLump(props[i].value, (int)strlen(props[i].value));
-		out.AddToLump(";\n", 2);
+		out += prop.key;
+		out += " = ";
+		out += prop.value;
+		out += ";\n";
 	}
 }
 
@@ -772,34 +838,46 @@ void FProcessor::WriteProps(FWadWriter &out, TArray<UDMFKey> &props)
 //
 //===========================================================================
 
-void FProcessor::WriteIntProp(FWadWriter &out, const char *key, int value)
+void FProcessor::WriteIntProp(std::string &out, const char *key, int value)
 {
-	char buffer[20];
+	char buffer[16];
 
-	out.AddToLump(key, (int)strlen(key));
-	out.AddToLump(" = ", 3);
-	sprintf(buffer, "%d;\n", value);
-	out.AddToLump(buffer, (int)strlen(buffer));
+	out += key;
+	out += " = ";
+	out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+	out += ";\n";
 }
 
 //===========================================================================
 //
-// writes a UDMF thing
+// writes the line that starts a block, and the opening brace
 //
 //===========================================================================
 
-void FProcessor::WriteThingUDMF(FWadWriter &out, IntThing *th, int num)
+static void WriteBlockStart(std::string &out, const char *type, int num)
 {
-	out.AddToLump("thing", 5);
+	out += type;
 	if (WriteComments)
 	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
+		char buffer[16];
+
+		out += " // ";
+		out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), num).ptr);
 	}
-	out.AddToLump("\n{\n", 3);
+	out += "\n{\n";
+}
+
+//===========================================================================
+//
+// writes a UDMF thing
+//
+//===========================================================================
+
+void FProcessor::WriteThingUDMF(std::string &out, IntThing *th, int num)
+{
+	WriteBlockStart(out, "thing", num);
 	WriteProps(out, th->props);
-	out.AddToLump("}\n\n", 3);
+	out += "}\n\n";
 }
 
 //===========================================================================
@@ -808,22 +886,15 @@ void FProcessor::WriteThingUDMF(FWadWriter &out, IntThing *th, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteLinedefUDMF(FWadWriter &out, IntLineDef *ld, int num)
+void FProcessor::WriteLinedefUDMF(std::string &out, IntLineDef *ld, int num)
 {
-	out.AddToLump("linedef", 7);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockStart(out, "linedef", num);
 	WriteIntProp(out, "v1", ld->v1);
 	WriteIntProp(out, "v2", ld->v2);
 	if (ld->sidenum[0] != NO_INDEX) WriteIntProp(out, "sidefront", ld->sidenum[0]);
 	if (ld->sidenum[1] != NO_INDEX) WriteIntProp(out, "sideback", ld->sidenum[1]);
 	WriteProps(out, ld->props);
-	out.AddToLump("}\n\n", 3);
+	out += "}\n\n";
 }
 
 //===========================================================================
@@ -832,19 +903,12 @@ void FProcessor::WriteLinedefUDMF(FWadWriter &out, IntLineDef *ld, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteSidedefUDMF(FWadWriter &out, IntSideDef *sd, int num)
+void FProcessor::WriteSidedefUDMF(std::string &out, IntSideDef *sd, int num)
 {
-	out.AddToLump("sidedef", 7);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockStart(out, "sidedef", num);
 	WriteIntProp(out, "sector", sd->sector);
 	WriteProps(out, sd->props);
-	out.AddToLump("}\n\n", 3);
+	out += "}\n\n";
 }
 
 //===========================================================================
@@ -853,18 +917,11 @@ void FProcessor::WriteSidedefUDMF(FWadWriter &out, IntSideDef *sd, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteSectorUDMF(FWadWriter &out, IntSector *sec, int num)
+void FProcessor::WriteSectorUDMF(std::string &out, IntSector *sec, int num)
 {
-	out.AddToLump("sector", 6);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockStart(out, "sector", num);
 	WriteProps(out, sec->props);
-	out.AddToLump("}\n\n", 3);
+	out += "}\n\n";
 }
 
 //===========================================================================
@@ -873,33 +930,36 @@ void FProcessor::WriteSectorUDMF(FWadWriter &out, IntSector *sec, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteVertexUDMF(FWadWriter &out, IntVertex *vt, int num)
+void FProcessor::WriteVertexUDMF(std::string &out, IntVertex *vt, int num)
 {
-	out.AddToLump("vertex", 6);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockStart(out, "vertex", num);
 	WriteProps(out, vt->props);
-	out.AddToLump("}\n\n", 3);
+	out += "}\n\n";
 }
 
 //===========================================================================
 //
 // writes a UDMF text map
 //
+// The whole map is put together in memory and written as one lump. The
+// text read in is about as long as what is written, so it is used to
+// size the buffer, with some room for the comments and the properties
+// that are not kept as text.
+//
 //===========================================================================
 
 void FProcessor::WriteTextMap(FWadWriter &out)
 {
-	out.StartWritingLump("TEXTMAP");
-	WriteProps(out, Level.props);
+	std::string text;
+	int insize = 0;
+
+	Wad.LumpData(Lump+1, insize);
+	text.reserve(insize + (Level.NumThings() + Level.NumOrgVerts + Level.NumLines() + Level.NumSides() + Level.NumSectors()) * 32);
+
+	WriteProps(text, Level.props);
 	for(int i = 0; i < Level.NumThings(); i++)
 	{
-		WriteThingUDMF(out, &Level.Things[i], i);
+		WriteThingUDMF(text, &Level.Things[i], i);
 	}
 
 	for(int i = 0; i < Level.NumOrgVerts; i++)
@@ -910,23 +970,25 @@ void FProcessor::WriteTextMap(FWadWriter &out)
 			// not valid!
 			throw std::runtime_error("Invalid vertex data.");
 		}
-		WriteVertexUDMF(out, &Level.VertexProps[vt->index-1], i);
+		WriteVertexUDMF(text, &Level.VertexProps[vt->index-1], i);
 	}
 
 	for(int i = 0; i < Level.NumLines(); i++)
 	{
-		WriteLinedefUDMF(out, &Level.Lines[i], i);
+		WriteLinedefUDMF(text, &Level.Lines[i], i);
 	}
 
 	for(int i = 0; i < Level.NumSides(); i++)
 	{
-		WriteSidedefUDMF(out, &Level.Sides[i], i);
+		WriteSidedefUDMF(text, &Level.Sides[i], i);
 	}
 
 	for(int i = 0; i < Level.NumSectors(); i++)
 	{
-		WriteSectorUDMF(out, &Level.Sectors[i], i);
+		WriteSectorUDMF(text, &Level.Sectors[i], i);
 	}
+
+	out.WriteLump("TEXTMAP", text.data(), (int)text.size());
 }
 
 //===========================================================================
@@ -949,12 +1011,15 @@ void FProcessor::WriteUDMF(FWadWriter &out)
 		if (stricmp(lumpname, "ZNODES") &&
 			stricmp(lumpname, "BLOCKMAP") &&
 			stricmp(lumpname, "REJECT") &&
-			stricmp(lumpname, "LIGHTMAP"))
+			stricmp(lumpname, "LIGHTMAP") &&
+			(Level.GLPVS == nullptr || stricmp(lumpname, "GL_PVS")))
 		{
 			out.CopyLump(Wad, i);
 		}
 	}
 
+	WriteGLPVS(out, true);
+
 	if (LightmapMesh)
 	{
 		LightmapMesh->AddLightmapLump(Level, out);
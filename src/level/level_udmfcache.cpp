@@ -0,0 +1,556 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "level/level.h"
+#include "framework/file.h"
+
+// With --udmf-cache, what ParseTextMap made of a TEXTMAP is kept in a file
+// named after a hash of the lump's text. When the same text comes in again,
+// the arrays are read back from that file instead of parsing it. The file
+// is a header, then the records of each kind of object, then the props, the
+// line ids and sector tags, and last all strings, each ending in a 0. The
+// records are in native layout, since the cache only has to be readable by
+// the build that wrote it; a change to them needs a new magic.
+
+static const char CacheMagic[4] = { 'Z', 'U', 'C', '1' };
+
+struct FCacheHeader
+{
+	char Magic[4];
+	uint32_t TextSize;
+	uint64_t Hash;
+	uint32_t Extended;
+	uint32_t NumLevelProps;
+	uint32_t NumThings, NumVertices, NumLines, NumSides, NumSectors;
+	uint32_t NumProps, NumInts, StringsSize;
+};
+
+struct FCachedThing
+{
+	fixed_t x, y;
+	short angle, pitch, type;
+	float height, alpha;
+	int special;
+	int args[5];
+	uint32_t arg0str;
+	uint32_t NumProps;
+};
+
+struct FCachedVertex
+{
+	fixed_t x, y;
+	double zfloor, zceiling;
+	uint32_t NumProps;
+};
+
+struct FCachedLine
+{
+	uint32_t v1, v2;
+	int flags, special;
+	int args[5];
+	uint32_t sidenum[2];
+	SideDefSampleProps sampling;
+	uint32_t NumIds, NumProps;
+};
+
+struct FCachedSide
+{
+	short textureoffset, rowoffset;
+	uint32_t toptexture, bottomtexture, midtexture;
+	int sector;
+	SideDefSampleProps sampling;
+	uint32_t NumProps;
+};
+
+struct FCachedSector
+{
+	short floorheight, ceilingheight, lightlevel, special, tag;
+	uint32_t floorpic, ceilingpic;
+	Plane ceilingplane, floorplane;
+	double floorTexZ, ceilingTexZ;
+	int sampleDistanceCeiling, sampleDistanceFloor;
+	uint32_t NumTags, NumProps;
+};
+
+struct FCachedProp
+{
+	uint32_t Key, Value;
+};
+
+//==========================================================================
+//
+// Hashes a lump, such as the text of a TEXTMAP
+//
+// Four independent lanes take 8 bytes each per step, mixed the way XXH64
+// mixes them, so hashing keeps up with reading the text. FNV-1a, one byte
+// at a time, took half as long as loading the cached level.
+//
+//==========================================================================
+
+static inline uint64_t HashRound (uint64_t lane, uint64_t input)
+{
+	lane += input * 14029467366897019727ull;
+	lane = (lane << 31) | (lane >> 33);
+	return lane * 11400714785074694791ull;
+}
+
+uint64_t FProcessor::HashLump (const void *data, int size)
+{
+	const char *text = (const char *)data;
+	uint64_t lanes[4] = { 1, 2, 3, 4 };
+	uint64_t hash = 14695981039346656037ull ^ (uint64_t)size;
+	int i = 0;
+
+	for (; i + 32 <= size; i += 32)
+	{
+		for (int j = 0; j < 4; ++j)
+		{
+			uint64_t input;
+			memcpy (&input, text + i + j * 8, sizeof(input));
+			lanes[j] = HashRound (lanes[j], input);
+		}
+	}
+	for (int j = 0; j < 4; ++j)
+	{
+		hash = HashRound (hash, lanes[j]);
+	}
+	for (; i < size; ++i)
+	{
+		hash = (hash ^ (uint8_t)text[i]) * 1099511628211ull;
+	}
+	hash ^= hash >> 33;
+	hash *= 11400714785074694791ull;
+	hash ^= hash >> 29;
+	return hash;
+}
+
+// Texture names are at most 63 characters, like in the parser.
+static void CopyName (char (&dest)[64], const char *name)
+{
+	strncpy (dest, name, sizeof(dest) - 1);
+	dest[sizeof(dest) - 1] = 0;
+}
+
+static FString CacheFileName (uint64_t hash)
+{
+	FString name;
+	name.Format ("%s/%016llx.zdu", UDMFCacheDir, (unsigned long long)hash);
+	return name;
+}
+
+//==========================================================================
+//
+// Fills the level from the cache entry for this text. Returns false if
+// there is no usable entry, in which case nothing has been changed.
+//
+//==========================================================================
+
+bool FProcessor::LoadUDMFCache (uint64_t hash, int textsize)
+{
+	std::vector<uint8_t> data;
+	FCacheHeader header;
+
+	try
+	{
+		data = File::read_all_bytes (CacheFileName (hash).GetChars());
+	}
+	catch (const std::runtime_error &)
+	{
+		return false;
+	}
+
+	if (data.size() < sizeof(header))
+	{
+		return false;
+	}
+	memcpy (&header, data.data(), sizeof(header));
+	if (memcmp (header.Magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+		header.Hash != hash || header.TextSize != (uint32_t)textsize)
+	{
+		return false;
+	}
+
+	uint64_t expected = sizeof(header) +
+		(uint64_t)header.NumThings * sizeof(FCachedThing) +
+		(uint64_t)header.NumVertices * sizeof(FCachedVertex) +
+		(uint64_t)header.NumLines * sizeof(FCachedLine) +
+		(uint64_t)header.NumSides * sizeof(FCachedSide) +
+		(uint64_t)header.NumSectors * sizeof(FCachedSector) +
+		(uint64_t)header.NumProps * sizeof(FCachedProp) +
+		(uint64_t)header.NumInts * sizeof(int) +
+		header.StringsSize;
+	if (expected != data.size() || header.StringsSize == 0 || data.back() != 0)
+	{
+		return false;
+	}
+
+	const uint8_t *things = data.data() + sizeof(header);
+	const uint8_t *vertices = things + header.NumThings * sizeof(FCachedThing);
+	const uint8_t *lines = vertices + header.NumVertices * sizeof(FCachedVertex);
+	const uint8_t *sides = lines + header.NumLines * sizeof(FCachedLine);
+	const uint8_t *sectors = sides + header.NumSides * sizeof(FCachedSide);
+	const uint8_t *props = sectors + header.NumSectors * sizeof(FCachedSector);
+	const uint8_t *ints = props + header.NumProps * sizeof(FCachedProp);
+	const uint8_t *strings = ints + header.NumInts * sizeof(int);
+
+	// Check that every count stays within its array before anything is
+	// touched, so a damaged entry cannot leave a half-loaded level behind.
+	uint64_t numprops = header.NumLevelProps, numints = 0;
+	for (uint32_t i = 0; i < header.NumThings; ++i)
+	{
+		FCachedThing th;
+		memcpy (&th, things + i * sizeof(th), sizeof(th));
+		numprops += th.NumProps;
+		if (th.arg0str >= header.StringsSize) return false;
+	}
+	for (uint32_t i = 0; i < header.NumVertices; ++i)
+	{
+		FCachedVertex vt;
+		memcpy (&vt, vertices + i * sizeof(vt), sizeof(vt));
+		numprops += vt.NumProps;
+	}
+	for (uint32_t i = 0; i < header.NumLines; ++i)
+	{
+		FCachedLine ld;
+		memcpy (&ld, lines + i * sizeof(ld), sizeof(ld));
+		numprops += ld.NumProps;
+		numints += ld.NumIds;
+	}
+	for (uint32_t i = 0; i < header.NumSides; ++i)
+	{
+		FCachedSide sd;
+		memcpy (&sd, sides + i * sizeof(sd), sizeof(sd));
+		numprops += sd.NumProps;
+		if (sd.toptexture >= header.StringsSize || sd.bottomtexture >= header.StringsSize || sd.midtexture >= header.StringsSize) return false;
+	}
+	for (uint32_t i = 0; i < header.NumSectors; ++i)
+	{
+		FCachedSector sec;
+		memcpy (&sec, sectors + i * sizeof(sec), sizeof(sec));
+		numprops += sec.NumProps;
+		numints += sec.NumTags;
+		if (sec.floorpic >= header.StringsSize || sec.ceilingpic >= header.StringsSize) return false;
+	}
+	if (numprops != header.NumProps || numints != header.NumInts)
+	{
+		return false;
+	}
+	for (uint32_t i = 0; i < header.NumProps; ++i)
+	{
+		FCachedProp prop;
+		memcpy (&prop, props + i * sizeof(prop), sizeof(prop));
+		if (prop.Key >= header.StringsSize || prop.Value >= header.StringsSize) return false;
+	}
+
+	// The strings are copied once, as a whole, and the props point into them.
+	// Since every key is stored once, its atom only has to be looked up once.
+	const char *text = Strings.Copy (std::string_view ((const char *)strings, header.StringsSize));
+	std::unordered_map<uint32_t, int> atoms;
+	uint32_t nextprop = 0, nextint = 0;
+
+	auto readprops = [&](UDMFProps &out, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; ++i, ++nextprop)
+		{
+			FCachedProp prop;
+			memcpy (&prop, props + nextprop * sizeof(prop), sizeof(prop));
+			auto atom = atoms.try_emplace (prop.Key, 0);
+			if (atom.second)
+			{
+				atom.first->second = InternUDMFKey (text + prop.Key);
+			}
+			UDMFKey k = { text + prop.Key, text + prop.Value, atom.first->second };
+			out.Push (k);
+		}
+	};
+	auto readint = [&]()
+	{
+		int value;
+		memcpy (&value, ints + (nextint++) * sizeof(value), sizeof(value));
+		return value;
+	};
+
+	Extended = header.Extended != 0;
+	readprops (Level.props, header.NumLevelProps);
+
+	Level.Things.Reserve(header.NumThings);
+	for (uint32_t i = 0; i < header.NumThings; ++i)
+	{
+		FCachedThing rec;
+		memcpy (&rec, things + i * sizeof(rec), sizeof(rec));
+		IntThing *th = &Level.Things[i];
+		th->x = rec.x;
+		th->y = rec.y;
+		th->angle = rec.angle;
+		th->pitch = rec.pitch;
+		th->type = rec.type;
+		th->height = rec.height;
+		th->alpha = rec.alpha;
+		th->special = rec.special;
+		memcpy (th->args, rec.args, sizeof(th->args));
+		th->arg0str = text + rec.arg0str;
+		readprops (th->props, rec.NumProps);
+	}
+
+	Level.Vertices = new WideVertex[header.NumVertices];
+	Level.NumVertices = header.NumVertices;
+	Level.VertexProps.Reserve(header.NumVertices);
+	for (uint32_t i = 0; i < header.NumVertices; ++i)
+	{
+		FCachedVertex rec;
+		memcpy (&rec, vertices + i * sizeof(rec), sizeof(rec));
+		Level.Vertices[i].x = rec.x;
+		Level.Vertices[i].y = rec.y;
+		Level.Vertices[i].index = i + 1;
+		IntVertex *vtp = &Level.VertexProps[i];
+		vtp->zfloor = rec.zfloor;
+		vtp->zceiling = rec.zceiling;
+		readprops (vtp->props, rec.NumProps);
+	}
+
+	Level.Lines.Reserve(header.NumLines);
+	for (uint32_t i = 0; i < header.NumLines; ++i)
+	{
+		FCachedLine rec;
+		memcpy (&rec, lines + i * sizeof(rec), sizeof(rec));
+		IntLineDef *ld = &Level.Lines[i];
+		ld->v1 = rec.v1;
+		ld->v2 = rec.v2;
+		ld->flags = rec.flags;
+		ld->special = rec.special;
+		memcpy (ld->args, rec.args, sizeof(ld->args));
+		ld->sidenum[0] = rec.sidenum[0];
+		ld->sidenum[1] = rec.sidenum[1];
+		ld->sampling = rec.sampling;
+		for (uint32_t j = 0; j < rec.NumIds; ++j)
+		{
+			ld->ids.Push (readint ());
+		}
+		readprops (ld->props, rec.NumProps);
+	}
+
+	Level.Sides.Reserve(header.NumSides);
+	for (uint32_t i = 0; i < header.NumSides; ++i)
+	{
+		FCachedSide rec;
+		memcpy (&rec, sides + i * sizeof(rec), sizeof(rec));
+		IntSideDef *sd = &Level.Sides[i];
+		sd->textureoffset = rec.textureoffset;
+		sd->rowoffset = rec.rowoffset;
+		CopyName (sd->toptexture, text + rec.toptexture);
+		CopyName (sd->bottomtexture, text + rec.bottomtexture);
+		CopyName (sd->midtexture, text + rec.midtexture);
+		sd->sector = rec.sector;
+		sd->sampling = rec.sampling;
+		readprops (sd->props, rec.NumProps);
+	}
+
+	Level.Sectors.Reserve(header.NumSectors);
+	for (uint32_t i = 0; i < header.NumSectors; ++i)
+	{
+		FCachedSector rec;
+		memcpy (&rec, sectors + i * sizeof(rec), sizeof(rec));
+		IntSector *sec = &Level.Sectors[i];
+		memset (&sec->data, 0, sizeof(sec->data));
+		sec->data.floorheight = rec.floorheight;
+		sec->data.ceilingheight = rec.ceilingheight;
+		sec->data.lightlevel = rec.lightlevel;
+		sec->data.special = rec.special;
+		sec->data.tag = rec.tag;
+		CopyName (sec->data.floorpic, text + rec.floorpic);
+		CopyName (sec->data.ceilingpic, text + rec.ceilingpic);
+		sec->ceilingplane = rec.ceilingplane;
+		sec->floorplane = rec.floorplane;
+		sec->floorTexZ = rec.floorTexZ;
+		sec->ceilingTexZ = rec.ceilingTexZ;
+		sec->sampleDistanceCeiling = rec.sampleDistanceCeiling;
+		sec->sampleDistanceFloor = rec.sampleDistanceFloor;
+		for (uint32_t j = 0; j < rec.NumTags; ++j)
+		{
+			sec->tags.Push (readint ());
+		}
+		readprops (sec->props, rec.NumProps);
+	}
+	return true;
+}
+
+//==========================================================================
+//
+// Writes what was just parsed to the cache
+//
+//==========================================================================
+
+void FProcessor::SaveUDMFCache (uint64_t hash, int textsize)
+{
+	std::vector<uint8_t> records, propdata, intdata;
+	std::string strings;
+	std::unordered_map<std::string_view, uint32_t> stringoffsets;
+	FCacheHeader header;
+
+	// Most keys and many values are the same for lots of objects, so each
+	// string is only stored once.
+	auto addstring = [&](const char *s)
+	{
+		auto found = stringoffsets.try_emplace (s, (uint32_t)strings.size());
+		if (found.second)
+		{
+			strings.append (s, strlen (s) + 1);
+		}
+		return found.first->second;
+	};
+	auto addrecord = [](std::vector<uint8_t> &out, const void *rec, size_t size)
+	{
+		out.insert (out.end(), (const uint8_t *)rec, (const uint8_t *)rec + size);
+	};
+	auto addprops = [&](const UDMFProps &props)
+	{
+		for (const UDMFKey &key : props)
+		{
+			FCachedProp prop = { addstring (key.key), addstring (key.value) };
+			addrecord (propdata, &prop, sizeof(prop));
+		}
+		return props.Size();
+	};
+	auto addints = [&](const TArray<int> &values)
+	{
+		for (int value : values)
+		{
+			addrecord (intdata, &value, sizeof(value));
+		}
+		return values.Size();
+	};
+
+	memset (&header, 0, sizeof(header));
+	memcpy (header.Magic, CacheMagic, sizeof(CacheMagic));
+	header.TextSize = textsize;
+	header.Hash = hash;
+	header.Extended = Extended;
+	header.NumLevelProps = addprops (Level.props);
+	header.NumThings = Level.Things.Size();
+	header.NumVertices = Level.NumVertices;
+	header.NumLines = Level.Lines.Size();
+	header.NumSides = Level.Sides.Size();
+	header.NumSectors = Level.Sectors.Size();
+
+	// Records are cleared first, so that padding does not make two entries
+	// for the same text differ. Lines and sides have no padding, and their
+	// sampling properties cannot be cleared with memset.
+	for (const IntThing &th : Level.Things)
+	{
+		FCachedThing rec;
+		memset (&rec, 0, sizeof(rec));
+		rec.x = th.x;
+		rec.y = th.y;
+		rec.angle = th.angle;
+		rec.pitch = th.pitch;
+		rec.type = th.type;
+		rec.height = th.height;
+		rec.alpha = th.alpha;
+		rec.special = th.special;
+		memcpy (rec.args, th.args, sizeof(rec.args));
+		rec.arg0str = addstring (th.arg0str.GetChars());
+		rec.NumProps = addprops (th.props);
+		addrecord (records, &rec, sizeof(rec));
+	}
+	for (int i = 0; i < Level.NumVertices; ++i)
+	{
+		FCachedVertex rec;
+		memset (&rec, 0, sizeof(rec));
+		rec.x = Level.Vertices[i].x;
+		rec.y = Level.Vertices[i].y;
+		rec.zfloor = Level.VertexProps[i].zfloor;
+		rec.zceiling = Level.VertexProps[i].zceiling;
+		rec.NumProps = addprops (Level.VertexProps[i].props);
+		addrecord (records, &rec, sizeof(rec));
+	}
+	for (const IntLineDef &ld : Level.Lines)
+	{
+		FCachedLine rec = {};
+		rec.v1 = ld.v1;
+		rec.v2 = ld.v2;
+		rec.flags = ld.flags;
+		rec.special = ld.special;
+		memcpy (rec.args, ld.args, sizeof(rec.args));
+		rec.sidenum[0] = ld.sidenum[0];
+		rec.sidenum[1] = ld.sidenum[1];
+		rec.sampling = ld.sampling;
+		rec.NumIds = addints (ld.ids);
+		rec.NumProps = addprops (ld.props);
+		addrecord (records, &rec, sizeof(rec));
+	}
+	for (const IntSideDef &sd : Level.Sides)
+	{
+		FCachedSide rec = {};
+		rec.textureoffset = sd.textureoffset;
+		rec.rowoffset = sd.rowoffset;
+		rec.toptexture = addstring (sd.toptexture);
+		rec.bottomtexture = addstring (sd.bottomtexture);
+		rec.midtexture = addstring (sd.midtexture);
+		rec.sector = sd.sector;
+		rec.sampling = sd.sampling;
+		rec.NumProps = addprops (sd.props);
+		addrecord (records, &rec, sizeof(rec));
+	}
+	for (const IntSector &sec : Level.Sectors)
+	{
+		FCachedSector rec;
+		memset (&rec, 0, sizeof(rec));
+		rec.floorheight = sec.data.floorheight;
+		rec.ceilingheight = sec.data.ceilingheight;
+		rec.lightlevel = sec.data.lightlevel;
+		rec.special = sec.data.special;
+		rec.tag = sec.data.tag;
+		rec.floorpic = addstring (sec.data.floorpic);
+		rec.ceilingpic = addstring (sec.data.ceilingpic);
+		rec.ceilingplane = sec.ceilingplane;
+		rec.floorplane = sec.floorplane;
+		rec.floorTexZ = sec.floorTexZ;
+		rec.ceilingTexZ = sec.ceilingTexZ;
+		rec.sampleDistanceCeiling = sec.sampleDistanceCeiling;
+		rec.sampleDistanceFloor = sec.sampleDistanceFloor;
+		rec.NumTags = addints (sec.tags);
+		rec.NumProps = addprops (sec.props);
+		addrecord (records, &rec, sizeof(rec));
+	}
+
+	header.NumProps = (uint32_t)(propdata.size() / sizeof(FCachedProp));
+	header.NumInts = (uint32_t)(intdata.size() / sizeof(int));
+	header.StringsSize = (uint32_t)strings.size();
+
+	std::vector<uint8_t> data;
+	data.reserve (sizeof(header) + records.size() + propdata.size() + intdata.size() + strings.size());
+	addrecord (data, &header, sizeof(header));
+	addrecord (data, records.data(), records.size());
+	addrecord (data, propdata.data(), propdata.size());
+	addrecord (data, intdata.data(), intdata.size());
+	addrecord (data, strings.data(), strings.size());
+
+	// Like the map cache, the entry is written under a temporary name for
+	// this thread and renamed once it is complete, so that a partial entry is
+	// never read, and two threads parsing the same text do not write to the
+	// same file.
+	FString name = CacheFileName (hash);
+	FString temp;
+	temp.Format ("%s.%zx.tmp", name.GetChars(), std::hash<std::thread::id>() (std::this_thread::get_id()));
+	try
+	{
+		File::write_all_bytes (temp.GetChars(), data.data(), data.size());
+	}
+	catch (const std::runtime_error &)
+	{
+		remove (temp.GetChars());
+		printf ("   Could not write to the UDMF cache in %s.\n", UDMFCacheDir);
+		return;
+	}
+	// A damaged entry that LoadUDMFCache turned down is still in the way.
+	remove (name.GetChars());
+	if (rename (temp.GetChars(), name.GetChars()) != 0)
+	{
+		remove (temp.GetChars());
+		printf ("   Could not write to the UDMF cache in %s.\n", UDMFCacheDir);
+	}
+}
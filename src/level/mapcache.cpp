@@ -0,0 +1,277 @@
+#include <string.h>
+#include <stdio.h>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include "level/level.h"
+#include "level/mapcache.h"
+#include "framework/file.h"
+#include "framework/filesystem.h"
+
+extern int LMDims;
+extern bool NoRtx;
+extern int ambientSampleCount;
+
+FMapCache::FMapCache (const char *dir)
+	: Dir (dir), ResourceHash (HashResources ())
+{
+}
+
+FString FMapCache::FileName (uint64_t hash) const
+{
+	FString name;
+	name.Format ("%s/%016llx.wad", Dir, (unsigned long long)hash);
+	return name;
+}
+
+//==========================================================================
+//
+// The lightmap depends on the textures in the resource folder: their sizes
+// decide the height of middle walls and whether upper and lower walls are
+// there at all, and they set the texture coordinates. Only PNGs are ever
+// decoded, and a texture can be looked up by its bare name, so every file
+// ending in .png or with no extension is hashed, in name order.
+//
+//==========================================================================
+
+uint64_t FMapCache::HashResources ()
+{
+	std::vector<std::pair<std::string, int>> files;
+	for (int i = 0; i < fileSystem.GetFileCount(); ++i)
+	{
+		std::string name = fileSystem.GetFileFullName (i);
+		if (FilePath::has_extension (name, "png") || FilePath::extension (name).empty())
+		{
+			files.emplace_back (name, i);
+		}
+	}
+	std::sort (files.begin(), files.end());
+
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](uint64_t value)
+	{
+		for (int i = 0; i < 8; ++i, value >>= 8)
+		{
+			hash = (hash ^ (uint8_t)value) * 1099511628211ull;
+		}
+	};
+
+	for (const auto &file : files)
+	{
+		FileData data = fileSystem.ReadFile (file.second);
+		for (char c : file.first)
+		{
+			mix (c);
+		}
+		mix (0);
+		mix (data.Buffer.size());
+		mix (FProcessor::HashLump (data.Buffer.data(), (int)data.Buffer.size()));
+	}
+	return hash;
+}
+
+//==========================================================================
+//
+// Hashes the lumps of the map starting at lump, along with the textures and
+// every option that can change what is written for it. Options that only
+// change how it is built, like the number of threads or the node cache, are
+// left out.
+//
+//==========================================================================
+
+uint64_t FMapCache::HashMap (FWadReader &wad, int lump) const
+{
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](uint64_t value)
+	{
+		for (int i = 0; i < 8; ++i, value >>= 8)
+		{
+			hash = (hash ^ (uint8_t)value) * 1099511628211ull;
+		}
+	};
+	auto mixdouble = [&mix](double value)
+	{
+		uint64_t bits;
+		memcpy (&bits, &value, sizeof(bits));
+		mix (bits);
+	};
+
+	for (const char *p = ZDRAY_VERSION; *p != 0; ++p)
+	{
+		mix (*p);
+	}
+	mix (BuildNodes);
+	mix (BuildGLNodes);
+	mix (ConformNodes);
+	mix (GLOnly);
+	mix (WriteComments);
+	mix (NoPrune);
+	mix (BlockmapMode);
+	mix (RejectMode);
+	mix (SplitterMode);
+	mix (ExactSides);
+	mix (MaxSegs);
+	mix (SplitCost);
+	mix (AAPreference);
+	mix (CheckPolyobjs);
+	mix (CompressNodes);
+	mix (CompressGLNodes);
+	mix (ForceCompression);
+	mix (V5GLNodes);
+	mix (SSELevel);
+	mix (BuildGLPVS);
+	mixdouble (PVSMaxDistance);
+	mixdouble (PVSTimeLimit);
+	mix (LMDims);
+	mix (NoRtx);
+	mix (ambientSampleCount);
+	mix (ResourceHash);
+
+	int end = wad.LumpAfterMap (lump);
+	for (int i = lump; i < end; ++i)
+	{
+		uint64_t name = 0;
+		const char *lumpname = wad.LumpName (i);
+		size_t len = strlen (lumpname);
+		int size;
+
+		memcpy (&name, lumpname, len < sizeof(name) ? len : sizeof(name));
+		const uint8_t *data = wad.LumpData (i, size);
+		mix (name);
+		mix (size);
+		mix (FProcessor::HashLump (data, size));
+	}
+	return hash;
+}
+
+//==========================================================================
+//
+// Makes sure an entry is a wad whose lumps all lie inside the file, so a
+// damaged one is built again instead of being copied.
+//
+//==========================================================================
+
+bool FMapCache::CheckEntry (const std::vector<uint8_t> &entry)
+{
+	WadHeader header;
+
+	if (entry.size() < sizeof(header))
+	{
+		return false;
+	}
+	memcpy (&header, entry.data(), sizeof(header));
+
+	int64_t numlumps = LittleLong (header.NumLumps);
+	int64_t directory = LittleLong (header.Directory);
+	if (memcmp (header.Magic, "PWAD", 4) != 0 || numlumps < 0 || directory < 0 ||
+		directory + numlumps * (int64_t)sizeof(WadLump) > (int64_t)entry.size())
+	{
+		return false;
+	}
+	for (int64_t i = 0; i < numlumps; ++i)
+	{
+		WadLump lump;
+		memcpy (&lump, entry.data() + directory + i * sizeof(WadLump), sizeof(lump));
+
+		int64_t pos = LittleLong (lump.FilePos);
+		int64_t size = LittleLong (lump.Size);
+		if (pos < 0 || size < 0 || pos + size > (int64_t)entry.size())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FMapCache::Load (uint64_t hash, std::vector<uint8_t> &entry) const
+{
+	try
+	{
+		entry = File::read_all_bytes (FileName (hash).GetChars());
+	}
+	catch (const std::runtime_error &)
+	{
+		entry.clear ();
+		return false;
+	}
+	if (!CheckEntry (entry))
+	{
+		entry.clear ();
+		return false;
+	}
+	return true;
+}
+
+void FMapCache::WriteEntry (const std::vector<uint8_t> &entry, FWadWriter &out)
+{
+	WadHeader header;
+	memcpy (&header, entry.data(), sizeof(header));
+
+	int numlumps = LittleLong (header.NumLumps);
+	const uint8_t *directory = entry.data() + LittleLong (header.Directory);
+	for (int i = 0; i < numlumps; ++i)
+	{
+		WadLump lump;
+		char name[9];
+
+		memcpy (&lump, directory + i * sizeof(WadLump), sizeof(lump));
+		strncpy (name, lump.Name, 8);
+		name[8] = 0;
+		out.WriteLump (name, entry.data() + LittleLong (lump.FilePos), LittleLong (lump.Size));
+	}
+}
+
+//==========================================================================
+//
+// The entry is written under a temporary name and renamed once it is
+// complete, so a run that stops halfway never leaves a partial entry that
+// a later run would copy. The temporary name is different for each thread,
+// since two maps that are the same get the same entry.
+//
+//==========================================================================
+
+void FMapCache::Write (uint64_t hash, FProcessor &map, FWadWriter &out) const
+{
+	FString name = FileName (hash);
+	FString temp;
+	temp.Format ("%s.%zx.tmp", name.GetChars(), std::hash<std::thread::id>() (std::this_thread::get_id()));
+	std::unique_ptr<FWadWriter> entrywad;
+	std::vector<uint8_t> entry;
+
+	try
+	{
+		entrywad.reset (new FWadWriter (temp.GetChars(), false));
+	}
+	catch (const std::runtime_error &)
+	{
+		printf ("   Could not write to the map cache in %s.\n", Dir);
+		map.Write (out);
+		return;
+	}
+
+	try
+	{
+		map.Write (*entrywad);
+		entrywad->Close ();
+		entrywad.reset ();
+		entry = File::read_all_bytes (temp.GetChars());
+	}
+	catch (...)
+	{
+		entrywad.reset ();
+		remove (temp.GetChars());
+		throw;
+	}
+
+	// A damaged entry that Load turned down is still in the way.
+	remove (name.GetChars());
+	if (rename (temp.GetChars(), name.GetChars()) != 0)
+	{
+		remove (temp.GetChars());
+		printf ("   Could not write to the map cache in %s.\n", Dir);
+	}
+	WriteEntry (entry, out);
+}
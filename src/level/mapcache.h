@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "framework/zstring.h"
+#include "wad/wad.h"
+
+class FProcessor;
+
+// Keeps everything that was written for each map in a directory, so a map
+// that has not changed since it was last built is copied instead of being
+// built again. Each entry is a small wad with the map's output lumps, named
+// after a hash of the map's input lumps, the textures in the resource folder
+// and every option that can change what gets written for it. The textures
+// are hashed once, when the cache is created.
+//
+// HashMap and Load may be called from any thread. Write and WriteEntry write
+// to the output wad, so only the thread writing the maps may call them.
+class FMapCache
+{
+public:
+	FMapCache (const char *dir);
+
+	uint64_t HashMap (FWadReader &wad, int lump) const;
+
+	// Reads the entry for hash. Returns false if there is none, or it is damaged.
+	bool Load (uint64_t hash, std::vector<uint8_t> &entry) const;
+
+	// Writes the lumps of an entry Load returned.
+	static void WriteEntry (const std::vector<uint8_t> &entry, FWadWriter &out);
+
+	// Writes the map as a new entry for hash, and then to out.
+	void Write (uint64_t hash, FProcessor &map, FWadWriter &out) const;
+
+private:
+	FString FileName (uint64_t hash) const;
+	static bool CheckEntry (const std::vector<uint8_t> &entry);
+	static uint64_t HashResources ();
+
+	const char *Dir;
+	uint64_t ResourceHash;
+};
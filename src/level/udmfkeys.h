@@ -0,0 +1,119 @@
+// UDMF keys that get an atom of their own, so they can be found without comparing strings.
+// Keys are matched without regard to case. Any other key is given an atom when it is first read.
+
+// map
+DEFINE_UDMFKEY(namespace)
+DEFINE_UDMFKEY(comment)
+
+// shared
+DEFINE_UDMFKEY(id)
+DEFINE_UDMFKEY(special)
+DEFINE_UDMFKEY(arg0)
+DEFINE_UDMFKEY(arg1)
+DEFINE_UDMFKEY(arg2)
+DEFINE_UDMFKEY(arg3)
+DEFINE_UDMFKEY(arg4)
+DEFINE_UDMFKEY(arg0str)
+DEFINE_UDMFKEY(moreids)
+
+// thing
+DEFINE_UDMFKEY(x)
+DEFINE_UDMFKEY(y)
+DEFINE_UDMFKEY(height)
+DEFINE_UDMFKEY(angle)
+DEFINE_UDMFKEY(pitch)
+DEFINE_UDMFKEY(type)
+DEFINE_UDMFKEY(alpha)
+DEFINE_UDMFKEY(skill1)
+DEFINE_UDMFKEY(skill2)
+DEFINE_UDMFKEY(skill3)
+DEFINE_UDMFKEY(skill4)
+DEFINE_UDMFKEY(skill5)
+DEFINE_UDMFKEY(ambush)
+DEFINE_UDMFKEY(single)
+DEFINE_UDMFKEY(dm)
+DEFINE_UDMFKEY(coop)
+DEFINE_UDMFKEY(friend)
+DEFINE_UDMFKEY(dormant)
+DEFINE_UDMFKEY(class1)
+DEFINE_UDMFKEY(class2)
+DEFINE_UDMFKEY(class3)
+DEFINE_UDMFKEY(standing)
+DEFINE_UDMFKEY(strifeally)
+DEFINE_UDMFKEY(translucent)
+DEFINE_UDMFKEY(invisible)
+
+// linedef
+DEFINE_UDMFKEY(v1)
+DEFINE_UDMFKEY(v2)
+DEFINE_UDMFKEY(sidefront)
+DEFINE_UDMFKEY(sideback)
+DEFINE_UDMFKEY(blocking)
+DEFINE_UDMFKEY(blockmonsters)
+DEFINE_UDMFKEY(twosided)
+DEFINE_UDMFKEY(dontpegtop)
+DEFINE_UDMFKEY(dontpegbottom)
+DEFINE_UDMFKEY(secret)
+DEFINE_UDMFKEY(blocksound)
+DEFINE_UDMFKEY(dontdraw)
+DEFINE_UDMFKEY(mapped)
+DEFINE_UDMFKEY(passuse)
+DEFINE_UDMFKEY(jumpover)
+DEFINE_UDMFKEY(blockfloaters)
+DEFINE_UDMFKEY(playercross)
+DEFINE_UDMFKEY(playeruse)
+DEFINE_UDMFKEY(monstercross)
+DEFINE_UDMFKEY(monsteruse)
+DEFINE_UDMFKEY(impact)
+DEFINE_UDMFKEY(playerpush)
+DEFINE_UDMFKEY(monsterpush)
+DEFINE_UDMFKEY(missilecross)
+DEFINE_UDMFKEY(repeatspecial)
+
+// sidedef
+DEFINE_UDMFKEY(sector)
+DEFINE_UDMFKEY(offsetx)
+DEFINE_UDMFKEY(offsety)
+DEFINE_UDMFKEY(offsetx_mid)
+DEFINE_UDMFKEY(offsety_mid)
+DEFINE_UDMFKEY(texturetop)
+DEFINE_UDMFKEY(texturemiddle)
+DEFINE_UDMFKEY(texturebottom)
+
+// sector
+DEFINE_UDMFKEY(heightfloor)
+DEFINE_UDMFKEY(heightceiling)
+DEFINE_UDMFKEY(texturefloor)
+DEFINE_UDMFKEY(textureceiling)
+DEFINE_UDMFKEY(lightlevel)
+DEFINE_UDMFKEY(floorplane_a)
+DEFINE_UDMFKEY(floorplane_b)
+DEFINE_UDMFKEY(floorplane_c)
+DEFINE_UDMFKEY(floorplane_d)
+DEFINE_UDMFKEY(ceilingplane_a)
+DEFINE_UDMFKEY(ceilingplane_b)
+DEFINE_UDMFKEY(ceilingplane_c)
+DEFINE_UDMFKEY(ceilingplane_d)
+
+// vertex
+DEFINE_UDMFKEY(zfloor)
+DEFINE_UDMFKEY(zceiling)
+
+// lightmap
+DEFINE_UDMFKEY(lm_suncolor)
+DEFINE_UDMFKEY(lm_sampledist)
+DEFINE_UDMFKEY(lm_sampledist_top)
+DEFINE_UDMFKEY(lm_sampledist_mid)
+DEFINE_UDMFKEY(lm_sampledist_bot)
+DEFINE_UDMFKEY(lm_sampledist_floor)
+DEFINE_UDMFKEY(lm_sampledist_ceiling)
+DEFINE_UDMFKEY(light_softshadowradius)
+DEFINE_UDMFKEY(lightcolorline)
+DEFINE_UDMFKEY(lightintensityline)
+DEFINE_UDMFKEY(lightdistanceline)
+DEFINE_UDMFKEY(lm_lightcolorfloor)
+DEFINE_UDMFKEY(lm_lightintensityfloor)
+DEFINE_UDMFKEY(lm_lightdistancefloor)
+DEFINE_UDMFKEY(lm_lightcolorceiling)
+DEFINE_UDMFKEY(lm_lightintensityceiling)
+DEFINE_UDMFKEY(lm_lightdistanceceiling)
@@ -3,6 +3,7 @@
 #include "level/level.h"
 #include "framework/halffloat.h"
 #include "framework/binfile.h"
+#include "framework/profiler.h"
 #include <algorithm>
 #include <map>
 #include <set>
@@ -12,6 +13,8 @@ extern float lm_scale;
 
 DoomLevelMesh::DoomLevelMesh(FLevel& doomMap)
 {
+	PROFILE_ZONE("DoomLevelMesh");
+
 	// Remove the empty mesh added in the LevelMesh constructor
 	Mesh.Vertices.Clear();
 	Mesh.Indexes.Clear();
@@ -48,6 +51,8 @@ void DoomLevelMesh::CreateLights(FLevel& doomMap)
 	if (Mesh.Lights.Size() != 0)
 		return;
 
+	PROFILE_ZONE("CreateLights");
+
 	for (unsigned i = 0; i < doomMap.ThingLights.Size(); ++i)
 	{
 		printf("   Building light lists: %u / %u\r", i, doomMap.ThingLights.Size());
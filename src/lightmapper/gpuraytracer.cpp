@@ -6,6 +6,7 @@
 #include "renderdoc_app.h"
 #include "doom_levelmesh.h"
 #include "levelmeshviewer.h"
+#include "framework/profiler.h"
 
 #ifndef _WIN32
 #include <dlfcn.h>
@@ -30,6 +31,8 @@ GPURaytracer::~GPURaytracer()
 
 void GPURaytracer::Raytrace(DoomLevelMesh* mesh)
 {
+	PROFILE_ZONE("Raytrace");
+
 	if (rdoc_api) rdoc_api->StartFrameCapture(nullptr, nullptr);
 
 #ifdef WIN32
@@ -52,6 +55,8 @@ void GPURaytracer::Raytrace(DoomLevelMesh* mesh)
 		// Keep baking until all surfaces have been processed
 		while (true)
 		{
+			PROFILE_ZONE("Raytrace batch");
+
 			levelmesh->BeginFrame();
 			lightmapper->BeginFrame();
 			mDevice->GetDescriptorSetManager()->UpdateBindlessDescriptorSet();
@@ -78,10 +83,13 @@ void GPURaytracer::Raytrace(DoomLevelMesh* mesh)
 
 		printf("   Ray tracing tiles: %u / %u\n", mesh->LightmapTiles.Size(), mesh->LightmapTiles.Size());
 
-		mesh->LMTextureData.Resize(mesh->LMTextureSize * mesh->LMTextureSize * mesh->LMTextureCount * 4);
-		for (int arrayIndex = 0; arrayIndex < mesh->LMTextureCount; arrayIndex++)
 		{
-			mDevice->GetTextureManager()->DownloadLightmap(arrayIndex, mesh->LMTextureData.Data() + arrayIndex * mesh->LMTextureSize * mesh->LMTextureSize * 4);
+			PROFILE_ZONE("Download lightmap");
+			mesh->LMTextureData.Resize(mesh->LMTextureSize * mesh->LMTextureSize * mesh->LMTextureCount * 4);
+			for (int arrayIndex = 0; arrayIndex < mesh->LMTextureCount; arrayIndex++)
+			{
+				mDevice->GetTextureManager()->DownloadLightmap(arrayIndex, mesh->LMTextureData.Data() + arrayIndex * mesh->LMTextureSize * mesh->LMTextureSize * 4);
+			}
 		}
 
 		if (mViewer)
@@ -1,5 +1,6 @@
 
 #include "hw_levelmesh.h"
+#include "framework/profiler.h"
 
 LevelMesh::LevelMesh()
 {
@@ -107,6 +108,7 @@ LevelMeshTileStats LevelMesh::GatherTilePixelStats()
 
 void LevelMesh::UpdateCollision()
 {
+	PROFILE_ZONE("BVH");
 	Collision = std::make_unique<TriangleMeshShape>(Mesh.Vertices.Data(), Mesh.Vertices.Size(), Mesh.Indexes.Data(), Mesh.Indexes.Size());
 }
 
@@ -25,6 +25,9 @@
 // Need windows.h for QueryPerformanceCounter
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define HAVE_TIMING 1
 #define START_COUNTER(s,e,f) \
@@ -35,13 +38,13 @@
 
 #else
 
-#include <time.h>
+#include <chrono>
 #define HAVE_TIMING 1
 #define START_COUNTER(s,e,f) \
-	clock_t s, e; s = clock();
+	std::chrono::steady_clock::time_point s, e; s = std::chrono::steady_clock::now();
 #define END_COUNTER(s,e,f,l) \
-	e = clock(); \
-	if (!NoTiming) printf (l, double(e - s) / CLOCKS_PER_SEC);
+	e = std::chrono::steady_clock::now(); \
+	if (!NoTiming) printf (l, std::chrono::duration<double>(e - s).count());
 
 // Need these to check if input/output are the same file
 #include <sys/types.h>
@@ -54,12 +57,19 @@
 #include <string.h>
 #include <stdarg.h>
 #include <thread>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
 
 #include "framework/zdray.h"
 #include "framework/filesystem.h"
 #include "framework/file.h"
+#include "framework/profiler.h"
+#include "framework/threadpool.h"
 #include "wad/wad.h"
 #include "level/level.h"
+#include "level/mapcache.h"
 #include "commandline/getopt.h"
 
 // MACROS ------------------------------------------------------------------
@@ -70,6 +80,19 @@
 
 // TYPES -------------------------------------------------------------------
 
+// A map being loaded and having its nodes and tables built on a worker, while
+// the main thread lightmaps and writes the maps before it.
+struct FMapJob
+{
+	int Lump;
+	std::unique_ptr<FProcessor> Processor;
+	uint64_t CacheHash = 0;
+	bool Cached = false;			// Entry holds what to write instead of Processor
+	std::vector<uint8_t> Entry;
+	std::exception_ptr Error;
+	std::atomic<bool> Done = { false };
+};
+
 // EXTERNAL FUNCTION PROTOTYPES --------------------------------------------
 
 // PUBLIC FUNCTION PROTOTYPES ----------------------------------------------
@@ -80,6 +103,8 @@ static void ParseArgs(int argc, char **argv);
 static void ShowUsage();
 static void ShowVersion();
 static bool CheckInOutNames();
+static int FindMapToBuild(FWadReader &wad, int lump);
+static void BuildMap(FMapJob &job, FWadReader &wad, FNodeCache *nodeCache, const FMapCache *mapCache);
 
 #ifndef DISABLE_SSE
 static void CheckSSE();
@@ -95,12 +120,16 @@ extern "C" char *optarg;
 const char		*Map = nullptr;
 const char		*InName;
 const char		*OutName = "tmp.wad";
+const char		*NodeCacheFile = nullptr;
+const char		*UDMFCacheDir = nullptr;
 bool			 BuildNodes = true;
 bool			 BuildGLNodes = true;// false;
 bool			 ConformNodes = false;
 bool			 NoPrune = false;
 EBlockmapMode	 BlockmapMode = EBM_Rebuild;
 ERejectMode		 RejectMode = ERM_DontTouch;
+ESplitterMode	 SplitterMode = ESM_Thorough;
+bool			 ExactSides = false;
 bool			 WriteComments = false;
 int				 MaxSegs = 64;
 int				 SplitCost = 8;
@@ -113,9 +142,12 @@ bool			 CompressGLNodes = true;// false;
 bool			 ForceCompression = true;// false;
 bool			 GLOnly = true;// false;
 bool			 V5GLNodes = false;
-bool			 HaveSSE1, HaveSSE2;
+bool			 HaveSSE1, HaveSSE2, HaveAVX2;
 int				 SSELevel;
 int				 NumThreads = 0;
+bool			 BuildGLPVS = false;
+double			 PVSMaxDistance = 0;
+double			 PVSTimeLimit = 0;
 int				 LMDims = 1024;
 bool			 VKDebug = false;
 bool			 DumpMesh = false;
@@ -126,6 +158,10 @@ int ambientSampleCount = 2048;
 
 // PRIVATE DATA DEFINITIONS ------------------------------------------------
 
+static const char *ProfileFile = nullptr;
+static const char *MapCacheDir = nullptr;
+static int MapThreads = 1;
+
 static option long_opts[] =
 {
 	{"help",			no_argument,		0,	1000},
@@ -156,6 +192,17 @@ static option long_opts[] =
 	{"gl-v5",			no_argument,		0,	'5'},
 	{"no-sse",			no_argument,		0,  1002},
 	{"no-sse2",			no_argument,		0,  1003},
+	{"no-avx2",			no_argument,		0,  1008},
+	{"node-cache",		required_argument,	0,	1009},
+	{"fast-nodes",		no_argument,		0,	1010},
+	{"exact-sides",		no_argument,		0,	1011},
+	{"profile",			required_argument,	0,	1012},
+	{"gl-pvs",			no_argument,		0,	1013},
+	{"pvs-distance",	required_argument,	0,	1014},
+	{"pvs-time",		required_argument,	0,	1015},
+	{"map-threads",		required_argument,	0,	1016},
+	{"udmf-cache",		required_argument,	0,	1017},
+	{"map-cache",		required_argument,	0,	1018},
 	{"comments",		no_argument,		0,	'c'},
 	{"threads",			required_argument,	0,	'j'},
 	{"size",			required_argument,	0,	'S'},
@@ -176,9 +223,9 @@ int main(int argc, char **argv)
 	bool fixSame = false;
 
 #ifdef DISABLE_SSE
-	HaveSSE1 = HaveSSE2 = false;
+	HaveSSE1 = HaveSSE2 = HaveAVX2 = false;
 #else
-	HaveSSE1 = HaveSSE2 = true;
+	HaveSSE1 = HaveSSE2 = HaveAVX2 = true;
 #endif
 
 	ParseArgs(argc, argv);
@@ -194,10 +241,45 @@ int main(int argc, char **argv)
 		InName = argv[optind];
 	}
 
+	// Each map being built runs its own pools for nodes, blockmaps, rejects
+	// and TEXTMAP parsing, so split the threads between the maps instead of
+	// giving every map one per core.
+	if (MapThreads > 1)
+	{
+		NumThreads = ThreadPool::GetThreadCount(NumThreads) / MapThreads;
+		if (NumThreads < 1)
+		{
+			NumThreads = 1;
+		}
+	}
+
 #ifndef DISABLE_SSE
 	CheckSSE();
 #endif
 
+	if (HaveAVX2 && HaveSSE2)
+	{
+		SSELevel = 3;
+	}
+	else if (HaveSSE2)
+	{
+		SSELevel = 2;
+	}
+	else if (HaveSSE1)
+	{
+		SSELevel = 1;
+	}
+	else
+	{
+		SSELevel = 0;
+	}
+
+	if (ProfileFile != nullptr)
+	{
+		Profiler::Start();
+		Profiler::SetThreadName("Main");
+	}
+
 	try
 	{
 		START_COUNTER(t1a, t1b, t1c)
@@ -243,26 +325,101 @@ int main(int argc, char **argv)
 		{
 			FWadReader inwad(InName);
 			FWadWriter outwad(OutName, inwad.IsIWAD());
+			FNodeCache nodeCache;
+			std::unique_ptr<FMapCache> mapCache;
+
+			if (NodeCacheFile != nullptr)
+			{
+				nodeCache.Load(NodeCacheFile);
+			}
+			if (MapCacheDir != nullptr)
+			{
+				mapCache = std::make_unique<FMapCache>(MapCacheDir);
+			}
 
 			int lump = 0;
 			int max = inwad.NumLumps();
+			FNodeCache *cache = NodeCacheFile != nullptr ? &nodeCache : nullptr;
+
+			// With --map-threads, up to that many maps are loaded and have
+			// their nodes built ahead of the one being lightmapped. The
+			// lightmapper only ever works on one map at a time, and the maps
+			// are still written in the order they came in.
+			std::deque<std::unique_ptr<FMapJob>> jobs;
+			std::unique_ptr<ThreadPool> mapPool;
+			int nextJob = 0;
+			bool allBuilt = true;
+
+			if (MapThreads > 1)
+			{
+				nextJob = FindMapToBuild(inwad, 0);
+				mapPool = std::make_unique<ThreadPool>(MapThreads);
+				if (cache != nullptr)
+				{
+					cache->BeginSharing();
+				}
+			}
 
 			while (lump < max)
 			{
 				if (inwad.IsMap(lump) && (!Map || stricmp(inwad.LumpName(lump), Map) == 0))
 				{
 					START_COUNTER(t2a, t2b, t2c)
-					FProcessor builder(inwad, lump);
-					builder.BuildNodes();
-					builder.BuildLightmaps();
-					builder.Write(outwad);
+					PROFILE_ZONE("Map", inwad.LumpName(lump));
+					std::unique_ptr<FMapJob> job;
+
+					if (mapPool != nullptr)
+					{
+						while (nextJob < max && (int)jobs.size() < MapThreads)
+						{
+							FMapJob *next = new FMapJob;
+							next->Lump = nextJob;
+							jobs.emplace_back(next);
+							mapPool->Submit([next, &inwad, cache, &mapCache]() { BuildMap(*next, inwad, cache, mapCache.get()); });
+							nextJob = FindMapToBuild(inwad, inwad.LumpAfterMap(nextJob));
+						}
+
+						FMapJob *front = jobs.front().get();
+						mapPool->WaitUntil([front]() { return front->Done.load(); });
+						job = std::move(jobs.front());
+						jobs.pop_front();
+					}
+					else
+					{
+						job = std::make_unique<FMapJob>();
+						job->Lump = lump;
+						BuildMap(*job, inwad, cache, mapCache.get());
+					}
+					if (job->Error)
+					{
+						std::rethrow_exception(job->Error);
+					}
+
+					if (job->Cached)
+					{
+						printf("----%s----\n   Copied from the map cache.\n", inwad.LumpName(lump));
+						allBuilt = false;
+						FMapCache::WriteEntry(job->Entry, outwad);
+					}
+					else
+					{
+						job->Processor->BuildLightmaps();
+						if (mapCache != nullptr)
+						{
+							mapCache->Write(job->CacheHash, *job->Processor, outwad);
+						}
+						else
+						{
+							job->Processor->Write(outwad);
+						}
+					}
 
 					END_COUNTER(t2a, t2b, t2c, "   %.3f seconds.\n")
 
 					if(DumpMesh)
 					{
 						printf("\n");
-						builder.DumpMesh();
+						job->Processor->DumpMesh();
 					}
 
 					lump = inwad.LumpAfterMap(lump);
@@ -289,6 +446,19 @@ int main(int argc, char **argv)
 			}
 
 			outwad.Close();
+
+			if (mapPool != nullptr && cache != nullptr)
+			{
+				cache->EndSharing();
+			}
+
+			if (NodeCacheFile != nullptr)
+			{
+				// Only forget unused choices when every map was built. A map
+				// copied from the map cache never looks up its choices, but
+				// still needs them once it is edited and has to be built again.
+				nodeCache.Save(NodeCacheFile, Map == nullptr && allBuilt);
+			}
 		}
 
 		if (fixSame)
@@ -302,6 +472,11 @@ int main(int argc, char **argv)
 		}
 
 		END_COUNTER(t1a, t1b, t1c, "\nTotal time: %.3f seconds.\n")
+
+		if (ProfileFile != nullptr)
+		{
+			Profiler::Stop(ProfileFile);
+		}
 	}
 	catch (std::runtime_error msg)
 	{
@@ -464,9 +639,14 @@ static void ParseArgs(int argc, char **argv)
 		case 1002:		// Disable SSE/SSE2 ClassifyLine routine
 			HaveSSE1 = false;
 			HaveSSE2 = false;
+			HaveAVX2 = false;
 			break;
 		case 1003:		// Disable only SSE2 ClassifyLine routine
 			HaveSSE2 = false;
+			HaveAVX2 = false;
+			break;
+		case 1008:		// Disable only the AVX2 ClassifyLines routine
+			HaveAVX2 = false;
 			break;
 		case 'j':
 			NumThreads = atoi(optarg);
@@ -489,6 +669,36 @@ static void ParseArgs(int argc, char **argv)
 		case 1006:
 			NoRtx = true;
 			break;
+		case 1009:
+			NodeCacheFile = optarg;
+			break;
+		case 1010:
+			SplitterMode = ESM_Fast;
+			break;
+		case 1011:
+			ExactSides = true;
+			break;
+		case 1012:
+			ProfileFile = optarg;
+			break;
+		case 1013:
+			BuildGLPVS = true;
+			break;
+		case 1014:
+			PVSMaxDistance = atof(optarg);
+			break;
+		case 1015:
+			PVSTimeLimit = atof(optarg);
+			break;
+		case 1016:
+			MapThreads = ThreadPool::GetThreadCount(atoi(optarg));
+			break;
+		case 1017:
+			UDMFCacheDir = optarg;
+			break;
+		case 1018:
+			MapCacheDir = optarg;
+			break;
 		case 1007:
 			showviewer = true;
 			break;
@@ -527,13 +737,23 @@ static void ShowUsage()
 		"  -b, --empty-blockmap     Create an empty blockmap\n"
 		"  -r, --empty-reject       Create an empty reject table\n"
 		"  -R, --zero-reject        Create a reject table of all zeroes\n"
-		//"  -e, --full-reject        Rebuild reject table (unsupported)\n"
+		"  -e, --full-reject        Rebuild reject table\n"
 		"  -E, --no-reject          Leave reject table untouched\n"
 		"  -p, --partition=NNN      Maximum segs to consider at each node (default %d)\n"
 		"  -s, --split-cost=NNN     Cost for splitting segs (default %d)\n"
 		"  -d, --diagonal-cost=NNN  Cost for avoiding diagonal splitters (default %d)\n"
 		"  -P, --no-polyobjs        Do not check for polyobject subsector splits\n"
-		"  -j, --threads=NNN        Number of threads used for raytracing (default %d)\n"
+		"      --gl-pvs             Build a GL_PVS lump of which GL subsectors can see each other\n"
+		"      --pvs-distance=NNN   Subsectors further apart than NNN map units never see each other\n"
+		"      --pvs-time=NNN       Spend about NNN seconds on the GL_PVS, then guess the rest\n"
+		"      --node-cache=FILE    Reuse splitter choices for unchanged areas from FILE\n"
+		"      --udmf-cache=DIR     Keep parsed TEXTMAPs in DIR and skip parsing any seen before. DIR must already exist\n"
+		"      --map-cache=DIR      Keep the output of every map in DIR and copy maps that did not change. DIR must already exist\n"
+		"      --fast-nodes         Choose splitters quickly, at the cost of a bigger tree\n"
+		"      --exact-sides        Use exact integer math to decide which side of a splitter a seg is on\n"
+		"      --profile=FILE       Write a chrome://tracing profile of the run to FILE\n"
+		"      --map-threads=NNN    Build the nodes of up to NNN maps at once, sharing the threads, 0 for one per core (default 1)\n"
+		"  -j, --threads=NNN        Number of threads used for node building and raytracing (default %d)\n"
 		"  -S, --size=NNN           lightmap texture dimensions for width and height must be in powers of two (1, 2, 4, 8, 16, etc)\n"
 		"  -D, --vkdebug            Print messages from the Vulkan validation layer\n"
 		"      --dump-mesh          Export level mesh and lightmaps for debugging\n"
@@ -591,6 +811,69 @@ static void ShowVersion()
 		" : " __DATE__ ")\n");
 }
 
+//==========================================================================
+//
+// FindMapToBuild
+//
+// Returns the first map at or after lump that is going to be built, or the
+// number of lumps if there are no more.
+//
+//==========================================================================
+
+static int FindMapToBuild(FWadReader &wad, int lump)
+{
+	while (lump < wad.NumLumps())
+	{
+		if (wad.IsMap(lump))
+		{
+			if (!Map || stricmp(wad.LumpName(lump), Map) == 0)
+			{
+				return lump;
+			}
+			lump = wad.LumpAfterMap(lump);
+		}
+		else
+		{
+			++lump;
+		}
+	}
+	return lump;
+}
+
+//==========================================================================
+//
+// BuildMap
+//
+// Loads a map and builds everything for it that does not need the GPU,
+// unless the map cache already has what it would write. Errors are kept
+// in the job, for the thread that writes the map to report.
+//
+//==========================================================================
+
+static void BuildMap(FMapJob &job, FWadReader &wad, FNodeCache *nodeCache, const FMapCache *mapCache)
+{
+	try
+	{
+		if (mapCache != nullptr)
+		{
+			// --dump-mesh needs the map built, even if it did not change.
+			job.CacheHash = mapCache->HashMap(wad, job.Lump);
+			job.Cached = !DumpMesh && mapCache->Load(job.CacheHash, job.Entry);
+		}
+		if (!job.Cached)
+		{
+			job.Processor = std::make_unique<FProcessor>(wad, job.Lump, nodeCache);
+			job.Processor->BuildNodes();
+			job.Processor->BuildTables();
+		}
+	}
+	catch (...)
+	{
+		job.Error = std::current_exception();
+	}
+	job.Done = true;
+}
+
 //==========================================================================
 //
 // CheckInOutNames
@@ -659,13 +942,40 @@ static bool CheckInOutNames()
 //
 // CheckSSE
 //
-// Checks if the processor supports SSE or SSE2.
+// Checks if the processor supports SSE, SSE2 or AVX2.
 //
 //==========================================================================
 
 #ifndef DISABLE_SSE
+static bool CheckAVX2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7)
+	{
+		return false;
+	}
+	// The OS must also save the YMM registers on a context switch.
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+	{
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return false;
+#endif
+}
+
 static void CheckSSE()
 {
+	HaveAVX2 = HaveAVX2 && CheckAVX2();
+
 #ifdef __SSE2__
 	// If we compiled with SSE2 support enabled for everything, then
 	// obviously it's available, or the program won't get very far.
@@ -0,0 +1,720 @@
+/*
+	Node builder benchmark.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+// Runs FNodeBuilder on a set of generated maps, plus every map in the wads of
+// a corpus directory, and writes how long each step took as JSON:
+//
+//   nodebench [--corpus DIR] [--runs N] [--scale N] [--threads N]
+//             [--check-threads N,N,...] [--sse-level N] [--output FILE]
+//             [--profile FILE]
+//
+// Each map is built with GL nodes and with regular nodes, and the fastest of
+// the runs is reported. With --check-threads, each map is also built once with
+// each of the listed thread counts, and nodebench fails if the tree does not
+// come out the same as with --threads.
+
+// HEADER FILES ------------------------------------------------------------
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "framework/zdray.h"
+#include "framework/file.h"
+#include "framework/profiler.h"
+#include "wad/wad.h"
+#include "level/level.h"
+
+// TYPES -------------------------------------------------------------------
+
+struct FBenchResult
+{
+	std::string Map;
+	std::string Source;
+	bool GL;
+	int Lines;
+	unsigned int InitialSegs;
+	int Nodes, Segs, Subsectors, Vertices;
+	unsigned int Splits;
+	unsigned int Depth;
+	FNodeBuilder::FPhaseTimes Phases;
+	double Extraction;
+	double Total;
+	long PeakMemoryKB;
+};
+
+// Builds a map out of closed loops of lines, in map units
+class FSynthMap
+{
+public:
+	int AddSector()
+	{
+		return NumSectors++;
+	}
+
+	int AddVertex(double x, double y)
+	{
+		WideVertex vert;
+		vert.x = int(floor(x + 0.5)) << FRACBITS;
+		vert.y = int(floor(y + 0.5)) << FRACBITS;
+		vert.index = 0;
+		Vertices.push_back(vert);
+		return int(Vertices.size()) - 1;
+	}
+
+	// The front side is on the right, going from v1 to v2
+	void AddLine(int v1, int v2, int front, int back)
+	{
+		IntLineDef line;
+		line.v1 = v1;
+		line.v2 = v2;
+		line.sidenum[0] = AddSide(front);
+		if (back >= 0)
+		{
+			line.sidenum[1] = AddSide(back);
+			line.flags = 4;		// ML_TWOSIDED
+		}
+		Lines.push_back(line);
+	}
+
+	// Adds the lines around a counterclockwise loop of vertices. A sector of
+	// -1 on either side means there is nothing there.
+	void AddLoop(const std::vector<int> &loop, int inside, int outside)
+	{
+		for (size_t i = 0; i < loop.size(); ++i)
+		{
+			int v1 = loop[i], v2 = loop[(i + 1) % loop.size()];
+			if (outside >= 0)
+			{
+				AddLine(v1, v2, outside, inside);
+			}
+			else
+			{
+				AddLine(v2, v1, inside, -1);
+			}
+		}
+	}
+
+	std::vector<int> AddPolygon(double cx, double cy, double radius, int sides, double rotation)
+	{
+		std::vector<int> loop;
+		for (int i = 0; i < sides; ++i)
+		{
+			double angle = rotation + i * 2 * M_PI / sides;
+			loop.push_back(AddVertex(cx + radius * cos(angle), cy + radius * sin(angle)));
+		}
+		return loop;
+	}
+
+	void Fill(FLevel &level) const
+	{
+		level.NumVertices = int(Vertices.size());
+		level.Vertices = new WideVertex[Vertices.size()];
+		memcpy(level.Vertices, Vertices.data(), Vertices.size() * sizeof(WideVertex));
+		level.Lines.Resize(unsigned(Lines.size()));
+		for (size_t i = 0; i < Lines.size(); ++i)
+		{
+			level.Lines[i] = Lines[i];
+		}
+		level.Sides.Resize(unsigned(SideSectors.size()));
+		for (size_t i = 0; i < SideSectors.size(); ++i)
+		{
+			IntSideDef &side = level.Sides[i];
+			side.textureoffset = side.rowoffset = 0;
+			side.toptexture[0] = side.bottomtexture[0] = side.midtexture[0] = 0;
+			side.sector = SideSectors[i];
+			side.lightdef = -1;
+			side.sectordef = nullptr;
+			side.line = nullptr;
+		}
+		level.Sectors.Resize(NumSectors);
+	}
+
+private:
+	unsigned int AddSide(int sector)
+	{
+		SideSectors.push_back(sector);
+		return unsigned(SideSectors.size()) - 1;
+	}
+
+	std::vector<WideVertex> Vertices;
+	std::vector<IntLineDef> Lines;
+	std::vector<int> SideSectors;
+	int NumSectors = 0;
+};
+
+typedef void (*SynthFunc)(FSynthMap &map, int scale);
+
+// PRIVATE FUNCTION PROTOTYPES ---------------------------------------------
+
+static void ParseArgs(int argc, char **argv);
+static void MakeGrid(FSynthMap &map, int scale);
+static void MakeCircles(FSynthMap &map, int scale);
+static void MakeStairs(FSynthMap &map, int scale);
+static void MakeOpen(FSynthMap &map, int scale);
+static void ParseThreadList(const char *list);
+static void BenchLevel(FLevel &source, TArray<FNodeBuilder::FPolyStart> &polyspots, TArray<FNodeBuilder::FPolyStart> &anchors,
+	const char *map, const char *sourcename);
+static void BenchCorpus(const std::string &dir);
+static void WriteResults(FILE *file);
+static long PeakMemoryKB();
+
+// PUBLIC DATA DEFINITIONS -------------------------------------------------
+
+// zdray's settings, left at their defaults
+const char		*Map = nullptr;
+const char		*InName;
+const char		*OutName = "tmp.wad";
+const char		*NodeCacheFile = nullptr;
+const char		*UDMFCacheDir = nullptr;
+bool			 BuildNodes = true;
+bool			 BuildGLNodes = true;
+bool			 ConformNodes = false;
+bool			 NoPrune = false;
+EBlockmapMode	 BlockmapMode = EBM_Rebuild;
+ERejectMode		 RejectMode = ERM_DontTouch;
+ESplitterMode	 SplitterMode = ESM_Thorough;
+bool			 ExactSides = false;
+bool			 WriteComments = false;
+int				 MaxSegs = 64;
+int				 SplitCost = 8;
+int				 AAPreference = 16;
+bool			 CheckPolyobjs = true;
+bool			 ShowWarnings = false;
+bool			 NoTiming = false;
+bool			 CompressNodes = true;
+bool			 CompressGLNodes = true;
+bool			 ForceCompression = true;
+bool			 GLOnly = true;
+bool			 V5GLNodes = false;
+bool			 HaveSSE1 = true, HaveSSE2 = true, HaveAVX2 = false;
+int				 SSELevel = 2;
+int				 NumThreads = 1;
+bool			 BuildGLPVS = false;
+double			 PVSMaxDistance = 0;
+double			 PVSTimeLimit = 0;
+int				 LMDims = 1024;
+bool			 VKDebug = false;
+bool			 DumpMesh = false;
+bool			 NoRtx = false;
+bool			 showviewer = false;
+
+int ambientSampleCount = 2048;
+
+// PRIVATE DATA DEFINITIONS ------------------------------------------------
+
+static const struct
+{
+	const char *Name;
+	SynthFunc Make;
+} SynthMaps[] =
+{
+	{ "grid", MakeGrid },
+	{ "circles", MakeCircles },
+	{ "stairs", MakeStairs },
+	{ "open", MakeOpen },
+};
+
+static const char *CorpusDir = nullptr;
+static const char *OutputName = "nodebench.json";
+static const char *ProfileFile = nullptr;
+static int Runs = 3;
+static int MapScale = 1;
+static std::vector<int> CheckThreads;
+static int NumMismatches = 0;
+static std::vector<FBenchResult> Results;
+
+// CODE --------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	ParseArgs(argc, argv);
+
+	if (ProfileFile != nullptr)
+	{
+		Profiler::Start();
+		Profiler::SetThreadName("Main");
+	}
+
+	for (const auto &synth : SynthMaps)
+	{
+		FSynthMap map;
+		FLevel level;
+		TArray<FNodeBuilder::FPolyStart> polyspots, anchors;
+
+		synth.Make(map, MapScale);
+		map.Fill(level);
+		BenchLevel(level, polyspots, anchors, synth.Name, "synthetic");
+	}
+
+	if (CorpusDir != nullptr)
+	{
+		BenchCorpus(CorpusDir);
+	}
+
+	FILE *file = fopen(OutputName, "w");
+	if (file == nullptr)
+	{
+		fprintf(stderr, "Could not write %s\n", OutputName);
+		return 1;
+	}
+	WriteResults(file);
+	fclose(file);
+
+	if (ProfileFile != nullptr)
+	{
+		Profiler::Stop(ProfileFile);
+	}
+	if (NumMismatches > 0)
+	{
+		fprintf(stderr, "%d builds did not match the build with %d threads\n", NumMismatches, NumThreads);
+		return 1;
+	}
+	return 0;
+}
+
+static void ParseArgs(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (value != nullptr && strcmp(arg, "--corpus") == 0)			CorpusDir = value;
+		else if (value != nullptr && strcmp(arg, "--output") == 0)		OutputName = value;
+		else if (value != nullptr && strcmp(arg, "--profile") == 0)		ProfileFile = value;
+		else if (value != nullptr && strcmp(arg, "--runs") == 0)		Runs = MAX(atoi(value), 1);
+		else if (value != nullptr && strcmp(arg, "--scale") == 0)		MapScale = clamp(atoi(value), 1, 4);
+		else if (value != nullptr && strcmp(arg, "--threads") == 0)		NumThreads = atoi(value);
+		else if (value != nullptr && strcmp(arg, "--check-threads") == 0)	ParseThreadList(value);
+		else if (value != nullptr && strcmp(arg, "--sse-level") == 0)	SSELevel = atoi(value);
+		else
+		{
+			fprintf(stderr,
+				"Usage: nodebench [options]\n"
+				"      --corpus DIR         Also build every map in the wads in DIR\n"
+				"      --runs NNN           Build each map NNN times and keep the fastest (default 3)\n"
+				"      --scale NNN          Size of the generated maps, from 1 to 4 (default 1)\n"
+				"      --threads NNN        Number of threads for the node builder (default 1)\n"
+				"      --check-threads LIST Also build each map with each of these comma separated\n"
+				"                           thread counts, and fail if the nodes differ\n"
+				"      --sse-level NNN      0 = C, 1 = SSE, 2 = SSE2, 3 = AVX2 (default 2)\n"
+				"      --output FILE        Write the results to FILE (default nodebench.json)\n"
+				"      --profile FILE       Write a chrome://tracing profile of the run to FILE\n");
+			exit(1);
+		}
+		++i;
+	}
+	HaveAVX2 = SSELevel >= 3;
+}
+
+static void ParseThreadList(const char *list)
+{
+	char *end;
+
+	for (const char *p = list; *p != 0; p = *end == ',' ? end + 1 : end)
+	{
+		long threads = strtol(p, &end, 10);
+		if (end == p)
+		{
+			fprintf(stderr, "Bad thread count list: %s\n", list);
+			exit(1);
+		}
+		CheckThreads.push_back(int(threads));
+	}
+}
+
+// Square rooms of 256 units, each with a pillar of 4 to 11 sides in it
+static void MakeGrid(FSynthMap &map, int scale)
+{
+	const int cells = 32 * scale, size = 256;
+	std::mt19937 rng(1234);
+	std::vector<int> corners, sectors;
+
+	for (int y = 0; y <= cells; ++y)
+		for (int x = 0; x <= cells; ++x)
+			corners.push_back(map.AddVertex(x * size, y * size));
+	for (int i = 0; i < cells * cells; ++i)
+		sectors.push_back(map.AddSector());
+
+	auto corner = [&](int x, int y) { return corners[y * (cells + 1) + x]; };
+	auto sector = [&](int x, int y) { return x < 0 || y < 0 || x >= cells || y >= cells ? -1 : sectors[y * cells + x]; };
+
+	for (int y = 0; y <= cells; ++y)
+	{
+		for (int x = 0; x < cells; ++x)
+		{
+			int above = sector(x, y), below = sector(x, y - 1);
+			if (above >= 0) map.AddLine(corner(x, y), corner(x + 1, y), above, below);
+			else map.AddLine(corner(x + 1, y), corner(x, y), below, -1);
+		}
+	}
+	for (int x = 0; x <= cells; ++x)
+	{
+		for (int y = 0; y < cells; ++y)
+		{
+			int right = sector(x, y), left = sector(x - 1, y);
+			if (left >= 0) map.AddLine(corner(x, y), corner(x, y + 1), left, right);
+			else map.AddLine(corner(x, y + 1), corner(x, y), right, -1);
+		}
+	}
+	for (int y = 0; y < cells; ++y)
+	{
+		for (int x = 0; x < cells; ++x)
+		{
+			double cx = x * size + size / 2 + int(rng() % 21) - 10;
+			double cy = y * size + size / 2 + int(rng() % 21) - 10;
+			double radius = 24 + rng() % 48;
+			int sides = 4 + rng() % 8;
+			map.AddLoop(map.AddPolygon(cx, cy, radius, sides, (rng() % 100) / 300.0), -1, sector(x, y));
+		}
+	}
+}
+
+// Rings of sectors around one center, so the lines go in every direction
+static void MakeCircles(FSynthMap &map, int scale)
+{
+	const int rings = 32 * scale, sides = 128;
+	std::vector<int> inner = map.AddPolygon(0, 0, 128, sides, 0);
+	int insector = map.AddSector();
+
+	for (int i = 1; i <= rings; ++i)
+	{
+		// Every other ring is turned half a side, so that no line continues another.
+		std::vector<int> outer = map.AddPolygon(0, 0, 128 + 96 * i, sides, (i & 1) * M_PI / sides);
+		int outsector = map.AddSector();
+
+		map.AddLoop(inner, insector, outsector);
+		inner = outer;
+		insector = outsector;
+	}
+	map.AddLoop(inner, insector, -1);
+}
+
+// Long staircases of 8-unit steps, at several angles
+static void MakeStairs(FSynthMap &map, int scale)
+{
+	const int steps = 256 * scale, depth = 8, width = 128;
+	const double length = steps * depth + 256;
+
+	for (int k = 0; k < 6; ++k)
+	{
+		double angle = k * 15 * M_PI / 180, c = cos(angle), s = sin(angle);
+		double ox = (k % 3) * length - length, oy = (k / 3) * length - length;
+		auto point = [&](double u, double v) { return map.AddVertex(ox + u * c - v * s, oy + u * s + v * c); };
+		std::vector<int> left, right, sectors;
+
+		for (int i = 0; i <= steps; ++i)
+		{
+			left.push_back(point(i * depth, 0));
+			right.push_back(point(i * depth, width));
+		}
+		for (int i = 0; i < steps; ++i)
+		{
+			sectors.push_back(map.AddSector());
+		}
+		for (int i = 0; i < steps; ++i)
+		{
+			map.AddLine(left[i + 1], left[i], sectors[i], -1);
+			map.AddLine(right[i], right[i + 1], sectors[i], -1);
+			if (i > 0)
+			{
+				map.AddLine(left[i], right[i], sectors[i], sectors[i - 1]);
+			}
+		}
+		map.AddLine(left[0], right[0], sectors[0], -1);
+		map.AddLine(right[steps], left[steps], sectors[steps - 1], -1);
+	}
+}
+
+// One huge room with a few small pillars scattered around it
+static void MakeOpen(FSynthMap &map, int scale)
+{
+	const int half = 16000, cells = 16 * scale, cellsize = 2 * half / cells;
+	std::mt19937 rng(5678);
+	int room = map.AddSector();
+
+	map.AddLoop({ map.AddVertex(-half, -half), map.AddVertex(half, -half), map.AddVertex(half, half), map.AddVertex(-half, half) }, room, -1);
+	for (int y = 0; y < cells; ++y)
+	{
+		for (int x = 0; x < cells; ++x)
+		{
+			if (rng() % 3 == 0)
+			{
+				double cx = -half + x * cellsize + cellsize / 4 + rng() % (cellsize / 2);
+				double cy = -half + y * cellsize + cellsize / 4 + rng() % (cellsize / 2);
+				map.AddLoop(map.AddPolygon(cx, cy, 16 + rng() % 48, 4 + rng() % 5, (rng() % 100) / 100.0), -1, room);
+			}
+		}
+	}
+}
+
+// Gives the node builder its own copy of everything it changes
+static void CopyForBuild(const FLevel &source, FLevel &level)
+{
+	level.NumVertices = source.NumVertices;
+	level.Vertices = new WideVertex[source.NumVertices];
+	memcpy(level.Vertices, source.Vertices, source.NumVertices * sizeof(WideVertex));
+	level.Lines = source.Lines;
+	level.Sides = source.Sides;
+}
+
+// Builds the nodes for a copy of the map once and measures it
+static void BuildOnce(const FLevel &source, TArray<FNodeBuilder::FPolyStart> &polyspots, TArray<FNodeBuilder::FPolyStart> &anchors,
+	const char *map, const char *sourcename, bool gl, FBenchResult &result)
+{
+	PROFILE_ZONE("Map", map);
+	FLevel level;
+
+	CopyForBuild(source, level);
+
+	auto start = std::chrono::steady_clock::now();
+	FNodeBuilder builder(level, polyspots, anchors, map, gl);
+	auto built = std::chrono::steady_clock::now();
+
+	// Extracting regular nodes looks up the vertices in the level.
+	delete[] level.Vertices;
+	builder.GetVertices(level.Vertices, level.NumVertices);
+	MapNodeEx *nodes;
+	MapSubsectorEx *subs;
+	if (gl)
+	{
+		MapSegGLEx *segs;
+		builder.GetGLNodes(nodes, result.Nodes, segs, result.Segs, subs, result.Subsectors);
+		delete[] segs;
+	}
+	else
+	{
+		MapSegEx *segs;
+		builder.GetNodes(nodes, result.Nodes, segs, result.Segs, subs, result.Subsectors);
+		delete[] segs;
+	}
+	delete[] nodes;
+	delete[] subs;
+	auto done = std::chrono::steady_clock::now();
+
+	result.Map = map;
+	result.Source = sourcename;
+	result.GL = gl;
+	result.Lines = source.NumLines();
+	result.InitialSegs = builder.GetNumInitialSegs();
+	result.Vertices = level.NumVertices;
+	result.Splits = builder.GetNumSplits();
+	result.Depth = builder.GetMaxDepth();
+	result.Phases = builder.GetPhaseTimes();
+	result.Extraction = std::chrono::duration<double>(done - built).count();
+	result.Total = std::chrono::duration<double>(done - start).count();
+}
+
+static void BenchLevel(FLevel &source, TArray<FNodeBuilder::FPolyStart> &polyspots, TArray<FNodeBuilder::FPolyStart> &anchors,
+	const char *map, const char *sourcename)
+{
+	for (int gl = 1; gl >= 0; --gl)
+	{
+		FBenchResult best;
+		best.Total = -1;
+
+		fprintf(stderr, "%s (%s) %s nodes\n", map, sourcename, gl ? "GL" : "regular");
+		for (int run = 0; run < Runs; ++run)
+		{
+			FBenchResult result;
+
+			BuildOnce(source, polyspots, anchors, map, sourcename, gl != 0, result);
+			if (best.Total < 0 || result.Total < best.Total)
+			{
+				best = result;
+			}
+		}
+		best.PeakMemoryKB = PeakMemoryKB();
+		Results.push_back(best);
+
+		// The tree must not depend on how the work was spread over the threads.
+		for (int threads : CheckThreads)
+		{
+			FBenchResult check;
+			int numthreads = NumThreads;
+
+			NumThreads = threads;
+			BuildOnce(source, polyspots, anchors, map, sourcename, gl != 0, check);
+			NumThreads = numthreads;
+			if (check.Splits != best.Splits || check.Segs != best.Segs || check.Nodes != best.Nodes)
+			{
+				fprintf(stderr, "   %d threads: %u splits, %d segs, %d nodes instead of %u splits, %d segs, %d nodes\n",
+					threads, check.Splits, check.Segs, check.Nodes, best.Splits, best.Segs, best.Nodes);
+				NumMismatches++;
+			}
+		}
+	}
+}
+
+// A map that does not use this fork's sidedef layout, or that is simply broken,
+// would send the node builder off the end of its arrays.
+static bool IsBuildable(const FLevel &level)
+{
+	if (level.NumLines() == 0 || level.NumSides() == 0)
+	{
+		return false;
+	}
+	for (unsigned int i = 0; i < level.Lines.Size(); ++i)
+	{
+		const IntLineDef &line = level.Lines[i];
+
+		if (line.v1 >= (uint32_t)level.NumVertices || line.v2 >= (uint32_t)level.NumVertices)
+		{
+			return false;
+		}
+		for (int j = 0; j < 2; ++j)
+		{
+			if (line.sidenum[j] != NO_INDEX && line.sidenum[j] >= (uint32_t)level.NumSides())
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void BenchCorpus(const std::string &dir)
+{
+	for (const std::string &filename : Directory::files(FilePath::combine(dir, "*")))
+	{
+		if (!FilePath::has_extension(filename, "wad"))
+		{
+			continue;
+		}
+
+		std::string path = FilePath::combine(dir, filename);
+		try
+		{
+			FWadReader wad(path.c_str());
+
+			for (int lump = wad.NextMap(-1); lump >= 0; lump = wad.NextMap(lump))
+			{
+				FProcessor processor(wad, lump);
+				std::string map = wad.LumpName(lump);
+
+				if (!IsBuildable(processor.GetLevel()))
+				{
+					fprintf(stderr, "%s (%s) refers to sides or vertices that are not there, skipping it\n", map.c_str(), path.c_str());
+				}
+				else
+				{
+					BenchLevel(processor.GetLevel(), processor.GetPolyStarts(), processor.GetPolyAnchors(), map.c_str(), path.c_str());
+				}
+			}
+		}
+		catch (const std::exception &error)
+		{
+			fprintf(stderr, "%s: %s\n", path.c_str(), error.what());
+		}
+	}
+}
+
+static void WriteString(FILE *file, const std::string &str)
+{
+	fputc('"', file);
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+		else if ((unsigned char)c < 0x20) fprintf(file, "\\u%04x", c);
+		else fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+static void WriteResults(FILE *file)
+{
+	fprintf(file, "{\n\t\"runs\": %d,\n\t\"threads\": %d,\n\t\"sse_level\": %d,\n\t\"results\": [", Runs, NumThreads, SSELevel);
+	for (size_t i = 0; i < Results.size(); ++i)
+	{
+		const FBenchResult &r = Results[i];
+
+		fprintf(file, "%s\n\t\t{\n\t\t\t\"map\": ", i > 0 ? "," : "");
+		WriteString(file, r.Map);
+		fprintf(file, ",\n\t\t\t\"source\": ");
+		WriteString(file, r.Source);
+		fprintf(file, ",\n\t\t\t\"gl\": %s,\n", r.GL ? "true" : "false");
+		fprintf(file, "\t\t\t\"lines\": %d,\n\t\t\t\"initial_segs\": %u,\n", r.Lines, r.InitialSegs);
+		fprintf(file, "\t\t\t\"nodes\": %d,\n\t\t\t\"segs\": %d,\n\t\t\t\"subsectors\": %d,\n\t\t\t\"vertices\": %d,\n", r.Nodes, r.Segs, r.Subsectors, r.Vertices);
+		fprintf(file, "\t\t\t\"splits\": %u,\n\t\t\t\"depth\": %u,\n", r.Splits, r.Depth);
+		fprintf(file, "\t\t\t\"segs_per_second\": %.0f,\n", r.Total > 0 ? r.InitialSegs / r.Total : 0.0);
+		fprintf(file, "\t\t\t\"peak_memory_kb\": %ld,\n", r.PeakMemoryKB);
+		fprintf(file, "\t\t\t\"seconds\": {\n");
+		fprintf(file, "\t\t\t\t\"find_used_vertices\": %.6f,\n", r.Phases.FindUsedVertices);
+		fprintf(file, "\t\t\t\t\"make_segs_from_sides\": %.6f,\n", r.Phases.MakeSegsFromSides);
+		fprintf(file, "\t\t\t\t\"find_poly_containers\": %.6f,\n", r.Phases.FindPolyContainers);
+		fprintf(file, "\t\t\t\t\"group_seg_planes\": %.6f,\n", r.Phases.GroupSegPlanes);
+		fprintf(file, "\t\t\t\t\"build_tree\": %.6f,\n", r.Phases.BuildTree);
+		fprintf(file, "\t\t\t\t\"extraction\": %.6f,\n", r.Extraction);
+		fprintf(file, "\t\t\t\t\"total\": %.6f\n", r.Total);
+		fprintf(file, "\t\t\t}\n\t\t}");
+	}
+	fprintf(file, "\n\t]\n}\n");
+}
+
+// The most memory the process has used so far. It never goes down, so it is
+// only an upper bound for the maps after the biggest one.
+static long PeakMemoryKB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return long(counters.PeakWorkingSetSize / 1024);
+	}
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return long(usage.ru_maxrss / 1024);
+#else
+	return long(usage.ru_maxrss);
+#endif
+#endif
+}
+
+void Warn(const char *format, ...)
+{
+	va_list marker;
+
+	if (!ShowWarnings)
+	{
+		return;
+	}
+
+	va_start(marker, format);
+	vprintf(format, marker);
+	va_end(marker);
+}
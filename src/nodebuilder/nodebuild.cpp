@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -29,6 +30,7 @@
 #include "framework/zdray.h"
 #include "nodebuilder/nodebuild.h"
 #include "framework/templates.h"
+#include "framework/profiler.h"
 
 #define Printf printf
 #define STACK_ARGS
@@ -41,16 +43,38 @@
 
 FNodeBuilder::FNodeBuilder (FLevel &level,
 							TArray<FPolyStart> &polyspots, TArray<FPolyStart> &anchors,
-							const char *name, bool makeGLnodes)
-	: Level(level), SegsStuffed(0), MapName(name)
+							const char *name, bool makeGLnodes, FNodeCache *cache, int threads)
+	: Threads(threads > 0 ? threads : ThreadPool::GetThreadCount (NumThreads)),
+	  Level(level), SegsStuffed(0), MapName(name), Cache(cache), NumSets(0), NumSplits(0), MaxDepth(0), CacheHits(0)
 {
-	VertexMap = new FVertexMap (*this, Level.MinX, Level.MinY, Level.MaxX, Level.MaxY);
+	PROFILE_ZONE ("FNodeBuilder", makeGLnodes ? "GL nodes" : "regular nodes");
+
+	// Each step is timed for GetPhaseTimes and shows up as a zone of its own in a profile.
+	int64_t start = Profiler::Now ();
+	auto lap = [&start](double &seconds, const char *zone)
+	{
+		int64_t now = Profiler::Now ();
+		seconds = (now - start) / 1e9;
+		if (Profiler::IsActive ())
+		{
+			Profiler::AddZone (zone, std::string (), start, now);
+		}
+		start = now;
+	};
+
+	VertexMap = new FVertexMap (*this, Level.NumVertices);
 	GLNodes = makeGLnodes;
 	FindUsedVertices (Level.Vertices, Level.NumVertices);
+	lap (PhaseTimes.FindUsedVertices, "FindUsedVertices");
 	MakeSegsFromSides ();
+	InitialSegs = Segs.Size ();
+	lap (PhaseTimes.MakeSegsFromSides, "MakeSegsFromSides");
 	FindPolyContainers (polyspots, anchors);
+	lap (PhaseTimes.FindPolyContainers, "FindPolyContainers");
 	GroupSegPlanes ();
+	lap (PhaseTimes.GroupSegPlanes, "GroupSegPlanes");
 	BuildTree ();
+	lap (PhaseTimes.BuildTree, "BuildTree");
 }
 
 FNodeBuilder::~FNodeBuilder()
@@ -65,45 +89,102 @@ void FNodeBuilder::BuildTree ()
 {
 	fixed_t bbox[4];
 
+	// The pool only ever picks splitters. All changes to the seg and vertex arrays
+	// still happen on this thread in the same order as a serial build, so the
+	// resulting tree does not depend on the number of threads.
+	if (Threads > 1 && Segs.Size() >= MIN_PARALLEL_SEGS)
+	{
+		Pool.reset (new ThreadPool (Threads - 1));
+	}
+	Scratch.Resize (Pool != nullptr ? Pool->GetWorkerCount() + 1 : 1);
+	for (unsigned int i = 0; i < Scratch.Size(); ++i)
+	{
+		Scratch[i].PlaneChecked.Resize ((Planes.Size() + 7) / 8);
+		memset (&Scratch[i].PlaneChecked[0], 0, Scratch[i].PlaneChecked.Size());
+		Scratch[i].MemoRows.Resize (Planes.Size());
+		for (unsigned int j = 0; j < Planes.Size(); ++j)
+		{
+			Scratch[i].MemoRows[j] = -1;
+		}
+	}
+
+	FSegSpan set = { 0, Segs.Size() };
+	SetSegs.Resize (Segs.Size());
+	for (unsigned int i = 0; i < Segs.Size(); ++i)
+	{
+		SetSegs[i] = i;
+	}
+
 	fprintf (stderr, "   BSP:   0.0%%\r");
 	HackSeg = DWORD_MAX;
 	HackMate = DWORD_MAX;
-	CreateNode (0, Segs.Size(), bbox);
+	CreateNode (set, Segs.Size(), bbox, nullptr, nullptr, 0);
 	CreateSubsectorsForReal ();
 	fprintf (stderr, "   BSP: 100.0%%\n");
+
+	Pool.reset ();
+	PackedSets.DeleteAndClear ();
 }
 
-uint32_t FNodeBuilder::CreateNode (uint32_t set, unsigned int count, fixed_t bbox[4])
+uint32_t FNodeBuilder::CreateNode (const FSegSpan &set, unsigned int count, fixed_t bbox[4], FPendingChoice *pending, const FPackedSet *parent, unsigned int depth)
 {
-	node_t node;
-	int skip, selstat;
-	uint32_t splitseg;
+	FNodeChoice choice;
+	FPackedSet *packed;
 
-	// When building GL nodes, count may not be an exact count of the number of segs
-	// in this set. That's okay, because we just use it to get a skip count, so an
-	// estimate is fine.
-	skip = int(count / MaxSegs);
+	if (pending != nullptr)
+	{
+		pending->Wait ();
+	}
+	// Splitting the sibling set may have split some of this set's segs as well,
+	// in which case the choice made ahead of time is stale.
+	if (pending != nullptr && IsPackCurrent (set, pending->Set))
+	{
+		choice = pending->Choice;
+		packed = &pending->Set;
+	}
+	else
+	{
+		// The packed set has to stay put until both children have been chosen,
+		// since they look up their parent's seg sides in it.
+		while (PackedSets.Size() <= depth)
+		{
+			PackedSets.Push (new FPackedSet);
+		}
+		packed = PackedSets[depth];
+		PackSet (set, *packed, parent);
+		ChooseSplitter (*packed, count, choice, Scratch[0]);
+	}
 
-	if ((selstat = SelectSplitter (set, node, splitseg, skip, true)) > 0 ||
-		(skip > 0 && (selstat = SelectSplitter (set, node, splitseg, 1, true)) > 0) ||
-		(selstat < 0 && (SelectSplitter (set, node, splitseg, skip, false) > 0 ||
-						(skip > 0 && SelectSplitter (set, node, splitseg, 1, false)))) ||
-		CheckSubsector (set, node, splitseg))
+	NumSets++;
+	MaxDepth = MAX (MaxDepth, depth);
+	if (Cache != nullptr)
+	{
+		CacheHits += choice.Cached;
+		RecordChoice (*packed, choice);
+	}
+
+	if (choice.Split)
 	{
 		// Create a normal node
-		uint32_t set1, set2;
+		node_t node = choice.Node;
+		FSegSpan set1, set2;
 		unsigned int count1, count2;
+		unsigned int mark = SetSegs.Size();
 
-		SplitSegs (set, node, splitseg, set1, set2, count1, count2);
+		HackSeg = choice.HackSeg;
+		HackMate = choice.HackMate;
+		SplitSegs (set, node, choice.SplitSeg, set1, set2, count1, count2);
 		D(PrintSet (1, set1));
-		D(Printf ("(%d,%d) delta (%d,%d) from seg %d\n", node.x>>16, node.y>>16, node.dx>>16, node.dy>>16, splitseg));
+		D(Printf ("(%d,%d) delta (%d,%d) from seg %d\n", node.x>>16, node.y>>16, node.dx>>16, node.dy>>16, choice.SplitSeg));
 		D(PrintSet (2, set2));
-		node.intchildren[0] = CreateNode (set1, count1, node.bbox[0]);
-		node.intchildren[1] = CreateNode (set2, count2, node.bbox[1]);
+		std::unique_ptr<FPendingChoice> ahead = ChooseAhead (set2, count2, packed);
+		node.intchildren[0] = CreateNode (set1, count1, node.bbox[0], nullptr, packed, depth + 1);
+		node.intchildren[1] = CreateNode (set2, count2, node.bbox[1], ahead.get(), packed, depth + 1);
 		bbox[BOXTOP] = MAX (node.bbox[0][BOXTOP], node.bbox[1][BOXTOP]);
 		bbox[BOXBOTTOM] = MIN (node.bbox[0][BOXBOTTOM], node.bbox[1][BOXBOTTOM]);
 		bbox[BOXLEFT] = MIN (node.bbox[0][BOXLEFT], node.bbox[1][BOXLEFT]);
 		bbox[BOXRIGHT] = MAX (node.bbox[0][BOXRIGHT], node.bbox[1][BOXRIGHT]);
+		SetSegs.Clamp (mark);
 		return (int)Nodes.Push (node);
 	}
 	else
@@ -112,25 +193,258 @@ uint32_t FNodeBuilder::CreateNode (uint32_t set, unsigned int count, fixed_t bbo
 	}
 }
 
-uint32_t FNodeBuilder::CreateSubsector (uint32_t set, fixed_t bbox[4])
+// Hands a set to the thread pool so that its splitter can be chosen while
+// the builder is busy with the set's sibling. Small sets are not worth it.
+
+std::unique_ptr<FNodeBuilder::FPendingChoice> FNodeBuilder::ChooseAhead (const FSegSpan &set, unsigned int count, const FPackedSet *parent)
+{
+	if (Pool == nullptr || count < MIN_PARALLEL_SEGS)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<FPendingChoice> pending (new FPendingChoice (Pool.get()));
+	FPendingChoice *p = pending.get();
+
+	PackSet (set, p->Set, parent);
+	Pool->Submit ([this, p, count]()
+	{
+		ChooseSplitter (p->Set, count, p->Choice, Scratch[Pool->GetCurrentSlot()]);
+		p->Done = true;
+	});
+	return pending;
+}
+
+// Lays out a linked list of segs as a new span at the end of SetSegs.
+
+FNodeBuilder::FSegSpan FNodeBuilder::MakeSpan (uint32_t list)
+{
+	FSegSpan span;
+
+	span.Begin = SetSegs.Size();
+	while (list != DWORD_MAX)
+	{
+		uint32_t next = Segs[list].next;
+		Segs[list].next = DWORD_MAX;
+		SetSegs.Push (list);
+		list = next;
+	}
+	span.End = SetSegs.Size();
+	return span;
+}
+
+// Each seg remembers where it was packed, so that the next set to be packed
+// from it can find it in its parent. Segs that were split since then have
+// different vertices and are not matched.
+
+void FNodeBuilder::PackSet (const FSegSpan &set, FPackedSet &packed, const FPackedSet *parent)
+{
+	packed.Clear ();
+	packed.Parent = parent;
+	for (unsigned int i = set.Begin; i < set.End; ++i)
+	{
+		for (uint32_t segnum = SetSegs[i]; segnum != DWORD_MAX; segnum = Segs[segnum].next)
+		{
+			FPrivSeg *seg = &Segs[segnum];
+			uint32_t pos = seg->packpos;
+
+			if (parent == nullptr || pos >= parent->Size() ||
+				(*parent)[pos].segnum != segnum || (*parent)[pos].v1 != seg->v1 || (*parent)[pos].v2 != seg->v2)
+			{
+				pos = DWORD_MAX;
+			}
+			packed.Origin.Push (pos);
+			seg->packpos = packed.Size();
+
+			FPackedSeg *p = &packed.Segs[packed.Segs.Reserve (1)];
+
+			packed.X1.Push (Vertices[seg->v1].x);
+			packed.Y1.Push (Vertices[seg->v1].y);
+			packed.X2.Push (Vertices[seg->v2].x);
+			packed.Y2.Push (Vertices[seg->v2].y);
+			p->segnum = segnum;
+			p->v1 = seg->v1;
+			p->v2 = seg->v2;
+			p->linedef = seg->linedef;
+			p->frontsector = seg->frontsector;
+			p->backsector = seg->backsector;
+			p->loopnum = seg->loopnum;
+			p->planenum = seg->planenum;
+			p->planefront = seg->planefront;
+		}
+	}
+}
+
+// Checks that a set still contains exactly the segs it had when it was packed.
+// Vertices never move once created, so comparing the vertex numbers is enough.
+
+bool FNodeBuilder::IsPackCurrent (const FSegSpan &set, const FPackedSet &packed) const
+{
+	unsigned int i = 0;
+
+	for (unsigned int j = set.Begin; j < set.End; ++j)
+	{
+		for (uint32_t segnum = SetSegs[j]; segnum != DWORD_MAX; segnum = Segs[segnum].next, ++i)
+		{
+			if (i == packed.Size() ||
+				packed[i].segnum != segnum ||
+				packed[i].v1 != Segs[segnum].v1 ||
+				packed[i].v2 != Segs[segnum].v2)
+			{
+				return false;
+			}
+		}
+	}
+	return i == packed.Size();
+}
+
+// Hashes everything about a set that can affect the choice of splitter. Seg
+// and line numbers are left out, so that sets away from an edit still match
+// after the numbers after it have shifted.
+
+uint64_t FNodeBuilder::HashSet (const FPackedSet &set, unsigned int count) const
+{
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](int64_t value)
+	{
+		for (int i = 0; i < 8; ++i, value >>= 8)
+		{
+			hash = (hash ^ (uint8_t)value) * 1099511628211ull;
+		}
+	};
+
+	mix (GLNodes);
+	mix (MaxSegs);
+	mix (SplitCost);
+	mix (AAPreference);
+	mix (SplitterMode);
+	mix (ExactSides);
+	mix (count);
+	for (unsigned int i = 0; i < set.Size(); ++i)
+	{
+		const FPackedSeg &seg = set[i];
+
+		mix (set.X1[i]);
+		mix (set.Y1[i]);
+		mix (set.X2[i]);
+		mix (set.Y2[i]);
+		mix (seg.linedef == -1);
+		mix (seg.frontsector);
+		mix (seg.frontsector == seg.backsector);
+		mix (seg.loopnum);
+		mix (seg.planefront);
+		if (seg.planenum >= 0)
+		{
+			const FSimpleLine &plane = Planes[seg.planenum];
+			mix (plane.x);
+			mix (plane.y);
+			mix (plane.dx);
+			mix (plane.dy);
+		}
+		else
+		{
+			mix (-1);
+		}
+	}
+	return hash;
+}
+
+void FNodeBuilder::RecordChoice (const FPackedSet &set, const FNodeChoice &choice)
+{
+	FNodeCacheEntry entry;
+
+	memset (&entry, 0, sizeof(entry));
+	entry.NumSegs = set.Size();
+	entry.X = choice.Node.x;
+	entry.Y = choice.Node.y;
+	entry.DX = choice.Node.dx;
+	entry.DY = choice.Node.dy;
+	entry.Split = choice.Split;
+	entry.SplitSeg = entry.HackSeg = entry.HackMate = DWORD_MAX;
+	for (unsigned int i = 0; i < set.Size(); ++i)
+	{
+		if (set[i].segnum == choice.SplitSeg) entry.SplitSeg = i;
+		if (set[i].segnum == choice.HackSeg) entry.HackSeg = i;
+		if (set[i].segnum == choice.HackMate) entry.HackMate = i;
+	}
+	Cache->Add (choice.Hash, entry);
+}
+
+// Decides whether a set should be split, and if so, how. Other than the set's
+// own side memo, this only reads the packed sets and the plane list, so it is
+// safe to call from any thread.
+
+void FNodeBuilder::ChooseSplitter (FPackedSet &set, unsigned int count, FNodeChoice &choice, FSplitterScratch &scratch) const
+{
+	int skip, selstat;
+
+	choice.SplitSeg = DWORD_MAX;
+	choice.HackSeg = DWORD_MAX;
+	choice.HackMate = DWORD_MAX;
+	choice.Cached = false;
+
+	if (Cache != nullptr)
+	{
+		choice.Hash = HashSet (set, count);
+
+		const FNodeCacheEntry *entry = Cache->Find (choice.Hash);
+		if (entry != nullptr && entry->NumSegs == set.Size())
+		{
+			choice.Node.x = entry->X;
+			choice.Node.y = entry->Y;
+			choice.Node.dx = entry->DX;
+			choice.Node.dy = entry->DY;
+			choice.Split = entry->Split != 0;
+			choice.SplitSeg = entry->SplitSeg < set.Size() ? set[entry->SplitSeg].segnum : DWORD_MAX;
+			choice.HackSeg = entry->HackSeg < set.Size() ? set[entry->HackSeg].segnum : DWORD_MAX;
+			choice.HackMate = entry->HackMate < set.Size() ? set[entry->HackMate].segnum : DWORD_MAX;
+			choice.Cached = true;
+			return;
+		}
+	}
+
+	if (SplitterMode == ESM_Fast && set.Size() > FAST_SPLITTERS * 2 && SelectSplitterFast (set, choice, scratch))
+	{
+		choice.Split = true;
+		return;
+	}
+
+	// When building GL nodes, count may not be an exact count of the number of segs
+	// in this set. That's okay, because we just use it to get a skip count, so an
+	// estimate is fine.
+	skip = int(count / MaxSegs);
+
+	choice.Split =
+		(selstat = SelectSplitter (set, choice, skip, true, scratch)) > 0 ||
+		(skip > 0 && (selstat = SelectSplitter (set, choice, 1, true, scratch)) > 0) ||
+		(selstat < 0 && (SelectSplitter (set, choice, skip, false, scratch) > 0 ||
+						(skip > 0 && SelectSplitter (set, choice, 1, false, scratch)))) ||
+		CheckSubsector (set, choice, scratch);
+}
+
+uint32_t FNodeBuilder::CreateSubsector (const FSegSpan &set, fixed_t bbox[4])
 {
 	int ssnum, count;
+	FSegSpan subset;
 
 	bbox[BOXTOP] = bbox[BOXRIGHT] = INT_MIN;
 	bbox[BOXBOTTOM] = bbox[BOXLEFT] = INT_MAX;
 
-	D(Printf ("Subsector from set %d\n", set));
+	D(Printf ("Subsector from set %d\n", SetSegs[set.Begin]));
 
-	assert (set != DWORD_MAX);
+	assert (set.Begin < set.End);
 
 #if defined(_DEBUG)// || 1
 	// Check for segs with duplicate start/end vertices
-	uint32_t s1, s2;
+	FPackedSet check;
 
-	for (s1 = set; s1 != DWORD_MAX; s1 = Segs[s1].next)
+	PackSet (set, check, nullptr);
+	for (unsigned int i1 = 0; i1 < check.Size(); ++i1)
 	{
-		for (s2 = Segs[s1].next; s2 != DWORD_MAX; s2 = Segs[s2].next)
+		for (unsigned int i2 = i1 + 1; i2 < check.Size(); ++i2)
 		{
+			uint32_t s1 = check[i1].segnum, s2 = check[i2].segnum;
+
 			if (Segs[s1].v1 == Segs[s2].v1)
 				printf ("Segs %d%c and %d%c have duplicate start vertex %d (%d, %d)\n",
 				s1, Segs[s1].linedef == -1 ? '*' : ' ',
@@ -152,15 +466,20 @@ uint32_t FNodeBuilder::CreateSubsector (uint32_t set, fixed_t bbox[4])
 	// must use the same pair of vertices), adding a new seg that hasn't been
 	// created yet. After all the nodes are built, then we can create the
 	// actual subsectors using the CreateSubsectorsForReal function below.
-	ssnum = (int)SubsectorSets.Push (set);
-
+	// The set's span has to be copied because SetSegs gets reused.
+	subset.Begin = SubsectorSegs.Size();
 	count = 0;
-	while (set != DWORD_MAX)
+	for (unsigned int i = set.Begin; i < set.End; ++i)
 	{
-		AddSegToBBox (bbox, &Segs[set]);
-		set = Segs[set].next;
-		count++;
+		SubsectorSegs.Push (SetSegs[i]);
+		for (uint32_t seg = SetSegs[i]; seg != DWORD_MAX; seg = Segs[seg].next)
+		{
+			AddSegToBBox (bbox, &Segs[seg]);
+			count++;
+		}
 	}
+	subset.End = SubsectorSegs.Size();
+	ssnum = (int)SubsectorSets.Push (subset);
 
 	SegsStuffed += count;
 	if ((SegsStuffed & ~63) != ((SegsStuffed - count) & ~63))
@@ -181,16 +500,18 @@ void FNodeBuilder::CreateSubsectorsForReal ()
 	for (i = 0; i < SubsectorSets.Size(); ++i)
 	{
 		subsector_t sub;
-		uint32_t set = SubsectorSets[i];
+		const FSegSpan &set = SubsectorSets[i];
 
 		sub.firstline = (uint32_t)SegList.Size();
-		while (set != DWORD_MAX)
+		for (unsigned int j = set.Begin; j < set.End; ++j)
 		{
-			USegPtr ptr;
+			for (uint32_t seg = SubsectorSegs[j]; seg != DWORD_MAX; seg = Segs[seg].next)
+			{
+				USegPtr ptr;
 
-			ptr.SegPtr = &Segs[set];
-			SegList.Push (ptr);
-			set = ptr.SegPtr->next;
+				ptr.SegPtr = &Segs[seg];
+				SegList.Push (ptr);
+			}
 		}
 		sub.numlines = (uint32_t)(SegList.Size() - sub.firstline);
 
@@ -286,23 +607,23 @@ int STACK_ARGS FNodeBuilder::SortSegs (const void *a, const void *b)
 // a splitter is synthesized, and true is returned to continue processing
 // down this branch of the tree.
 
-bool FNodeBuilder::CheckSubsector (uint32_t set, node_t &node, uint32_t &splitseg)
+bool FNodeBuilder::CheckSubsector (const FPackedSet &set, FNodeChoice &choice, FSplitterScratch &scratch) const
 {
 	int sec;
-	uint32_t seg;
+	unsigned int seg;
 
 	sec = -1;
-	seg = set;
+	seg = 0;
 
 	do
 	{
-		D(Printf (" - seg %d%c(%d,%d)-(%d,%d) line %d front %d back %d\n", seg,
-			Segs[seg].linedef == -1 ? '+' : ' ',
-			Vertices[Segs[seg].v1].x>>16, Vertices[Segs[seg].v1].y>>16,
-			Vertices[Segs[seg].v2].x>>16, Vertices[Segs[seg].v2].y>>16,
-			Segs[seg].linedef, Segs[seg].frontsector, Segs[seg].backsector));
-		if (Segs[seg].linedef != -1 &&
-			Segs[seg].frontsector != sec
+		D(Printf (" - seg %d%c(%d,%d)-(%d,%d) line %d front %d back %d\n", set[seg].segnum,
+			set[seg].linedef == -1 ? '+' : ' ',
+			set.X1[seg]>>16, set.Y1[seg]>>16,
+			set.X2[seg]>>16, set.Y2[seg]>>16,
+			set[seg].linedef, set[seg].frontsector, set[seg].backsector));
+		if (set[seg].linedef != -1 &&
+			set[seg].frontsector != sec
 			// Segs with the same front and back sectors are allowed to reside
 			// in a subsector with segs from a different sector, because the
 			// only effect they can have on the display is to place masked
@@ -311,67 +632,67 @@ bool FNodeBuilder::CheckSubsector (uint32_t set, node_t &node, uint32_t &splitse
 			//
 			// Update: Lines with the same front and back sectors *can* affect
 			// the display if their subsector does not match their front sector.
-			/*&& Segs[seg].frontsector != Segs[seg].backsector*/)
+			/*&& set[seg].frontsector != set[seg].backsector*/)
 		{
 			if (sec == -1)
 			{
-				sec = Segs[seg].frontsector;
+				sec = set[seg].frontsector;
 			}
 			else
 			{
 				break;
 			}
 		}
-		seg = Segs[seg].next;
-	} while (seg != DWORD_MAX);
+		++seg;
+	} while (seg < set.Size());
 
-	if (seg == DWORD_MAX)
+	if (seg == set.Size())
 	{ // It's a valid non-GL subsector, and probably a valid GL subsector too.
 		if (GLNodes)
 		{
-			return CheckSubsectorOverlappingSegs (set, node, splitseg);
+			return CheckSubsectorOverlappingSegs (set, choice, scratch);
 		}
 		return false;
 	}
 
-	D(Printf("Need to synthesize a splitter for set %d on seg %d\n", set, seg));
-	splitseg = DWORD_MAX;
+	D(Printf("Need to synthesize a splitter for set %d on seg %d\n", set[0].segnum, set[seg].segnum));
+	choice.SplitSeg = DWORD_MAX;
 
 	// This is a very simple and cheap "fix" for subsectors with segs
 	// from multiple sectors, and it seems ZenNode does something
 	// similar. It is the only technique I could find that makes the
 	// "transparent water" in nb_bmtrk.wad work properly.
-	return ShoveSegBehind (set, node, seg, DWORD_MAX);
+	return ShoveSegBehind (set, choice, seg, DWORD_MAX, scratch);
 }
 
 // When creating GL nodes, we need to check for segs with the same start and
 // end vertices and split them into two subsectors.
 
-bool FNodeBuilder::CheckSubsectorOverlappingSegs (uint32_t set, node_t &node, uint32_t &splitseg)
+bool FNodeBuilder::CheckSubsectorOverlappingSegs (const FPackedSet &set, FNodeChoice &choice, FSplitterScratch &scratch) const
 {
 	int v1, v2;
-	uint32_t seg1, seg2;
+	unsigned int seg1, seg2;
 
-	for (seg1 = set; seg1 != DWORD_MAX; seg1 = Segs[seg1].next)
+	for (seg1 = 0; seg1 < set.Size(); ++seg1)
 	{
-		if (Segs[seg1].linedef == -1)
+		if (set[seg1].linedef == -1)
 		{ // Do not check minisegs.
 			continue;
 		}
-		v1 = Segs[seg1].v1;
-		v2 = Segs[seg1].v2;
-		for (seg2 = Segs[seg1].next; seg2 != DWORD_MAX; seg2 = Segs[seg2].next)
+		v1 = set[seg1].v1;
+		v2 = set[seg1].v2;
+		for (seg2 = seg1 + 1; seg2 < set.Size(); ++seg2)
 		{
-			if (Segs[seg2].v1 == v1 && Segs[seg2].v2 == v2)
+			if (set[seg2].v1 == v1 && set[seg2].v2 == v2)
 			{
-				if (Segs[seg2].linedef == -1)
+				if (set[seg2].linedef == -1)
 				{ // Do not put minisegs into a new subsector.
 					std::swap (seg1, seg2);
 				}
-				D(Printf("Need to synthesize a splitter for set %d on seg %d (ov)\n", set, seg2));
-				splitseg = DWORD_MAX;
+				D(Printf("Need to synthesize a splitter for set %d on seg %d (ov)\n", set[0].segnum, set[seg2].segnum));
+				choice.SplitSeg = DWORD_MAX;
 
-				return ShoveSegBehind (set, node, seg2, seg1);
+				return ShoveSegBehind (set, choice, seg2, set[seg1].segnum, scratch);
 			}
 		}
 	}
@@ -390,19 +711,21 @@ bool FNodeBuilder::CheckSubsectorOverlappingSegs (uint32_t set, node_t &node, ui
 // seg in front of the splitter is partnered with a new miniseg on
 // the back so that the back will have two segs.
 
-bool FNodeBuilder::ShoveSegBehind (uint32_t set, node_t &node, uint32_t seg, uint32_t mate)
+bool FNodeBuilder::ShoveSegBehind (const FPackedSet &set, FNodeChoice &choice, unsigned int seg, uint32_t mate, FSplitterScratch &scratch) const
 {
-	SetNodeFromSeg (node, &Segs[seg]);
-	HackSeg = seg;
-	HackMate = mate;
-	if (!Segs[seg].planefront)
+	node_t &node = choice.Node;
+
+	SetNodeFromSeg (node, set, seg);
+	choice.HackSeg = set[seg].segnum;
+	choice.HackMate = mate;
+	if (!set[seg].planefront)
 	{
 		node.x += node.dx;
 		node.y += node.dy;
 		node.dx = -node.dx;
 		node.dy = -node.dy;
 	}
-	return Heuristic (node, set, false) > 0;
+	return Heuristic (node, set, false, choice.HackSeg, scratch) > 0;
 }
 
 // Splitters are chosen to coincide with segs in the given set. To reduce the
@@ -412,27 +735,30 @@ bool FNodeBuilder::ShoveSegBehind (uint32_t set, node_t &node, uint32_t seg, uin
 // each unique plane needs to be considered as a splitter. A result of 0 means
 // this set is a convex region. A result of -1 means that there were possible
 // splitters, but they all split segs we want to keep intact.
-int FNodeBuilder::SelectSplitter (uint32_t set, node_t &node, uint32_t &splitseg, int step, bool nosplit)
+int FNodeBuilder::SelectSplitter (FPackedSet &set, FNodeChoice &choice, int step, bool nosplit, FSplitterScratch &scratch) const
 {
 	int stepleft;
 	int bestvalue;
-	uint32_t bestseg;
-	uint32_t seg;
+	unsigned int bestseg;
+	unsigned int seg;
 	bool nosplitters = false;
+	node_t &node = choice.Node;
+	TArray<uint8_t> &PlaneChecked = scratch.PlaneChecked;
+	TArray<unsigned int> candidates;
+	TArray<int> values;
 
 	bestvalue = 0;
-	bestseg = DWORD_MAX;
+	bestseg = UINT_MAX;
 
-	seg = set;
 	stepleft = 0;
 
-	memset (&PlaneChecked[0], 0, PlaneChecked.Size());
-
-	D(printf("Processing set %d\n", set));
+	D(printf("Processing set %d\n", set[0].segnum));
 
-	while (seg != DWORD_MAX)
+	// Which segs get tried does not depend on how they score, so collect
+	// them first and score them all in one go.
+	for (seg = 0; seg < set.Size(); ++seg)
 	{
-		FPrivSeg *pseg = &Segs[seg];
+		const FPackedSeg *pseg = &set[seg];
 
 		if (--stepleft <= 0)
 		{
@@ -447,45 +773,268 @@ int FNodeBuilder::SelectSplitter (uint32_t set, node_t &node, uint32_t &splitseg
 				}
 
 				stepleft = step;
-				SetNodeFromSeg (node, pseg);
+				candidates.Push (seg);
+			}
+		}
+	}
+
+	// Clear just the planes that were marked, rather than the whole list, since
+	// most sets only use a few of them. This has to happen before scoring:
+	// while ScoreSplitters waits, this thread may select the splitter of
+	// another set with the same scratch space, and must find no planes marked.
+	for (unsigned int i = 0; i < candidates.Size(); ++i)
+	{
+		int planenum = set[candidates[i]].planenum;
+		if (planenum >= 0)
+		{
+			PlaneChecked[planenum >> 3] = 0;
+		}
+	}
+
+	// Only the first pass over a set keeps its sides. Later passes mostly try
+	// the same planes again, and the children only need one row per plane.
+	ScoreSplitters (set, candidates, values, nosplit, set.MemoPlanes.Size() == 0, scratch);
+
+	for (unsigned int i = 0; i < candidates.Size(); ++i)
+	{
+		int value = values[i];
+
+		seg = candidates[i];
+		D(SetNodeFromSeg (node, set, seg));
+		D(Printf ("Seg %5d, ld %d (%5d,%5d)-(%5d,%5d) scores %d\n", set[seg].segnum,
+			set[seg].linedef,
+			node.x>>16, node.y>>16,
+			(node.x+node.dx)>>16, (node.y+node.dy)>>16, value));
+
+		if (value > bestvalue)
+		{
+			bestvalue = value;
+			bestseg = seg;
+		}
+		else if (value < 0)
+		{
+			nosplitters = true;
+		}
+	}
+
+	if (bestseg == UINT_MAX)
+	{ // No lines split any others into two sets, so this is a convex region.
+	D(Printf ("set %d, step %d, nosplit %d has no good splitter (%d)\n", set[0].segnum, step, nosplit, nosplitters));
+		return nosplitters ? -1 : 0;
+	}
+
+	D(Printf ("split seg %u in set %u, score %d, step %d, nosplit %d\n", set[bestseg].segnum, set[0].segnum, bestvalue, step, nosplit));
+
+	choice.SplitSeg = set[bestseg].segnum;
+	SetNodeFromSeg (node, set, bestseg);
+	return 1;
+}
+
+// Used before SelectSplitter for --fast-nodes. Instead of a seg from every
+// plane, only the planes of the segs closest to the middle of the set are
+// tried: vertical segs across the set's width, horizontal segs across its
+// height, and if that is not enough, any segs across its width. That makes
+// each node take linear time and keeps the splits fairly even. If none of
+// them will do, this returns false and the set is handled as usual, which is
+// also how convex sets are recognized.
+
+bool FNodeBuilder::SelectSplitterFast (FPackedSet &set, FNodeChoice &choice, FSplitterScratch &scratch) const
+{
+	TArray<int64_t> &keys = scratch.Keys;
+	TArray<unsigned int> candidates;
+	TArray<int> values;
+	unsigned int size = set.Size();
+	int bestvalue = 0;
+	unsigned int bestseg = UINT_MAX;
+
+	auto gather = [&](const TArray<fixed_t> &c1, const TArray<fixed_t> &c2, const TArray<fixed_t> *flat1, const TArray<fixed_t> *flat2)
+	{
+		unsigned int best[FAST_SPLITTERS];
+		int64_t bestdist[FAST_SPLITTERS];
+		unsigned int numbest = 0;
 
-				int value = Heuristic (node, set, nosplit);
+		keys.Resize (size);
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			keys[i] = (int64_t)c1[i] + c2[i];
+		}
+		std::nth_element (&keys[0], &keys[size / 2], &keys[0] + size);
+		int64_t median = keys[size / 2];
 
-				D(Printf ("Seg %5d, ld %d (%5d,%5d)-(%5d,%5d) scores %d\n", seg,
-					Segs[seg].linedef,
-					node.x>>16, node.y>>16,
-					(node.x+node.dx)>>16, (node.y+node.dy)>>16, value));
+		// Keep the closest segs on different planes, nearest first
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			int64_t dist = (int64_t)c1[i] + c2[i] - median;
+			int planenum = set[i].planenum;
+			unsigned int j;
 
-				if (value > bestvalue)
+			if (flat1 != nullptr && (*flat1)[i] != (*flat2)[i])
+			{
+				continue;
+			}
+			dist = dist < 0 ? -dist : dist;
+			if (numbest == FAST_SPLITTERS && dist >= bestdist[numbest - 1])
+			{
+				continue;
+			}
+			for (j = 0; j < numbest; ++j)
+			{
+				if (planenum >= 0 && set[best[j]].planenum == planenum)
 				{
-					bestvalue = value;
-					bestseg = seg;
+					break;
 				}
-				else if (value < 0)
+			}
+			if (j < numbest)
+			{
+				continue;
+			}
+			if (numbest < FAST_SPLITTERS)
+			{
+				numbest++;
+			}
+			for (j = numbest - 1; j > 0 && bestdist[j - 1] > dist; --j)
+			{
+				best[j] = best[j - 1];
+				bestdist[j] = bestdist[j - 1];
+			}
+			best[j] = i;
+			bestdist[j] = dist;
+		}
+
+		for (unsigned int i = 0; i < numbest; ++i)
+		{
+			unsigned int j;
+
+			for (j = 0; j < candidates.Size(); ++j)
+			{
+				if (set[best[i]].planenum >= 0 && set[candidates[j]].planenum == set[best[i]].planenum)
 				{
-					nosplitters = true;
+					break;
 				}
 			}
-			else
+			if (j == candidates.Size())
 			{
-				pseg = pseg;
+				candidates.Push (best[i]);
 			}
 		}
+	};
 
-		seg = pseg->next;
+	gather (set.X1, set.X2, &set.X1, &set.X2);
+	gather (set.Y1, set.Y2, &set.Y1, &set.Y2);
+	if (candidates.Size() < FAST_SPLITTERS)
+	{
+		gather (set.X1, set.X2, nullptr, nullptr);
 	}
 
-	if (bestseg == DWORD_MAX)
-	{ // No lines split any others into two sets, so this is a convex region.
-	D(Printf ("set %d, step %d, nosplit %d has no good splitter (%d)\n", set, step, nosplit, nosplitters));
-		return nosplitters ? -1 : 0;
+	ScoreSplitters (set, candidates, values, true, set.MemoPlanes.Size() == 0, scratch);
+
+	for (unsigned int i = 0; i < candidates.Size(); ++i)
+	{
+		if (values[i] > bestvalue)
+		{
+			bestvalue = values[i];
+			bestseg = candidates[i];
+		}
+	}
+	if (bestseg == UINT_MAX)
+	{
+		return false;
 	}
 
-	D(Printf ("split seg %u in set %u, score %d, step %d, nosplit %d\n", bestseg, set, bestvalue, step, nosplit));
+	D(Printf ("fast split seg %u in set %u, score %d\n", set[bestseg].segnum, set[0].segnum, bestvalue));
 
-	splitseg = bestseg;
-	SetNodeFromSeg (node, &Segs[bestseg]);
-	return 1;
+	choice.SplitSeg = set[bestseg].segnum;
+	SetNodeFromSeg (choice.Node, set, bestseg);
+	return true;
+}
+
+// Runs the heuristic for every candidate splitter. Large sets are divided
+// among the thread pool; each task scores a contiguous run of candidates
+// with the scratch space of whichever thread runs it.
+//
+// If record is set, each candidate's plane gets a row in the set's side memo
+// until the memo is full. The rows are all made before scoring starts, so
+// MemoSides does not move while the heuristic is writing to it.
+
+void FNodeBuilder::ScoreSplitters (FPackedSet &set, const TArray<unsigned int> &candidates, TArray<int> &values, bool nosplit, bool record, FSplitterScratch &scratch) const
+{
+	unsigned int count = candidates.Size();
+	TArray<FSideMemoRow> memos;
+	TArray<int> rows;
+	TArray<int> &memorows = scratch.MemoRows;
+	const FPackedSet *parent = set.Parent;
+
+	values.Resize (count);
+	memos.Resize (count);
+	rows.Resize (count);
+
+	if (parent != nullptr)
+	{
+		for (unsigned int i = 0; i < parent->MemoPlanes.Size(); ++i)
+		{
+			memorows[parent->MemoPlanes[i]] = (int)i;
+		}
+	}
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		int planenum = set[candidates[i]].planenum;
+		int known = planenum >= 0 ? memorows[planenum] : -1;
+
+		rows[i] = -1;
+		if (record && planenum >= 0 && (set.MemoPlanes.Size() + 1) * set.Size() <= SIDE_MEMO_BYTES)
+		{
+			rows[i] = (int)set.MemoPlanes.Push (planenum);
+			set.MemoCounts.Push (0);
+		}
+		memos[i].Known = known >= 0 ? &parent->MemoSides[known * parent->Size()] : nullptr;
+		memos[i].KnownCount = known >= 0 ? parent->MemoCounts[known] : 0;
+	}
+	if (parent != nullptr)
+	{
+		for (unsigned int i = 0; i < parent->MemoPlanes.Size(); ++i)
+		{
+			memorows[parent->MemoPlanes[i]] = -1;
+		}
+	}
+	set.MemoSides.Resize (set.MemoPlanes.Size() * set.Size());
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		memos[i].Record = rows[i] >= 0 ? &set.MemoSides[rows[i] * set.Size()] : nullptr;
+		memos[i].RecordCount = rows[i] >= 0 ? &set.MemoCounts[rows[i]] : nullptr;
+	}
+
+	if (Pool == nullptr || count < 2 || set.Size() < MIN_PARALLEL_SCORE_SEGS)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			node_t node;
+			SetNodeFromSeg (node, set, candidates[i]);
+			values[i] = Heuristic (node, set, nosplit, DWORD_MAX, scratch, &memos[i]);
+		}
+		return;
+	}
+
+	unsigned int numtasks = MIN (count, (unsigned int)(Pool->GetWorkerCount() + 1) * 4);
+	std::atomic<unsigned int> remaining (numtasks);
+
+	for (unsigned int t = 0; t < numtasks; ++t)
+	{
+		unsigned int start = (unsigned int)((uint64_t)count * t / numtasks);
+		unsigned int end = (unsigned int)((uint64_t)count * (t + 1) / numtasks);
+
+		Pool->Submit ([this, &set, &candidates, &values, &memos, &remaining, nosplit, start, end]()
+		{
+			FSplitterScratch &taskscratch = Scratch[Pool->GetCurrentSlot()];
+			for (unsigned int i = start; i < end; ++i)
+			{
+				node_t node;
+				SetNodeFromSeg (node, set, candidates[i]);
+				values[i] = Heuristic (node, set, nosplit, DWORD_MAX, taskscratch, &memos[i]);
+			}
+			remaining--;
+		});
+	}
+	Pool->WaitUntil ([&remaining]() { return remaining == 0; });
 }
 
 // Given a splitter (node), returns a score based on how "good" the resulting
@@ -494,7 +1043,7 @@ int FNodeBuilder::SelectSplitter (uint32_t set, node_t &node, uint32_t &splitseg
 // true. A score of 0 means that the splitter does not split any of the segs
 // in the set.
 
-int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
+int FNodeBuilder::Heuristic (node_t &node, const FPackedSet &set, bool honorNoSplit, uint32_t hackseg, FSplitterScratch &scratch, const FSideMemoRow *memo) const
 {
 	// Set the initial score above 0 so that near vertex anti-weighting is less likely to produce a negative score.
 	int score = 1000000;
@@ -502,27 +1051,38 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 	int counts[2] = { 0, 0 };
 	int realSegs[2] = { 0, 0 };
 	int specialSegs[2] = { 0, 0 };
-	uint32_t i = set;
+	unsigned int i;
 	int sidev[2];
 	int side;
 	bool splitter = false;
 	unsigned int max, m2, p, q;
 	double frac;
+	TArray<int> &Touched = scratch.Touched;
+	TArray<int> &Colinear = scratch.Colinear;
 
 	Touched.Clear ();
 	Colinear.Clear ();
 
-	while (i != DWORD_MAX)
+	for (i = 0; i < set.Size(); ++i)
 	{
-		const FPrivSeg *test = &Segs[i];
+		const FPackedSeg *test = &set[i];
+		unsigned int b = i % CLASSIFY_BLOCK;
+
+		if (b == 0)
+		{
+			ClassifyLines (node, set, i, MIN (set.Size() - i, (unsigned int)CLASSIFY_BLOCK), scratch, memo);
+		}
+		uint8_t code = scratch.Sides[b];
+		sidev[0] = ((code >> 2) & 3) - 1;
+		sidev[1] = (code >> 4) - 1;
 
-		if (HackSeg == i)
+		if (hackseg == test->segnum)
 		{
 			side = 1;
 		}
 		else
 		{
-			side = ClassifyLine (node, &Vertices[test->v1], &Vertices[test->v2], sidev);
+			side = (code & 3) - 1;
 		}
 
 		switch (side)
@@ -591,7 +1151,7 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 			{
 				if (honorNoSplit)
 				{
-					D(Printf ("Splits seg %d\n", i));
+					D(Printf ("Splits seg %d\n", test->segnum));
 					return -1;
 				}
 				else
@@ -601,22 +1161,23 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 			}
 
 			// Splitters that are too close to a vertex are bad.
-			frac = InterceptVector (node, *test);
+			FSimpleVert p1 = set.V1 (i), p2 = set.V2 (i);
+			frac = InterceptVector (node, p1, p2);
 			if (frac < 0.001 || frac > 0.999)
 			{
-				FPrivVert *v1 = &Vertices[test->v1];
-				FPrivVert *v2 = &Vertices[test->v2];
+				const FSimpleVert *v1 = &p1;
+				const FSimpleVert *v2 = &p2;
 				double x = v1->x, y = v1->y;
 				x += frac * (v2->x - x);
 				y += frac * (v2->y - y);
 				if (fabs(x - v1->x) < VERTEX_EPSILON+1 && fabs(y - v1->y) < VERTEX_EPSILON+1)
 				{
-					D(Printf("Splitter will produce same start vertex as seg %d\n", i));
+					D(Printf("Splitter will produce same start vertex as seg %d\n", test->segnum));
 					return -1;
 				}
 				if (fabs(x - v2->x) < VERTEX_EPSILON+1 && fabs(y - v2->y) < VERTEX_EPSILON+1)
 				{
-					D(Printf("Splitter will produce same end vertex as seg %d\n", i));
+					D(Printf("Splitter will produce same end vertex as seg %d\n", test->segnum));
 					return -1;
 				}
 				if (frac > 0.999)
@@ -625,7 +1186,7 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 				}
 				int penalty = int(1 / frac);
 				score = MAX(score - penalty, 1);
-				D(Printf ("Penalized splitter by %d for being near endpt of seg %d (%f).\n", penalty, i, frac));
+				D(Printf ("Penalized splitter by %d for being near endpt of seg %d (%f).\n", penalty, test->segnum, frac));
 			}
 
 			counts[0]++;
@@ -644,7 +1205,6 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 		}
 
 		segsInSet++;
-		i = test->next;
 	}
 
 	// If this line is outside all the others, return a special score
@@ -733,167 +1293,236 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 	return score;
 }
 
-void FNodeBuilder::SplitSegs (uint32_t set, node_t &node, uint32_t splitseg, uint32_t &outset0, uint32_t &outset1, unsigned int &count0, unsigned int &count1)
+// Classifies a run of segs in a packed set against a splitter. The results
+// go into the scratch arrays, indexed from the start of the run. If the
+// parent set was already classified against the same plane, the segs it
+// shares with the parent are looked up instead, and only the rest are
+// classified.
+
+void FNodeBuilder::ClassifyLines (node_t &node, const FPackedSet &set, unsigned int start, unsigned int count, FSplitterScratch &scratch, const FSideMemoRow *memo)
 {
-	unsigned int _count0 = 0;
-	unsigned int _count1 = 0;
-	outset0 = DWORD_MAX;
-	outset1 = DWORD_MAX;
+	uint8_t *sides;
 
-	Events.DeleteAll ();
-	SplitSharers.Clear ();
+	scratch.Sides.Resize (CLASSIFY_BLOCK);
+	sides = &scratch.Sides[0];
 
-	while (set != DWORD_MAX)
+	if (memo != nullptr && memo->Known != nullptr)
 	{
-		bool hack;
-		FPrivSeg *seg = &Segs[set];
-		int next = seg->next;
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			uint32_t pos = set.Origin[start + i];
 
-		int sidev[2], side;
+			if (pos < memo->KnownCount)
+			{
+				sides[i] = memo->Known[pos];
+			}
+			else
+			{
+				FSimpleVert v1 = set.V1 (start + i), v2 = set.V2 (start + i);
+				int sidev[2];
+				int side = ClassifyLine (node, &v1, &v2, sidev);
 
-		if (HackSeg == set)
-		{
-			HackSeg = DWORD_MAX;
-			side = 1;
-			sidev[0] = sidev[1] = 0;
-			hack = true;
-		}
-		else
-		{
-			side = ClassifyLine (node, &Vertices[seg->v1], &Vertices[seg->v2], sidev);
-			hack = false;
+				sides[i] = EncodeSides (side, sidev[0], sidev[1]);
+			}
 		}
-
-		switch (side)
+	}
+#ifndef DISABLE_SSE
+	else if (SSELevel >= 3 && !ExactSides)
+	{
+		ClassifyLinesAVX2 (node, &set.X1[start], &set.Y1[start], &set.X2[start], &set.Y2[start], count, sides);
+	}
+#endif
+	else
+	{
+		for (unsigned int i = 0; i < count; ++i)
 		{
-		case 0: // seg is entirely in front
-			seg->next = outset0;
-			//Printf ("%u in front\n", set);
-			outset0 = set;
-			_count0++;
-			break;
+			FSimpleVert v1 = set.V1 (start + i), v2 = set.V2 (start + i);
+			int sidev[2];
+			int side = ClassifyLine (node, &v1, &v2, sidev);
 
-		case 1: // seg is entirely in back
-			seg->next = outset1;
-			//Printf ("%u in back\n", set);
-			outset1 = set;
-			_count1++;
-			break;
+			sides[i] = EncodeSides (side, sidev[0], sidev[1]);
+		}
+	}
 
-		default: // seg needs to be split
-			double frac;
-			FPrivVert newvert;
-			unsigned int vertnum;
-			int seg2;
+	if (memo != nullptr && memo->Record != nullptr)
+	{
+		memcpy (memo->Record + start, sides, count);
+		*memo->RecordCount = start + count;
+	}
+}
 
-			//Printf ("%u is cut\n", set);
-			if (seg->loopnum)
-			{
-				Printf ("   Split seg %lu (%d,%d)-(%d,%d) of sector %d on line %d\n",
-					(unsigned long)set,
-					Vertices[seg->v1].x>>16, Vertices[seg->v1].y>>16,
-					Vertices[seg->v2].x>>16, Vertices[seg->v2].y>>16,
-					seg->frontsector, seg->linedef);
-			}
+void FNodeBuilder::SplitSegs (const FSegSpan &span, node_t &node, uint32_t splitseg, FSegSpan &outspan0, FSegSpan &outspan1, unsigned int &count0, unsigned int &count1)
+{
+	unsigned int _count0 = 0;
+	unsigned int _count1 = 0;
+	uint32_t outset0 = DWORD_MAX;
+	uint32_t outset1 = DWORD_MAX;
 
-			frac = InterceptVector (node, *seg);
-			newvert.x = Vertices[seg->v1].x;
-			newvert.y = Vertices[seg->v1].y;
-			newvert.x += fixed_t(frac * double(Vertices[seg->v2].x - newvert.x));
-			newvert.y += fixed_t(frac * double(Vertices[seg->v2].y - newvert.y));
-			newvert.index = 0;
-			vertnum = VertexMap->SelectVertexClose (newvert);
+	Events.Clear ();
+	SplitSharers.Clear ();
 
-			if ((int)vertnum == seg->v1 || (int)vertnum == seg->v2)
-			{
-				Printf("SelectVertexClose selected endpoint of seg %u\n", (unsigned int)set);
-			}
+	// The out sets are built up as linked lists while the segs are sorted. Segs in
+	// the span can still grow chains here, since splitting a seg also splits its
+	// partner, which may come later in this same set.
+	for (unsigned int i = span.Begin; i < span.End; ++i)
+	{
+		uint32_t set = SetSegs[i];
 
-			seg2 = SplitSeg (set, vertnum, sidev[0]);
+		while (set != DWORD_MAX)
+		{
+			bool hack;
+			FPrivSeg *seg = &Segs[set];
+			int next = seg->next;
 
-			Segs[seg2].next = outset0;
-			outset0 = seg2;
-			Segs[set].next = outset1;
-			outset1 = set;
-			_count0++;
-			_count1++;
+			int sidev[2], side;
 
-			// Also split the seg on the back side
-			if (Segs[set].partner != DWORD_MAX)
+			if (HackSeg == set)
 			{
-				int partner1 = Segs[set].partner;
-				int partner2 = SplitSeg (partner1, vertnum, sidev[1]);
-				// The newly created seg stays in the same set as the
-				// back seg because it has not been considered for splitting
-				// yet. If it had been, then the front seg would have already
-				// been split, and we would not be in this default case.
-				// Moreover, the back seg may not even be in the set being
-				// split, so we must not move its pieces into the out sets.
-				Segs[partner1].next = partner2;
-				Segs[partner2].partner = seg2;
-				Segs[seg2].partner = partner2;
-
-				assert (Segs[partner2].v1 == Segs[seg2].v2);
-				assert (Segs[partner2].v2 == Segs[seg2].v1);
-				assert (Segs[partner1].v1 == Segs[set].v2);
-				assert (Segs[partner1].v2 == Segs[set].v1);
+				HackSeg = DWORD_MAX;
+				side = 1;
+				sidev[0] = sidev[1] = 0;
+				hack = true;
 			}
-
-			if (GLNodes)
+			else
 			{
-				AddIntersection (node, vertnum);
+				side = ClassifyLine (node, &Vertices[seg->v1], &Vertices[seg->v2], sidev);
+				hack = false;
 			}
 
-			break;
-		}
-		if (side >= 0 && GLNodes)
-		{
-			if (sidev[0] == 0)
+			switch (side)
 			{
-				double dist1 = AddIntersection (node, seg->v1);
-				if (sidev[1] == 0)
+			case 0: // seg is entirely in front
+				seg->next = outset0;
+				//Printf ("%u in front\n", set);
+				outset0 = set;
+				_count0++;
+				break;
+
+			case 1: // seg is entirely in back
+				seg->next = outset1;
+				//Printf ("%u in back\n", set);
+				outset1 = set;
+				_count1++;
+				break;
+
+			default: // seg needs to be split
+				double frac;
+				FPrivVert newvert;
+				unsigned int vertnum;
+				int seg2;
+
+				//Printf ("%u is cut\n", set);
+				if (seg->loopnum)
 				{
-					double dist2 = AddIntersection (node, seg->v2);
-					FSplitSharer share = { dist1, set, dist2 > dist1 };
-					SplitSharers.Push (share);
+					Printf ("   Split seg %lu (%d,%d)-(%d,%d) of sector %d on line %d\n",
+						(unsigned long)set,
+						Vertices[seg->v1].x>>16, Vertices[seg->v1].y>>16,
+						Vertices[seg->v2].x>>16, Vertices[seg->v2].y>>16,
+						seg->frontsector, seg->linedef);
 				}
-			}
-			else if (sidev[1] == 0)
-			{
-				AddIntersection (node, seg->v2);
-			}
-		}
-		if (hack && GLNodes)
-		{
-			uint32_t newback, newfront;
 
-			newback = AddMiniseg (seg->v2, seg->v1, DWORD_MAX, set, splitseg);
-			if (HackMate == DWORD_MAX)
-			{
-				newfront = AddMiniseg (Segs[set].v1, Segs[set].v2, newback, set, splitseg);
-				Segs[newfront].next = outset0;
-				outset0 = newfront;
+				frac = InterceptVector (node, Vertices[seg->v1], Vertices[seg->v2]);
+				newvert.x = Vertices[seg->v1].x;
+				newvert.y = Vertices[seg->v1].y;
+				newvert.x += fixed_t(frac * double(Vertices[seg->v2].x - newvert.x));
+				newvert.y += fixed_t(frac * double(Vertices[seg->v2].y - newvert.y));
+				newvert.index = 0;
+				vertnum = VertexMap->SelectVertexClose (newvert);
+
+				if ((int)vertnum == seg->v1 || (int)vertnum == seg->v2)
+				{
+					Printf("SelectVertexClose selected endpoint of seg %u\n", (unsigned int)set);
+				}
+
+				seg2 = SplitSeg (set, vertnum, sidev[0]);
+				NumSplits++;
+
+				Segs[seg2].next = outset0;
+				outset0 = seg2;
+				Segs[set].next = outset1;
+				outset1 = set;
+				_count0++;
+				_count1++;
+
+				// Also split the seg on the back side
+				if (Segs[set].partner != DWORD_MAX)
+				{
+					int partner1 = Segs[set].partner;
+					int partner2 = SplitSeg (partner1, vertnum, sidev[1]);
+					// The newly created seg stays in the same set as the
+					// back seg because it has not been considered for splitting
+					// yet. If it had been, then the front seg would have already
+					// been split, and we would not be in this default case.
+					// Moreover, the back seg may not even be in the set being
+					// split, so we must not move its pieces into the out sets.
+					Segs[partner1].next = partner2;
+					Segs[partner2].partner = seg2;
+					Segs[seg2].partner = partner2;
+
+					assert (Segs[partner2].v1 == Segs[seg2].v2);
+					assert (Segs[partner2].v2 == Segs[seg2].v1);
+					assert (Segs[partner1].v1 == Segs[set].v2);
+					assert (Segs[partner1].v2 == Segs[set].v1);
+				}
+
+				if (GLNodes)
+				{
+					AddIntersection (node, vertnum);
+				}
+
+				break;
 			}
-			else
+			if (side >= 0 && GLNodes)
 			{
-				newfront = HackMate;
-				Segs[newfront].partner = newback;
-				Segs[newback].partner = newfront;
+				if (sidev[0] == 0)
+				{
+					double dist1 = AddIntersection (node, seg->v1);
+					if (sidev[1] == 0)
+					{
+						double dist2 = AddIntersection (node, seg->v2);
+						FSplitSharer share = { dist1, set, dist2 > dist1 };
+						SplitSharers.Push (share);
+					}
+				}
+				else if (sidev[1] == 0)
+				{
+					AddIntersection (node, seg->v2);
+				}
 			}
-			Segs[newback].frontsector = Segs[newback].backsector =
-				Segs[newfront].frontsector = Segs[newfront].backsector =
-				Segs[set].frontsector;
+			if (hack && GLNodes)
+			{
+				uint32_t newback, newfront;
+
+				newback = AddMiniseg (seg->v2, seg->v1, DWORD_MAX, set, splitseg);
+				if (HackMate == DWORD_MAX)
+				{
+					newfront = AddMiniseg (Segs[set].v1, Segs[set].v2, newback, set, splitseg);
+					Segs[newfront].next = outset0;
+					outset0 = newfront;
+				}
+				else
+				{
+					newfront = HackMate;
+					Segs[newfront].partner = newback;
+					Segs[newback].partner = newfront;
+				}
+				Segs[newback].frontsector = Segs[newback].backsector =
+					Segs[newfront].frontsector = Segs[newfront].backsector =
+					Segs[set].frontsector;
 
-			Segs[newback].next = outset1;
-			outset1 = newback;
+				Segs[newback].next = outset1;
+				outset1 = newback;
+			}
+			set = next;
 		}
-		set = next;
 	}
 	FixSplitSharers ();
 	if (GLNodes)
 	{
 		AddMinisegs (node, splitseg, outset0, outset1);
 	}
+	outspan0 = MakeSpan (outset0);
+	outspan1 = MakeSpan (outset1);
 	count0 = _count0;
 	count1 = _count1;
 }
@@ -917,6 +1546,25 @@ void FNodeBuilder::SetNodeFromSeg (node_t &node, const FPrivSeg *pseg) const
 	}
 }
 
+void FNodeBuilder::SetNodeFromSeg (node_t &node, const FPackedSet &set, unsigned int seg) const
+{
+	if (set[seg].planenum >= 0)
+	{
+		const FSimpleLine *pline = &Planes[set[seg].planenum];
+		node.x = pline->x;
+		node.y = pline->y;
+		node.dx = pline->dx;
+		node.dy = pline->dy;
+	}
+	else
+	{
+		node.x = set.X1[seg];
+		node.y = set.Y1[seg];
+		node.dx = set.X2[seg] - node.x;
+		node.dy = set.Y2[seg] - node.y;
+	}
+}
+
 uint32_t FNodeBuilder::SplitSeg (uint32_t segnum, int splitvert, int v1InFront)
 {
 	double dx, dy;
@@ -1020,12 +1668,12 @@ void FNodeBuilder::RemoveSegFromVert2 (uint32_t segnum, int vertnum)
 	}
 }
 
-double FNodeBuilder::InterceptVector (const node_t &splitter, const FPrivSeg &seg)
+double FNodeBuilder::InterceptVector (const node_t &splitter, const FSimpleVert &v1, const FSimpleVert &v2)
 {
-	double v2x = (double)Vertices[seg.v1].x;
-	double v2y = (double)Vertices[seg.v1].y;
-	double v2dx = (double)Vertices[seg.v2].x - v2x;
-	double v2dy = (double)Vertices[seg.v2].y - v2y;
+	double v2x = (double)v1.x;
+	double v2y = (double)v1.y;
+	double v2dx = (double)v2.x - v2x;
+	double v2dy = (double)v2.y - v2y;
 	double v1dx = (double)splitter.dx;
 	double v1dy = (double)splitter.dy;
 
@@ -1041,18 +1689,21 @@ double FNodeBuilder::InterceptVector (const node_t &splitter, const FPrivSeg &se
 	return num / den;
 }
 
-void FNodeBuilder::PrintSet (int l, uint32_t set)
+void FNodeBuilder::PrintSet (int l, const FSegSpan &span)
 {
 	Printf ("set %d:\n", l);
-	for (; set != DWORD_MAX; set = Segs[set].next)
-	{
-		Printf ("\t%5lu(%d)%c%d(%d,%d)-%d(%d,%d)\n", (unsigned long)set,
-			Segs[set].frontsector,
-			Segs[set].linedef == -1 ? '+' : ':',
-			Segs[set].v1,
-			Vertices[Segs[set].v1].x>>16, Vertices[Segs[set].v1].y>>16,
-			Segs[set].v2,
-			Vertices[Segs[set].v2].x>>16, Vertices[Segs[set].v2].y>>16);
+	for (unsigned int i = span.Begin; i < span.End; ++i)
+	{
+		for (uint32_t set = SetSegs[i]; set != DWORD_MAX; set = Segs[set].next)
+		{
+			Printf ("\t%5lu(%d)%c%d(%d,%d)-%d(%d,%d)\n", (unsigned long)set,
+				Segs[set].frontsector,
+				Segs[set].linedef == -1 ? '+' : ':',
+				Segs[set].v1,
+				Vertices[Segs[set].v1].x>>16, Vertices[Segs[set].v1].y>>16,
+				Segs[set].v2,
+				Vertices[Segs[set].v2].x>>16, Vertices[Segs[set].v2].y>>16);
+		}
 	}
 	Printf ("*\n");
 }
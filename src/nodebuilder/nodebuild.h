@@ -2,9 +2,13 @@
 #pragma once
 
 #include <math.h>
+#include <atomic>
+#include <memory>
 #include "level/doomdata.h"
 #include "level/workdata.h"
 #include "framework/tarray.h"
+#include "framework/threadpool.h"
+#include "nodebuilder/nodecache.h"
 
 struct FEventInfo
 {
@@ -14,38 +18,34 @@ struct FEventInfo
 
 struct FEvent
 {
-	FEvent *Parent, *Left, *Right;
 	double Distance;
 	FEventInfo Info;
 };
 
-class FEventTree
+class FEventList
 {
 public:
-	FEventTree ();
-	~FEventTree ();
+	FEventList ();
 
+	void Insert (double distance, int vertex);
+	void Clear ();
+
+	// The lookups sort the list first, so do not insert while walking it.
 	FEvent *GetMinimum ();
-	FEvent *GetSuccessor (FEvent *event) const { FEvent *node = Successor(event); return node == &Nil ? nullptr : node; }
-	FEvent *GetPredecessor (FEvent *event) const { FEvent *node = Predecessor(event); return node == &Nil ? nullptr : node; }
+	FEvent *GetSuccessor (FEvent *event) const;
+	FEvent *GetPredecessor (FEvent *event) const;
+	FEvent *FindEvent (double distance);
 
-	FEvent *GetNewNode ();
-	void Insert (FEvent *event);
-	FEvent *FindEvent (double distance) const;
-	void DeleteAll ();
+	unsigned int GetAllocations () const { return Allocations; }
 
-	void PrintTree () const { PrintTree (Root); }
+	void PrintList () const;
 
 private:
-	FEvent Nil;
-	FEvent *Root;
-	FEvent *Spare;
-
-	void DeletionTraverser (FEvent *event);
-	FEvent *Successor (FEvent *event) const;
-	FEvent *Predecessor (FEvent *event) const;
+	TArray<FEvent> Events;
+	bool Sorted;
+	unsigned int Allocations;
 
-	void PrintTree (const FEvent *event) const;
+	void Sort ();
 };
 
 struct FSimpleVert
@@ -53,12 +53,23 @@ struct FSimpleVert
 	fixed_t x, y;
 };
 
+// ClassifyLines packs the side a seg is on and the sides its vertices are on
+// into one byte, so they can be kept cheaply for a set's children.
+inline uint8_t EncodeSides (int side, int sidev1, int sidev2)
+{
+	return uint8_t((side + 1) | ((sidev1 + 1) << 2) | ((sidev2 + 1) << 4));
+}
+
 extern "C"
 {
 	int ClassifyLine2 (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2]);
+	int ClassifyLineExact (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2]);
+	int PointOnSideExact (int x, int y, int x1, int y1, int dx, int dy);
 #ifndef DISABLE_SSE
 	int ClassifyLineSSE1 (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2]);
 	int ClassifyLineSSE2 (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2]);
+	void ClassifyLinesAVX2 (node_t &node, const fixed_t *x1, const fixed_t *y1, const fixed_t *x2, const fixed_t *y2,
+		unsigned int count, uint8_t *sides);
 #ifdef BACKPATCH
 #ifdef __GNUC__
 	int ClassifyLineBackpatch (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2]) __attribute__((noinline));
@@ -78,7 +89,7 @@ class FNodeBuilder
 		int linedef;
 		int frontsector;
 		int backsector;
-		uint32_t next;
+		uint32_t next;		// seg split off after this one's set was laid out
 		uint32_t nextforvert;
 		uint32_t nextforvert2;
 		int loopnum;		// loop number for split avoidance (0 means splitting is okay)
@@ -90,6 +101,7 @@ class FNodeBuilder
 		int planenum;
 		bool planefront;
 		FPrivSeg *hashnext;
+		uint32_t packpos;		// position in the last packed set that held this seg
 	};
 	struct FPrivVert : FSimpleVert
 	{
@@ -119,34 +131,136 @@ class FNodeBuilder
 		bool Forward;
 	};
 
-	// Like a blockmap, but for vertices instead of lines
+	// Where Heuristic can find and keep seg sides for the plane it is scoring
+	struct FSideMemoRow
+	{
+		const uint8_t *Known;		// the parent set's row for the plane, indexed through Origin
+		unsigned int KnownCount;	// how many segs of the parent's row are valid
+		uint8_t *Record;			// this set's row for the plane
+		unsigned int *RecordCount;
+	};
+
+	// A set of segs is a span of SetSegs. Segs that join a set after it was laid
+	// out, such as the second half of a split partner, are chained through
+	// FPrivSeg::next from the seg they follow. The set's order is each seg in the
+	// span followed by its chain.
+	struct FSegSpan
+	{
+		unsigned int Begin, End;
+	};
+
+	// A seg set copied out of Segs and Vertices in set order. Splitter selection
+	// only looks at these, so it can run on another thread while the builder
+	// keeps appending to the real arrays. The endpoints are kept in separate
+	// arrays so that ClassifyLines can stream through them.
+	struct FPackedSeg
+	{
+		uint32_t segnum;
+		int v1, v2;
+		int linedef;
+		int frontsector;
+		int backsector;
+		int loopnum;
+		int planenum;
+		bool planefront;
+	};
+
+	// A child set is mostly the same segs as its parent, so the sides found
+	// while scoring the parent's candidate splitters are kept, one row per
+	// plane, for the children to look up instead of classifying them again.
+	struct FPackedSet
+	{
+		FPackedSet () : Parent(nullptr) {}
+
+		TArray<FPackedSeg> Segs;
+		TArray<fixed_t> X1, Y1, X2, Y2;
+		TArray<uint32_t> Origin;		// position of each seg in Parent, or DWORD_MAX if it is new or has changed
+		const FPackedSet *Parent;
+		TArray<int> MemoPlanes;
+		TArray<unsigned int> MemoCounts;
+		TArray<uint8_t> MemoSides;		// Size() bytes for each plane in MemoPlanes
+
+		unsigned int Size () const { return Segs.Size(); }
+		const FPackedSeg &operator[] (unsigned int i) const { return Segs[i]; }
+		FSimpleVert V1 (unsigned int i) const { FSimpleVert v = { X1[i], Y1[i] }; return v; }
+		FSimpleVert V2 (unsigned int i) const { FSimpleVert v = { X2[i], Y2[i] }; return v; }
+		void Clear ()
+		{
+			Segs.Clear(); X1.Clear(); Y1.Clear(); X2.Clear(); Y2.Clear(); Origin.Clear();
+			Parent = nullptr; MemoPlanes.Clear(); MemoCounts.Clear(); MemoSides.Clear();
+		}
+	};
+
+	// Scratch space for one thread selecting splitters
+	struct FSplitterScratch
+	{
+		TArray<int> Touched;	// Loops a splitter touches on a vertex
+		TArray<int> Colinear;	// Loops with edges colinear to a splitter
+		TArray<uint8_t> PlaneChecked;
+		TArray<uint8_t> Sides;	// ClassifyLines results for one block, made by EncodeSides
+		TArray<int> MemoRows;	// Row in the parent's side memo for each plane, or -1; only set during ScoreSplitters
+		TArray<int64_t> Keys;	// Seg midpoints for SelectSplitterFast
+	};
+
+	// What CreateNode should do with a set
+	struct FNodeChoice
+	{
+		node_t Node;
+		uint32_t SplitSeg;
+		uint32_t HackSeg;		// Seg to force to back of splitter
+		uint32_t HackMate;		// Seg to use in front of hack seg
+		bool Split;
+		bool Cached;			// Came from the node cache
+		uint64_t Hash;			// Node cache key, if there is a cache
+	};
+
+	// A set whose choice is being worked out ahead of time by the thread pool
+	struct FPendingChoice
+	{
+		FPendingChoice (ThreadPool *pool) : Pool(pool), Done(false) {}
+		~FPendingChoice () { Wait (); }
+		void Wait () { Pool->WaitUntil ([this]() { return Done.load(); }); }
+
+		ThreadPool *Pool;
+		FPackedSet Set;
+		FNodeChoice Choice;
+		std::atomic<bool> Done;
+	};
+
+	// Like a blockmap, but for vertices instead of lines. Only the cells that
+	// hold something take up space: they are kept in one open-addressed hash
+	// table, with one entry for each vertex in each cell it touches.
 	class FVertexMap
 	{
 	public:
-		FVertexMap (FNodeBuilder &builder, fixed_t minx, fixed_t miny, fixed_t maxx, fixed_t maxy);
-		~FVertexMap ();
+		FVertexMap (FNodeBuilder &builder, int numverts);
 
 		int SelectVertexExact (FPrivVert &vert);
 		int SelectVertexClose (FPrivVert &vert);
 
 	private:
-		FNodeBuilder &MyBuilder;
-		TArray<int> *VertexGrid;
+		struct FCellEntry
+		{
+			int32_t CellX, CellY;
+			int VertNum;			// -1 if this slot is empty
+		};
 
-		fixed_t MinX, MinY, MaxX, MaxY;
-		int BlocksWide, BlocksTall;
+		FNodeBuilder &MyBuilder;
+		TArray<FCellEntry> Table;
+		unsigned int NumEntries;
 
-		enum { BLOCK_SHIFT = 8 + FRACBITS };
-		enum { BLOCK_SIZE = 1 << BLOCK_SHIFT };
+		// Cells are one map unit across. That is much bigger than VERTEX_EPSILON,
+		// so nearly every vertex is in just one cell, and small enough that
+		// even very dense detail only puts a vertex or two in each cell.
+		enum { CELL_SHIFT = FRACBITS };
 
 		int InsertVertex (FPrivVert &vert);
-		inline int GetBlock (fixed_t x, fixed_t y)
+		void AddVertex (int vertnum);
+		void Rehash (unsigned int size);
+		inline unsigned int HashCell (int32_t cellx, int32_t celly) const
 		{
-			assert (x >= MinX);
-			assert (y >= MinY);
-			assert (x <= MaxX);
-			assert (y <= MaxY);
-			return (unsigned(x - MinX) >> BLOCK_SHIFT) + (unsigned(y - MinY) >> BLOCK_SHIFT) * BlocksWide;
+			uint64_t key = (uint64_t(uint32_t(cellx)) << 32) | uint32_t(celly);
+			return unsigned((key * 0x9E3779B97F4A7C15ull) >> 32) & (Table.Size() - 1);
 		}
 	};
 
@@ -162,7 +276,8 @@ public:
 
 	FNodeBuilder (FLevel &level,
 		TArray<FPolyStart> &polyspots, TArray<FPolyStart> &anchors,
-		const char *name, bool makeGLnodes);
+		const char *name, bool makeGLnodes, FNodeCache *cache = nullptr,
+		int threads = 0);	// 0 uses the --threads value
 	~FNodeBuilder ();
 
 	void GetVertices (WideVertex *&verts, int &count);
@@ -174,6 +289,30 @@ public:
 		MapSegGLEx *&segs, int &segCount,
 		MapSubsectorEx *&ssecs, int &subCount);
 
+	// Number of times the splitter intersection list had to grow
+	unsigned int GetEventAllocations () const { return Events.GetAllocations(); }
+
+	// Number of seg sets, and how many of them had their choice in the node cache
+	unsigned int GetNumSets () const { return NumSets; }
+	unsigned int GetCacheHits () const { return CacheHits; }
+
+	// Seconds spent in each step of the build
+	struct FPhaseTimes
+	{
+		double FindUsedVertices;
+		double MakeSegsFromSides;
+		double FindPolyContainers;
+		double GroupSegPlanes;
+		double BuildTree;
+	};
+	const FPhaseTimes &GetPhaseTimes () const { return PhaseTimes; }
+
+	// Segs made from the map's sides, how many times a seg was split, and the
+	// most nodes between the root and a subsector
+	unsigned int GetNumInitialSegs () const { return InitialSegs; }
+	unsigned int GetNumSplits () const { return NumSplits; }
+	unsigned int GetMaxDepth () const { return MaxDepth; }
+
 	//  < 0 : in front of line
 	// == 0 : on line
 	//  > 0 : behind line
@@ -185,17 +324,32 @@ private:
 
 	TArray<node_t> Nodes;
 	TArray<subsector_t> Subsectors;
-	TArray<uint32_t> SubsectorSets;
+	TArray<FSegSpan> SubsectorSets;
+	TArray<uint32_t> SubsectorSegs;	// Spans of SubsectorSets point into this
+	TArray<uint32_t> SetSegs;		// Spans of the sets being built; used like a stack
 	TArray<FPrivSeg> Segs;
 	TArray<FPrivVert> Vertices;
 	TArray<USegPtr> SegList;
-	TArray<uint8_t> PlaneChecked;
 	TArray<FSimpleLine> Planes;
 	size_t InitialVertices;	// Number of vertices in a map that are connected to linedefs
 
-	TArray<int> Touched;	// Loops a splitter touches on a vertex
-	TArray<int> Colinear;	// Loops with edges colinear to a splitter
-	FEventTree Events;		// Vertices intersected by the current splitter
+	// Sets with at least this many segs have their splitter chosen on the thread pool
+	// while the builder works on their sibling.
+	enum
+	{
+		MIN_PARALLEL_SEGS = 256,		// Smallest set whose splitter is chosen ahead on the pool
+		MIN_PARALLEL_SCORE_SEGS = 1024,	// Smallest set whose candidate splitters are scored on the pool
+		CLASSIFY_BLOCK = 256,			// Segs classified per ClassifyLines call
+		SIDE_MEMO_BYTES = 1 << 22,		// Most seg sides kept for one set's children
+		FAST_SPLITTERS = 8				// Planes tried along each axis by SelectSplitterFast
+	};
+
+	int Threads;			// Including the builder's own thread
+	std::unique_ptr<ThreadPool> Pool;
+	mutable TArray<FSplitterScratch> Scratch;	// [0] for the builder thread, [n] for pool worker n
+	TDeletingArray<FPackedSet *> PackedSets;	// Packed sets of the nodes being built, by depth
+
+	FEventList Events;		// Vertices intersected by the current splitter
 	TArray<FSplitSharer> SplitSharers;	// Segs collinear with the current splitter
 
 	uint32_t HackSeg;			// Seg to force to back of splitter
@@ -207,6 +361,14 @@ private:
 	int SegsStuffed;
 	const char *MapName;
 
+	FNodeCache *Cache;
+	unsigned int NumSets;
+	unsigned int InitialSegs;
+	unsigned int NumSplits;
+	unsigned int MaxDepth;
+	FPhaseTimes PhaseTimes;
+	unsigned int CacheHits;
+
 	void FindUsedVertices (WideVertex *vertices, int max);
 	void BuildTree ();
 	void MakeSegsFromSides ();
@@ -216,23 +378,33 @@ private:
 	bool GetPolyExtents (int polynum, fixed_t bbox[4]);
 	int MarkLoop (uint32_t firstseg, int loopnum);
 	void AddSegToBBox (fixed_t bbox[4], const FPrivSeg *seg);
-	uint32_t CreateNode (uint32_t set, unsigned int count, fixed_t bbox[4]);
-	uint32_t CreateSubsector (uint32_t set, fixed_t bbox[4]);
+	uint32_t CreateNode (const FSegSpan &set, unsigned int count, fixed_t bbox[4], FPendingChoice *pending, const FPackedSet *parent, unsigned int depth);
+	uint32_t CreateSubsector (const FSegSpan &set, fixed_t bbox[4]);
 	void CreateSubsectorsForReal ();
-	bool CheckSubsector (uint32_t set, node_t &node, uint32_t &splitseg);
-	bool CheckSubsectorOverlappingSegs (uint32_t set, node_t &node, uint32_t &splitseg);
-	bool ShoveSegBehind (uint32_t set, node_t &node, uint32_t seg, uint32_t mate);
-	int SelectSplitter (uint32_t set, node_t &node, uint32_t &splitseg, int step, bool nosplit);
-	void SplitSegs (uint32_t set, node_t &node, uint32_t splitseg, uint32_t &outset0, uint32_t &outset1, unsigned int &count0, unsigned int &count1);
+	FSegSpan MakeSpan (uint32_t list);
+	void PackSet (const FSegSpan &set, FPackedSet &packed, const FPackedSet *parent);
+	bool IsPackCurrent (const FSegSpan &set, const FPackedSet &packed) const;
+	std::unique_ptr<FPendingChoice> ChooseAhead (const FSegSpan &set, unsigned int count, const FPackedSet *parent);
+	uint64_t HashSet (const FPackedSet &set, unsigned int count) const;
+	void RecordChoice (const FPackedSet &set, const FNodeChoice &choice);
+	void ChooseSplitter (FPackedSet &set, unsigned int count, FNodeChoice &choice, FSplitterScratch &scratch) const;
+	bool CheckSubsector (const FPackedSet &set, FNodeChoice &choice, FSplitterScratch &scratch) const;
+	bool CheckSubsectorOverlappingSegs (const FPackedSet &set, FNodeChoice &choice, FSplitterScratch &scratch) const;
+	bool ShoveSegBehind (const FPackedSet &set, FNodeChoice &choice, unsigned int seg, uint32_t mate, FSplitterScratch &scratch) const;
+	int SelectSplitter (FPackedSet &set, FNodeChoice &choice, int step, bool nosplit, FSplitterScratch &scratch) const;
+	bool SelectSplitterFast (FPackedSet &set, FNodeChoice &choice, FSplitterScratch &scratch) const;
+	void ScoreSplitters (FPackedSet &set, const TArray<unsigned int> &candidates, TArray<int> &values, bool nosplit, bool record, FSplitterScratch &scratch) const;
+	void SplitSegs (const FSegSpan &set, node_t &node, uint32_t splitseg, FSegSpan &outset0, FSegSpan &outset1, unsigned int &count0, unsigned int &count1);
 	uint32_t SplitSeg (uint32_t segnum, int splitvert, int v1InFront);
-	int Heuristic (node_t &node, uint32_t set, bool honorNoSplit);
+	int Heuristic (node_t &node, const FPackedSet &set, bool honorNoSplit, uint32_t hackseg, FSplitterScratch &scratch, const FSideMemoRow *memo=nullptr) const;
 
 	// Returns:
 	//	0 = seg is in front
 	//  1 = seg is in back
 	// -1 = seg cuts the node
 
-	inline int ClassifyLine (node_t &node, const FPrivVert *v1, const FPrivVert *v2, int sidev[2]);
+	static inline int ClassifyLine (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2]);
+	static void ClassifyLines (node_t &node, const FPackedSet &set, unsigned int start, unsigned int count, FSplitterScratch &scratch, const FSideMemoRow *memo);
 
 	void FixSplitSharers ();
 	double AddIntersection (const node_t &node, int vertex);
@@ -243,6 +415,7 @@ private:
 	void RemoveSegFromVert2 (uint32_t segnum, int vertnum);
 	uint32_t AddMiniseg (int v1, int v2, uint32_t partner, uint32_t seg1, uint32_t splitseg);
 	void SetNodeFromSeg (node_t &node, const FPrivSeg *pseg) const;
+	void SetNodeFromSeg (node_t &node, const FPackedSet &set, unsigned int seg) const;
 
 	int RemoveMinisegs (MapNodeEx *nodes, TArray<MapSegEx> &segs, MapSubsectorEx *subs, int node, short bbox[4]);
 	int StripMinisegs (TArray<MapSegEx> &segs, int subsector, short bbox[4]);
@@ -254,9 +427,9 @@ private:
 
 	static int SortSegs (const void *a, const void *b);
 
-	double InterceptVector (const node_t &splitter, const FPrivSeg &seg);
+	static double InterceptVector (const node_t &splitter, const FSimpleVert &v1, const FSimpleVert &v2);
 
-	void PrintSet (int l, uint32_t set);
+	void PrintSet (int l, const FSegSpan &set);
 	void DumpNodes(MapNodeEx *outNodes, int nodeCount);
 };
 
@@ -269,6 +442,11 @@ const double SIDE_EPSILON = 6.5536;
 
 inline int FNodeBuilder::PointOnSide (int x, int y, int x1, int y1, int dx, int dy)
 {
+	if (ExactSides)
+	{
+		return PointOnSideExact (x, y, x1, y1, dx, dy);
+	}
+
 	// For most cases, a simple dot product is enough.
 	double d_dx = double(dx);
 	double d_dy = double(dy);
@@ -294,8 +472,13 @@ inline int FNodeBuilder::PointOnSide (int x, int y, int x1, int y1, int dx, int
 	return s_num > 0.0 ? -1 : 1;
 }
 
-inline int FNodeBuilder::ClassifyLine (node_t &node, const FPrivVert *v1, const FPrivVert *v2, int sidev[2])
+inline int FNodeBuilder::ClassifyLine (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2])
 {
+	if (ExactSides)
+	{
+		return ClassifyLineExact (node, v1, v2, sidev);
+	}
+
 #ifdef DISABLE_SSE
 	return ClassifyLine2 (node, v1, v2, sidev);
 #else
@@ -310,7 +493,7 @@ inline int FNodeBuilder::ClassifyLine (node_t &node, const FPrivVert *v1, const
 #ifdef BACKPATCH
 	return ClassifyLineBackpatch (node, v1, v2, sidev);
 #else
-	if (SSELevel == 2)
+	if (SSELevel >= 2)
 		return ClassifyLineSSE2 (node, v1, v2, sidev);
 	else if (SSELevel == 1)
 		return ClassifyLineSSE1 (node, v1, v2, sidev);
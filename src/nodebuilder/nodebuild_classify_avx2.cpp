@@ -0,0 +1,121 @@
+/*
+    Determine what side of a splitter a run of segs lie on. (AVX2 version)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+#ifndef DISABLE_SSE
+
+#include "framework/zdray.h"
+#include "nodebuilder/nodebuild.h"
+#include <immintrin.h>
+
+#define FAR_ENOUGH 17179869184.f		// 4<<32
+
+// Classifies four segs at a time. Every step is done in double precision
+// in the same order as ClassifyLineSSE2, and this file must not be compiled
+// with FMA contraction, so the results are identical to the one-seg version.
+
+// sidev for four s_num values: 0 if the endpoint is within SIDE_EPSILON of the
+// splitter, otherwise -1 in front and 1 behind. Values at least FAR_ENOUGH away
+// skip the distance check, exactly as the scalar code does.
+static inline __m128i SideOf (__m256d num, __m256d l)
+{
+	const __m256d far_pos = _mm256_set1_pd (FAR_ENOUGH);
+	const __m256d far_neg = _mm256_set1_pd (-FAR_ENOUGH);
+	const __m256d epsilon = _mm256_set1_pd (SIDE_EPSILON*SIDE_EPSILON);
+
+	__m256d nearby = _mm256_and_pd (_mm256_cmp_pd (num, far_neg, _CMP_GT_OQ), _mm256_cmp_pd (num, far_pos, _CMP_LT_OQ));
+	__m256d dist = _mm256_mul_pd (_mm256_mul_pd (num, num), l);
+	__m256d onplane = _mm256_and_pd (nearby, _mm256_cmp_pd (dist, epsilon, _CMP_LT_OQ));
+	__m256d front = _mm256_cmp_pd (num, _mm256_setzero_pd (), _CMP_GT_OQ);
+	__m256d side = _mm256_blendv_pd (_mm256_set1_pd (1.0), _mm256_set1_pd (-1.0), front);
+
+	return _mm256_cvtpd_epi32 (_mm256_andnot_pd (onplane, side));
+}
+
+static inline int SideFromSidev (const node_t &node, int sidev0, int sidev1, fixed_t x1, fixed_t y1, fixed_t x2, fixed_t y2)
+{
+	if ((sidev0 | sidev1) == 0)
+	{ // seg is coplanar with the splitter, so use its orientation to determine
+	  // which child it ends up in. If it faces the same direction as the splitter,
+	  // it goes in front. Otherwise, it goes in back.
+
+		if (node.dx != 0)
+		{
+			return ((node.dx > 0 && x2 > x1) || (node.dx < 0 && x2 < x1)) ? 0 : 1;
+		}
+		else
+		{
+			return ((node.dy > 0 && y2 > y1) || (node.dy < 0 && y2 < y1)) ? 0 : 1;
+		}
+	}
+	else if (sidev0 <= 0 && sidev1 <= 0)
+	{
+		return 0;
+	}
+	else if (sidev0 >= 0 && sidev1 >= 0)
+	{
+		return 1;
+	}
+	return -1;
+}
+
+extern "C" void ClassifyLinesAVX2 (node_t &node, const fixed_t *x1, const fixed_t *y1, const fixed_t *x2, const fixed_t *y2,
+	unsigned int count, uint8_t *sides)
+{
+	double d_dx = double(node.dx);
+	double d_dy = double(node.dy);
+	__m256d nx = _mm256_set1_pd (double(node.x));
+	__m256d ny = _mm256_set1_pd (double(node.y));
+	__m256d ndx = _mm256_set1_pd (d_dx);
+	__m256d ndy = _mm256_set1_pd (d_dy);
+	__m256d l = _mm256_set1_pd (1.f / (d_dx*d_dx + d_dy*d_dy));
+	int sidev1[4], sidev2[4];
+	unsigned int i;
+
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		__m256d xv1 = _mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i *)(x1 + i)));
+		__m256d yv1 = _mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i *)(y1 + i)));
+		__m256d xv2 = _mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i *)(x2 + i)));
+		__m256d yv2 = _mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i *)(y2 + i)));
+
+		// s_num = (d_y1 - d_yv) * d_dx - (d_x1 - d_xv) * d_dy
+		__m256d num1 = _mm256_sub_pd (_mm256_mul_pd (_mm256_sub_pd (ny, yv1), ndx), _mm256_mul_pd (_mm256_sub_pd (nx, xv1), ndy));
+		__m256d num2 = _mm256_sub_pd (_mm256_mul_pd (_mm256_sub_pd (ny, yv2), ndx), _mm256_mul_pd (_mm256_sub_pd (nx, xv2), ndy));
+
+		_mm_storeu_si128 ((__m128i *)sidev1, SideOf (num1, l));
+		_mm_storeu_si128 ((__m128i *)sidev2, SideOf (num2, l));
+
+		for (int j = 0; j < 4; ++j)
+		{
+			int side = SideFromSidev (node, sidev1[j], sidev2[j], x1[i+j], y1[i+j], x2[i+j], y2[i+j]);
+			sides[i+j] = EncodeSides (side, sidev1[j], sidev2[j]);
+		}
+	}
+
+	for (; i < count; ++i)
+	{
+		FSimpleVert v1 = { x1[i], y1[i] }, v2 = { x2[i], y2[i] };
+		int sidev[2];
+
+		int side = ClassifyLineSSE2 (node, &v1, &v2, sidev);
+		sides[i] = EncodeSides (side, sidev[0], sidev[1]);
+	}
+}
+
+#endif
@@ -0,0 +1,142 @@
+/*
+    Determine what side of a splitter a seg lies on, using only integer math.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+#include "framework/zdray.h"
+#include "nodebuilder/nodebuild.h"
+
+// The floating point routines compute the cross product in doubles, which
+// rounds once it needs more than 53 bits, so a vertex that lies right on
+// the SIDE_EPSILON boundary of a long splitter can land on either side of
+// it. These routines do the same test exactly, so the result only depends
+// on the map, not on the rounding of whichever routine was picked.
+//
+// SIDE_EPSILON is 65536/10000, so a point is on the line when
+//     s_num^2 / (dx^2 + dy^2) < 65536^2 / 10000^2
+// or, without the division,
+//     (s_num * 10000)^2 < (dx^2 + dy^2) << 32
+
+// Fills hi:lo with the 128-bit product of a and b.
+
+static inline void Mul64 (uint64_t a, uint64_t b, uint64_t &hi, uint64_t &lo)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128)a * b;
+	hi = uint64_t(p >> 64);
+	lo = uint64_t(p);
+#else
+	uint64_t a0 = uint32_t(a), a1 = a >> 32;
+	uint64_t b0 = uint32_t(b), b1 = b >> 32;
+	uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+	uint64_t mid = (p00 >> 32) + uint32_t(p01) + uint32_t(p10);
+
+	lo = (mid << 32) | uint32_t(p00);
+	hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+}
+
+// Returns the same thing as FNodeBuilder::PointOnSide: -1 for in front of
+// the line, 1 for behind it, and 0 for on it.
+
+static inline int ExactSide (int64_t x, int64_t y, int64_t x1, int64_t y1, int64_t dx, int64_t dy)
+{
+	// s_num = (y1-y)*dx - (x1-x)*dy needs up to 66 bits, so split the
+	// vertex deltas at bit 16 and keep the two halves apart: each partial
+	// product then fits in 48 bits, and s_num = hi * 65536 + lo.
+	int64_t a = y1 - y, b = x1 - x;
+	int64_t hi = (a >> 16) * dx - (b >> 16) * dy;
+	int64_t lo = (a & 0xFFFF) * dx - (b & 0xFFFF) * dy;
+
+	// Normalize so that 0 <= lo < 65536. Then the sign of s_num is the sign
+	// of hi, unless hi is 0.
+	hi += lo >> 16;
+	lo &= 0xFFFF;
+
+	// dx and dy are fixed_ts, so the splitter is at most 2^31.5 long and no
+	// point more than SIDE_EPSILON * 2^31.5 < 2^35 away from it can be near it.
+	if (hi >= (1 << 22) || hi < -(1 << 22))
+	{
+		return hi > 0 ? -1 : 1;
+	}
+
+	int64_t s_num = hi * 65536 + lo;
+	if (s_num == 0)
+	{
+		return 0;
+	}
+
+	uint64_t near_hi, near_lo;
+	uint64_t len = uint64_t(dx * dx) + uint64_t(dy * dy);
+	uint64_t dist = uint64_t(s_num < 0 ? -s_num : s_num) * 10000;
+
+	Mul64 (dist, dist, near_hi, near_lo);
+	if (near_hi < (len >> 32) || (near_hi == (len >> 32) && near_lo < (len << 32)))
+	{
+		return 0;
+	}
+	return s_num > 0 ? -1 : 1;
+}
+
+extern "C" int PointOnSideExact (int x, int y, int x1, int y1, int dx, int dy)
+{
+	return ExactSide (x, y, x1, y1, dx, dy);
+}
+
+extern "C" int ClassifyLineExact (node_t &node, const FSimpleVert *v1, const FSimpleVert *v2, int sidev[2])
+{
+	sidev[0] = ExactSide (v1->x, v1->y, node.x, node.y, node.dx, node.dy);
+	sidev[1] = ExactSide (v2->x, v2->y, node.x, node.y, node.dx, node.dy);
+
+	if ((sidev[0] | sidev[1]) == 0)
+	{ // seg is coplanar with the splitter, so use its orientation to determine
+	  // which child it ends up in. If it faces the same direction as the splitter,
+	  // it goes in front. Otherwise, it goes in back.
+
+		if (node.dx != 0)
+		{
+			if ((node.dx > 0 && v2->x > v1->x) || (node.dx < 0 && v2->x < v1->x))
+			{
+				return 0;
+			}
+			else
+			{
+				return 1;
+			}
+		}
+		else
+		{
+			if ((node.dy > 0 && v2->y > v1->y) || (node.dy < 0 && v2->y < v1->y))
+			{
+				return 0;
+			}
+			else
+			{
+				return 1;
+			}
+		}
+	}
+	else if (sidev[0] <= 0 && sidev[1] <= 0)
+	{
+		return 0;
+	}
+	else if (sidev[0] >= 0 && sidev[1] >= 0)
+	{
+		return 1;
+	}
+	return -1;
+}
@@ -1,5 +1,5 @@
 /*
-    A red-black tree implementation for building minisegs.
+    A sorted list of splitter intersections for building minisegs.
     Copyright (C) 2002-2006 Randy Heit
 
     This program is free software; you can redistribute it and/or modify
@@ -19,189 +19,117 @@
 */
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
 #include "framework/zdray.h"
 #include "nodebuilder/nodebuild.h"
 
-FEventTree::FEventTree ()
-: Root (&Nil), Spare (nullptr)
+FEventList::FEventList ()
+: Sorted (true), Allocations (0)
 {
-	memset (&Nil, 0, sizeof(Nil));
 }
 
-FEventTree::~FEventTree ()
+void FEventList::Clear ()
 {
-	FEvent *probe;
-
-	DeleteAll ();
-	probe = Spare;
-	while (probe != nullptr)
-	{
-		FEvent *next = probe->Left;
-		delete probe;
-		probe = next;
-	}
+	Events.Clear ();
+	Sorted = true;
 }
 
-void FEventTree::DeleteAll ()
-{
-	DeletionTraverser (Root);
-	Root = &Nil;
-}
+// Events are only appended while a splitter is being applied. Keeping them
+// in one array that is reused for every splitter means that memory only has
+// to be allocated when a splitter hits more vertices than any before it.
 
-void FEventTree::DeletionTraverser (FEvent *node)
+void FEventList::Insert (double distance, int vertex)
 {
-	if (node != &Nil && node != nullptr)
+	if (Events.Size() == Events.Max())
 	{
-		DeletionTraverser (node->Left);
-		DeletionTraverser (node->Right);
-		node->Left = Spare;
-		Spare = node;
+		Allocations++;
 	}
-}
-
-FEvent *FEventTree::GetNewNode ()
-{
-	FEvent *node;
 
-	if (Spare != nullptr)
-	{
-		node = Spare;
-		Spare = node->Left;
-	}
-	else
-	{
-		node = new FEvent;
-	}
-	return node;
+	FEvent *event = &Events[Events.Reserve (1)];
+	event->Distance = distance;
+	event->Info.Vertex = vertex;
+	event->Info.FrontSeg = DWORD_MAX;
+	Sorted = false;
 }
 
-void FEventTree::Insert (FEvent *z)
-{
-	FEvent *y = &Nil;
-	FEvent *x = Root;
+// Sorts the events by distance along the splitter. When several events share
+// a distance, the first one that was inserted is kept, like FindEvent would
+// have found it when inserting the others.
 
-	while (x != &Nil)
-	{
-		y = x;
-		if (z->Distance < x->Distance)
-		{
-			x = x->Left;
-		}
-		else
-		{
-			x = x->Right;
-		}
-	}
-	z->Parent = y;
-	if (y == &Nil)
-	{
-		Root = z;
-	}
-	else if (z->Distance < y->Distance)
-	{
-		y->Left = z;
-	}
-	else
-	{
-		y->Right = z;
-	}
-	z->Left = &Nil;
-	z->Right = &Nil;
-}
-
-FEvent *FEventTree::Successor (FEvent *event) const
+void FEventList::Sort ()
 {
-	if (event->Right != &Nil)
+	if (Sorted)
 	{
-		event = event->Right;
-		while (event->Left != &Nil)
-		{
-			event = event->Left;
-		}
-		return event;
+		return;
 	}
-	else
-	{
-		FEvent *y = event->Parent;
-		while (y != &Nil && event == y->Right)
-		{
-			event = y;
-			y = y->Parent;
-		}
-		return y;
-	}
-}
 
-FEvent *FEventTree::Predecessor (FEvent *event) const
-{
-	if (event->Left != &Nil)
+	std::stable_sort (&Events[0], &Events[0] + Events.Size(), [](const FEvent &a, const FEvent &b)
 	{
-		event = event->Left;
-		while (event->Right != &Nil)
-		{
-			event = event->Right;
-		}
-		return event;
-	}
-	else
+		return a.Distance < b.Distance;
+	});
+
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < Events.Size(); ++i)
 	{
-		FEvent *y = event->Parent;
-		while (y != &Nil && event == y->Left)
+		if (count == 0 || Events[i].Distance != Events[count-1].Distance)
 		{
-			event = y;
-			y = y->Parent;
+			Events[count++] = Events[i];
 		}
-		return y;
 	}
+	Events.Clamp (count);
+	Sorted = true;
 }
 
-FEvent *FEventTree::FindEvent (double key) const
+FEvent *FEventList::FindEvent (double key)
 {
-	FEvent *node = Root;
+	Sort ();
 
-	while (node != &Nil)
+	unsigned int lo = 0, hi = Events.Size();
+
+	while (lo < hi)
 	{
-		if (node->Distance == key)
-		{
-			return node;
-		}
-		else if (node->Distance > key)
+		unsigned int mid = (lo + hi) / 2;
+
+		if (Events[mid].Distance < key)
 		{
-			node = node->Left;
+			lo = mid + 1;
 		}
 		else
 		{
-			node = node->Right;
+			hi = mid;
 		}
 	}
+	if (lo < Events.Size() && Events[lo].Distance == key)
+	{
+		return &Events[lo];
+	}
 	return nullptr;
 }
 
-FEvent *FEventTree::GetMinimum ()
+FEvent *FEventList::GetMinimum ()
 {
-	FEvent *node = Root;
+	Sort ();
+	return Events.Size() > 0 ? &Events[0] : nullptr;
+}
 
-	if (node == &Nil)
-	{
-		return nullptr;
-	}
-	while (node->Left != &Nil)
-	{
-		node = node->Left;
-	}
-	return node;
+FEvent *FEventList::GetSuccessor (FEvent *event) const
+{
+	assert (Sorted);
+	return event + 1 < &Events[0] + Events.Size() ? event + 1 : nullptr;
 }
 
-void FEventTree::PrintTree (const FEvent *event) const
+FEvent *FEventList::GetPredecessor (FEvent *event) const
 {
-	if (event->Left != &Nil)
-	{
-		PrintTree (event->Left);
-	}
-	printf (" Distance %g, vertex %d, seg %u\n",
-		sqrt(event->Distance/4294967296.0), event->Info.Vertex, (unsigned)event->Info.FrontSeg);
-	if (event->Right != &Nil)
+	assert (Sorted);
+	return event > &Events[0] ? event - 1 : nullptr;
+}
+
+void FEventList::PrintList () const
+{
+	for (unsigned int i = 0; i < Events.Size(); ++i)
 	{
-		PrintTree (event->Right);
+		const FEvent *event = &Events[i];
+		printf (" Distance %g, vertex %d, seg %u\n",
+			sqrt(event->Distance/4294967296.0), event->Info.Vertex, (unsigned)event->Info.FrontSeg);
 	}
 }
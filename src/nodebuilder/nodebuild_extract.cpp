@@ -24,6 +24,7 @@
 #include "framework/zdray.h"
 #include "nodebuilder/nodebuild.h"
 #include "framework/templates.h"
+#include "framework/profiler.h"
 
 #if 0
 #define D(x) x
@@ -37,6 +38,7 @@ void FNodeBuilder::GetGLNodes (MapNodeEx *&outNodes, int &nodeCount,
 	MapSegGLEx *&outSegs, int &segCount,
 	MapSubsectorEx *&outSubs, int &subCount)
 {
+	PROFILE_ZONE ("GetGLNodes");
 	TArray<MapSegGLEx> segs (Segs.Size()*5/4);
 	int i, j, k;
 
@@ -378,6 +380,7 @@ void FNodeBuilder::PushConnectingGLSeg (int subsector, TArray<MapSegGLEx> &segs,
 
 void FNodeBuilder::GetVertices (WideVertex *&verts, int &count)
 {
+	PROFILE_ZONE ("GetVertices");
 	count = Vertices.Size ();
 	verts = new WideVertex[count];
 
@@ -393,6 +396,7 @@ void FNodeBuilder::GetNodes (MapNodeEx *&outNodes, int &nodeCount,
 	MapSegEx *&outSegs, int &segCount,
 	MapSubsectorEx *&outSubs, int &subCount)
 {
+	PROFILE_ZONE ("GetNodes");
 	short bbox[4];
 	TArray<MapSegEx> segs (Segs.Size());
 
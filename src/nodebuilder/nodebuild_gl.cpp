@@ -32,27 +32,12 @@
 
 double FNodeBuilder::AddIntersection (const node_t &node, int vertex)
 {
-	static const FEventInfo defaultInfo =
-	{
-		-1, DWORD_MAX
-	};
-
 	// Calculate signed distance of intersection vertex from start of splitter.
 	// Only ordering is important, so we don't need a sqrt.
 	FPrivVert *v = &Vertices[vertex];
 	double dist = (double(v->x) - node.x)*(node.dx) + (double(v->y) - node.y)*(node.dy);
 
-	FEvent *event = Events.FindEvent (dist);
-
-	if (event == nullptr)
-	{
-		event = Events.GetNewNode ();
-		event->Distance = dist;
-		event->Info = defaultInfo;
-		event->Info.Vertex = vertex;
-		Events.Insert (event);
-	}
-
+	Events.Insert (dist, vertex);
 	return dist;
 }
 
@@ -64,7 +49,7 @@ double FNodeBuilder::AddIntersection (const node_t &node, int vertex)
 void FNodeBuilder::FixSplitSharers ()
 {
 	D(printf("events:\n"));
-	D(Events.PrintTree());
+	D(Events.PrintList());
 	for (unsigned int i = 0; i < SplitSharers.Size(); ++i)
 	{
 		uint32_t seg = SplitSharers[i].Seg;
@@ -235,6 +220,7 @@ uint32_t FNodeBuilder::AddMiniseg (int v1, int v2, uint32_t partner, uint32_t se
 	newseg.linedef = NO_INDEX;
 	newseg.loopnum = 0;
 	newseg.next = DWORD_MAX;
+	newseg.packpos = DWORD_MAX;
 	newseg.planefront = true;
 	newseg.hashnext = nullptr;
 	newseg.storedseg = DWORD_MAX;
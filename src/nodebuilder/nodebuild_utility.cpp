@@ -112,6 +112,7 @@ int FNodeBuilder::CreateSeg (int linenum, int sidenum)
 	int segnum;
 
 	seg.next = DWORD_MAX;
+	seg.packpos = DWORD_MAX;
 	seg.loopnum = 0;
 	seg.offset = 0;
 	seg.partner = DWORD_MAX;
@@ -161,13 +162,9 @@ void FNodeBuilder::GroupSegPlanes ()
 
 	for (i = 0; i < (int)Segs.Size(); ++i)
 	{
-		FPrivSeg *seg = &Segs[i];
-		seg->next = i+1;
-		seg->hashnext = nullptr;
+		Segs[i].hashnext = nullptr;
 	}
 
-	Segs[Segs.Size()-1].next = DWORD_MAX;
-
 	for (i = planenum = 0; i < (int)Segs.Size(); ++i)
 	{
 		FPrivSeg *seg = &Segs[i];
@@ -238,8 +235,6 @@ void FNodeBuilder::GroupSegPlanes ()
 	}
 
 	D(printf ("%d planes from %d segs\n", planenum, Segs.Size()));
-
-	PlaneChecked.Reserve ((planenum + 7) / 8);
 }
 
 // Find "loops" of segs surrounding polyobject's origin. Note that a polyobject's origin
@@ -455,35 +450,34 @@ void FNodeBuilder::AddSegToBBox (fixed_t bbox[4], const FPrivSeg *seg)
 	if (v2->y > bbox[BOXTOP])		bbox[BOXTOP] = v2->y;
 }
 
-FNodeBuilder::FVertexMap::FVertexMap (FNodeBuilder &builder,
-	fixed_t minx, fixed_t miny, fixed_t maxx, fixed_t maxy)
+FNodeBuilder::FVertexMap::FVertexMap (FNodeBuilder &builder, int numverts)
 	: MyBuilder(builder)
 {
-	MinX = minx;
-	MinY = miny;
-	BlocksWide = int(((double(maxx) - minx + 1) + (BLOCK_SIZE - 1)) / BLOCK_SIZE);
-	BlocksTall = int(((double(maxy) - miny + 1) + (BLOCK_SIZE - 1)) / BLOCK_SIZE);
-	MaxX = MinX + BlocksWide * BLOCK_SIZE - 1;
-	MaxY = MinY + BlocksTall * BLOCK_SIZE - 1;
-	VertexGrid = new TArray<int>[BlocksWide * BlocksTall];
-}
-
-FNodeBuilder::FVertexMap::~FVertexMap ()
-{
-	delete[] VertexGrid;
+	// Splitting segs usually adds about as many vertices again as the map
+	// started with, so start with room for that and grow if needed.
+	unsigned int size = 1024;
+	while (size < unsigned(numverts) * 4)
+	{
+		size <<= 1;
+	}
+	Rehash (size);
 }
 
 int FNodeBuilder::FVertexMap::SelectVertexExact (FNodeBuilder::FPrivVert &vert)
 {
-	TArray<int> &block = VertexGrid[GetBlock (vert.x, vert.y)];
+	int32_t cellx = vert.x >> CELL_SHIFT;
+	int32_t celly = vert.y >> CELL_SHIFT;
 	FPrivVert *vertices = &MyBuilder.Vertices[0];
+	unsigned int mask = Table.Size() - 1;
 	unsigned int i;
 
-	for (i = 0; i < block.Size(); ++i)
+	for (i = HashCell (cellx, celly); Table[i].VertNum >= 0; i = (i + 1) & mask)
 	{
-		if (vertices[block[i]].x == vert.x && vertices[block[i]].y == vert.y)
+		const FCellEntry &entry = Table[i];
+		if (entry.CellX == cellx && entry.CellY == celly &&
+			vertices[entry.VertNum].x == vert.x && vertices[entry.VertNum].y == vert.y)
 		{
-			return block[i];
+			return entry.VertNum;
 		}
 	}
 
@@ -491,22 +485,33 @@ int FNodeBuilder::FVertexMap::SelectVertexExact (FNodeBuilder::FPrivVert &vert)
 	return InsertVertex (vert);
 }
 
+// Entries for the same cell are found in the order they were added, so if
+// more than one vertex is close enough, this picks the oldest, just like
+// when each cell had its own list.
+
 int FNodeBuilder::FVertexMap::SelectVertexClose (FNodeBuilder::FPrivVert &vert)
 {
-	TArray<int> &block = VertexGrid[GetBlock (vert.x, vert.y)];
+	int32_t cellx = vert.x >> CELL_SHIFT;
+	int32_t celly = vert.y >> CELL_SHIFT;
 	FPrivVert *vertices = &MyBuilder.Vertices[0];
+	unsigned int mask = Table.Size() - 1;
 	unsigned int i;
 
-	for (i = 0; i < block.Size(); ++i)
+	for (i = HashCell (cellx, celly); Table[i].VertNum >= 0; i = (i + 1) & mask)
 	{
+		const FCellEntry &entry = Table[i];
+		if (entry.CellX != cellx || entry.CellY != celly)
+		{
+			continue;
+		}
 #if VERTEX_EPSILON <= 1
-		if (vertices[block[i]].x == vert.x && vertices[block[i]].y == vert.y)
+		if (vertices[entry.VertNum].x == vert.x && vertices[entry.VertNum].y == vert.y)
 #else
-		if (abs(vertices[block[i]].x - vert.x) < VERTEX_EPSILON &&
-			abs(vertices[block[i]].y - vert.y) < VERTEX_EPSILON)
+		if (abs(vertices[entry.VertNum].x - vert.x) < VERTEX_EPSILON &&
+			abs(vertices[entry.VertNum].y - vert.y) < VERTEX_EPSILON)
 #endif
 		{
-			return block[i];
+			return entry.VertNum;
 		}
 	}
 
@@ -518,39 +523,68 @@ int FNodeBuilder::FVertexMap::InsertVertex (FNodeBuilder::FPrivVert &vert)
 {
 	int vertnum;
 
+	// Keep the table at most half full. A vertex adds up to four entries.
+	if ((NumEntries + 4) * 2 > Table.Size())
+	{
+		Rehash (Table.Size() * 2);
+	}
+
 	vert.segs = DWORD_MAX;
 	vert.segs2 = DWORD_MAX;
 	vertnum = (int)MyBuilder.Vertices.Push (vert);
+	AddVertex (vertnum);
 
-	// If a vertex is near a block boundary, then it will be inserted on
-	// both sides of the boundary so that SelectVertexClose can find
-	// it by checking in only one block.
-	fixed_t minx = MAX (MinX, vert.x - VERTEX_EPSILON);
-	fixed_t maxx = MIN (MaxX, vert.x + VERTEX_EPSILON);
-	fixed_t miny = MAX (MinY, vert.y - VERTEX_EPSILON);
-	fixed_t maxy = MIN (MaxY, vert.y + VERTEX_EPSILON);
+	return vertnum;
+}
 
-	int blk[4] =
-	{
-		GetBlock (minx, miny),
-		GetBlock (maxx, miny),
-		GetBlock (minx, maxy),
-		GetBlock (maxx, maxy)
-	};
-	unsigned int blkcount[4] =
-	{
-		VertexGrid[blk[0]].Size(),
-		VertexGrid[blk[1]].Size(),
-		VertexGrid[blk[2]].Size(),
-		VertexGrid[blk[3]].Size()
-	};
-	for (int i = 0; i < 4; ++i)
+// If a vertex is near a cell boundary, then it will be added on both sides
+// of the boundary so that SelectVertexClose can find it by checking in only
+// one cell.
+
+void FNodeBuilder::FVertexMap::AddVertex (int vertnum)
+{
+	const FPrivVert &vert = MyBuilder.Vertices[vertnum];
+	int32_t minx = int32_t((int64_t(vert.x) - VERTEX_EPSILON) >> CELL_SHIFT);
+	int32_t maxx = int32_t((int64_t(vert.x) + VERTEX_EPSILON) >> CELL_SHIFT);
+	int32_t miny = int32_t((int64_t(vert.y) - VERTEX_EPSILON) >> CELL_SHIFT);
+	int32_t maxy = int32_t((int64_t(vert.y) + VERTEX_EPSILON) >> CELL_SHIFT);
+	unsigned int mask = Table.Size() - 1;
+
+	for (int32_t celly = miny; celly <= maxy; ++celly)
 	{
-		if (VertexGrid[blk[i]].Size() == blkcount[i])
+		for (int32_t cellx = minx; cellx <= maxx; ++cellx)
 		{
-			VertexGrid[blk[i]].Push (vertnum);
+			unsigned int i = HashCell (cellx, celly);
+
+			while (Table[i].VertNum >= 0)
+			{
+				i = (i + 1) & mask;
+			}
+			Table[i].CellX = cellx;
+			Table[i].CellY = celly;
+			Table[i].VertNum = vertnum;
+			NumEntries++;
 		}
 	}
+}
 
-	return vertnum;
+// Adding the vertices back in the order they were created keeps the entries
+// for each cell in that order too.
+
+void FNodeBuilder::FVertexMap::Rehash (unsigned int size)
+{
+	FCellEntry empty = { 0, 0, -1 };
+
+	Table.Clear ();
+	Table.Resize (size);
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		Table[i] = empty;
+	}
+	NumEntries = 0;
+
+	for (unsigned int i = 0; i < MyBuilder.Vertices.Size(); ++i)
+	{
+		AddVertex (i);
+	}
 }
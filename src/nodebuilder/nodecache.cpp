@@ -0,0 +1,121 @@
+
+#include <string.h>
+#include <stdio.h>
+#include <stdexcept>
+#include <vector>
+#include "framework/zdray.h"
+#include "framework/file.h"
+#include "nodebuilder/nodecache.h"
+
+static const char CacheMagic[4] = { 'Z', 'N', 'C', '1' };
+
+struct FCacheRecord
+{
+	uint64_t Hash;
+	FNodeCacheEntry Choice;
+};
+
+void FNodeCache::Load (const char *filename)
+{
+	std::vector<uint8_t> data;
+
+	Entries.clear ();
+	Fresh.clear ();
+
+	try
+	{
+		data = File::read_all_bytes (filename);
+	}
+	catch (const std::runtime_error &)
+	{
+		// No cache yet. It will be created when the build is done.
+		return;
+	}
+
+	uint32_t count;
+	if (data.size() < sizeof(CacheMagic) + sizeof(count) || memcmp (data.data(), CacheMagic, sizeof(CacheMagic)) != 0)
+	{
+		printf ("   %s is not a node cache. It will be overwritten.\n", filename);
+		return;
+	}
+	memcpy (&count, data.data() + sizeof(CacheMagic), sizeof(count));
+	if (data.size() != sizeof(CacheMagic) + sizeof(count) + (size_t)count * sizeof(FCacheRecord))
+	{
+		printf ("   Node cache %s is damaged. It will be overwritten.\n", filename);
+		return;
+	}
+
+	const uint8_t *p = data.data() + sizeof(CacheMagic) + sizeof(count);
+	Entries.reserve (count);
+	for (uint32_t i = 0; i < count; ++i, p += sizeof(FCacheRecord))
+	{
+		FCacheRecord record;
+		memcpy (&record, p, sizeof(record));
+		Entries[record.Hash] = { record.Choice, false };
+	}
+}
+
+// With prune set, only the entries that were used by this run are kept, so
+// the cache does not keep growing as a map is edited. Leave it unset if only
+// some of the maps in the wad were built.
+
+void FNodeCache::Save (const char *filename, bool prune) const
+{
+	std::vector<uint8_t> data;
+	uint32_t count = 0;
+
+	data.resize (sizeof(CacheMagic) + sizeof(count));
+	for (const auto &it : Entries)
+	{
+		if (it.second.Used || !prune)
+		{
+			FCacheRecord record;
+
+			memset (&record, 0, sizeof(record));
+			record.Hash = it.first;
+			record.Choice = it.second.Choice;
+			data.insert (data.end(), (const uint8_t *)&record, (const uint8_t *)(&record + 1));
+			count++;
+		}
+	}
+	memcpy (data.data(), CacheMagic, sizeof(CacheMagic));
+	memcpy (data.data() + sizeof(CacheMagic), &count, sizeof(count));
+
+	File::write_all_bytes (filename, data.data(), data.size());
+}
+
+const FNodeCacheEntry *FNodeCache::Find (uint64_t hash) const
+{
+	auto it = Entries.find (hash);
+	return it != Entries.end() ? &it->second.Choice : nullptr;
+}
+
+void FNodeCache::Add (uint64_t hash, const FNodeCacheEntry &entry)
+{
+	std::lock_guard<std::mutex> lock (FreshMutex);
+	Fresh[hash] = entry;
+}
+
+void FNodeCache::Commit ()
+{
+	if (Sharing)
+	{
+		return;
+	}
+	for (const auto &it : Fresh)
+	{
+		Entries[it.first] = { it.second, true };
+	}
+	Fresh.clear ();
+}
+
+void FNodeCache::BeginSharing ()
+{
+	Sharing = true;
+}
+
+void FNodeCache::EndSharing ()
+{
+	Sharing = false;
+	Commit ();
+}
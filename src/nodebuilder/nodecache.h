@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include "level/doomdata.h"
+
+// What the node builder decided to do with one seg set. Segs are identified by
+// their position in the set, since seg numbers change whenever the map does.
+struct FNodeCacheEntry
+{
+	uint32_t NumSegs;
+	fixed_t X, Y, DX, DY;
+	uint32_t SplitSeg;
+	uint32_t HackSeg;
+	uint32_t HackMate;
+	uint8_t Split;
+};
+
+// Remembers splitter choices between runs, keyed by a hash of the seg set and
+// the options that affect the choice. Sets that did not change since the last
+// build can skip splitter selection, which is most of the node builder's time.
+//
+// Find and Add may be called from any thread, including by two trees being
+// built at once. New entries do not become visible to Find until Commit is
+// called, which may only happen once no tree is being built. While several
+// maps are being built at once, call BeginSharing first: Commit then does
+// nothing until EndSharing, which commits everything once they are done.
+class FNodeCache
+{
+public:
+	void Load (const char *filename);
+	void Save (const char *filename, bool prune) const;
+
+	const FNodeCacheEntry *Find (uint64_t hash) const;
+	void Add (uint64_t hash, const FNodeCacheEntry &entry);
+	void Commit ();
+	void BeginSharing ();
+	void EndSharing ();
+
+private:
+	struct FEntry
+	{
+		FNodeCacheEntry Choice;
+		bool Used;
+	};
+
+	std::unordered_map<uint64_t, FEntry> Entries;
+	std::unordered_map<uint64_t, FNodeCacheEntry> Fresh;
+	std::mutex FreshMutex;
+	bool Sharing = false;
+};
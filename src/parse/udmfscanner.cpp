@@ -0,0 +1,240 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include <string>
+
+#include "framework/zdray.h"
+#include "parse/udmfscanner.h"
+
+// Characters that are a token of their own, as in sc_man's C mode.
+static const char StopChars[] = "`~!@#$%^&*(){}[]/=?+|;:<>,";
+
+static bool StopTable[256];
+static const bool StopTableReady = []()
+{
+	for (const char *p = StopChars; *p; ++p)
+	{
+		StopTable[(uint8_t)*p] = true;
+	}
+	return true;
+}();
+
+static inline bool IsSpace (char c)
+{
+	// Like sc_man, anything from 128 up counts as space outside of quotes.
+	return (signed char)c <= ' ';
+}
+
+static inline bool IsStop (char c)
+{
+	return StopTable[(uint8_t)c];
+}
+
+FUDMFScanner::FUDMFScanner (const char *buffer, size_t size, size_t offset)
+	: Start (buffer), Ptr (buffer + offset), End (buffer + size)
+{
+}
+
+//==========================================================================
+//
+// Skips spaces and comments. Returns false if nothing else is left.
+//
+//==========================================================================
+
+bool FUDMFScanner::SkipSpace ()
+{
+	while (Ptr < End)
+	{
+		if (IsSpace (*Ptr))
+		{
+			Ptr++;
+		}
+		else if (Ptr[0] == '/' && Ptr + 1 < End && Ptr[1] == '/')
+		{
+			Ptr = (const char *)memchr (Ptr, '\n', End - Ptr);
+			if (Ptr == nullptr)
+			{
+				Ptr = End;
+			}
+		}
+		else if (Ptr[0] == '/' && Ptr + 1 < End && Ptr[1] == '*')
+		{
+			const char *p = Ptr + 1;
+			while (p + 1 < End && (p[0] != '*' || p[1] != '/'))
+			{
+				p++;
+			}
+			Ptr = p + 1 < End ? p + 2 : End;
+		}
+		else
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool FUDMFScanner::GetToken (std::string_view &token)
+{
+	if (!SkipSpace ())
+	{
+		return false;
+	}
+
+	const char *tokstart = Ptr;
+	if (*Ptr == '"')
+	{
+		for (Ptr++; Ptr < End && *Ptr != '"'; Ptr++)
+		{
+			// Keep \" from ending the string. Escapes are not translated,
+			// since the string is only ever written back out.
+			if (*Ptr == '\\' && Ptr + 1 < End)
+			{
+				Ptr++;
+			}
+		}
+		if (Ptr < End)
+		{
+			Ptr++;
+		}
+	}
+	else if (IsStop (*Ptr))
+	{
+		Ptr++;
+	}
+	else
+	{
+		while (Ptr < End && !IsSpace (*Ptr) && !IsStop (*Ptr))
+		{
+			Ptr++;
+		}
+	}
+	token = std::string_view (tokstart, Ptr - tokstart);
+	return true;
+}
+
+void FUDMFScanner::MustGetToken (std::string_view &token)
+{
+	if (!GetToken (token))
+	{
+		Error ("Missing string (unexpected end of file).");
+	}
+}
+
+bool FUDMFScanner::CheckChar (char c)
+{
+	if (SkipSpace () && *Ptr == c)
+	{
+		Ptr++;
+		return true;
+	}
+	return false;
+}
+
+void FUDMFScanner::MustGetChar (char c)
+{
+	if (!CheckChar (c))
+	{
+		std::string_view token;
+
+		MustGetToken (token);
+		Error ("Expected '%c', got '%.*s'.", c, (int)token.size(), token.data());
+	}
+}
+
+bool FUDMFScanner::SkipPastBlockEnd (size_t offset)
+{
+	std::string_view token;
+	int depth = 0;
+
+	// Only a bare one character token can be a brace. One inside a quoted
+	// string or a comment never gets this far.
+	while (GetToken (token))
+	{
+		if (token.size() != 1)
+		{
+			continue;
+		}
+		if (token[0] == '{')
+		{
+			depth++;
+		}
+		else if (token[0] == '}' && depth > 0 && --depth == 0 && GetOffset () >= offset)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+int FUDMFScanner::GetLine () const
+{
+	int line = 1;
+	for (const char *p = Start; (p = (const char *)memchr (p, '\n', Ptr - p)) != nullptr; ++p)
+	{
+		line++;
+	}
+	return line;
+}
+
+void FUDMFScanner::Error (const char *message, ...) const
+{
+	char composed[2048];
+	char full[2100];
+
+	va_list arglist;
+	va_start (arglist, message);
+	vsnprintf (composed, sizeof(composed), message, arglist);
+	va_end (arglist);
+
+	snprintf (full, sizeof(full), "Script error, line %d:\n%s", GetLine (), composed);
+	throw std::runtime_error (full);
+}
+
+bool FUDMFScanner::Compare (std::string_view token, const char *text)
+{
+	size_t len = strlen (text);
+	return len == token.size() && strnicmp (token.data(), text, len) == 0;
+}
+
+double FUDMFScanner::ToFloat (std::string_view token)
+{
+	// Plain decimals with few enough digits come out exact from one division,
+	// the same as strtod would give. Anything else goes to strtod.
+	static const double Powers[] =
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *p = token.data(), *e = p + token.size();
+	bool negative = false;
+	uint64_t mantissa = 0;
+	int digits = 0, fraction = 0;
+
+	if (p < e && (*p == '-' || *p == '+'))
+	{
+		negative = *p++ == '-';
+	}
+	for (; p < e && *p >= '0' && *p <= '9'; ++p, ++digits)
+	{
+		mantissa = mantissa * 10 + (*p - '0');
+	}
+	if (p < e && *p == '.')
+	{
+		for (++p; p < e && *p >= '0' && *p <= '9'; ++p, ++digits, ++fraction)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+	}
+	if (p == e && digits > 0 && digits <= 15)
+	{
+		double value = (double)mantissa / Powers[fraction];
+		return negative ? -value : value;
+	}
+
+	std::string copy (token);
+	return strtod (copy.c_str(), nullptr);
+}
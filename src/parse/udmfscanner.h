@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <string_view>
+
+// Splits a TEXTMAP into tokens, the same way sc_man did in C mode. Tokens are
+// views into the buffer, so nothing is copied, and all state is in the object,
+// so any number of maps can be scanned at once. A quoted string keeps its
+// quotes. Numbers are only converted when asked for, straight from the token.
+class FUDMFScanner
+{
+public:
+	// Scanning may start at an offset into the buffer. Line numbers in errors
+	// are still counted from the start of the buffer.
+	FUDMFScanner (const char *buffer, size_t size, size_t offset = 0);
+
+	// Returns false at the end of the buffer.
+	bool GetToken (std::string_view &token);
+	void MustGetToken (std::string_view &token);
+
+	// Reads the next token only if it is the single character c, which must
+	// be one of the characters that are always a token on their own.
+	bool CheckChar (char c);
+	void MustGetChar (char c);
+
+	// Skips tokens up to and including the first '}' that closes a block
+	// opened after the current position and that ends at or past offset.
+	// Returns false if the buffer ends first.
+	bool SkipPastBlockEnd (size_t offset);
+
+	size_t GetOffset () const { return Ptr - Start; }
+
+	[[noreturn]] void Error (const char *message, ...) const;
+	int GetLine () const;
+
+	static bool Compare (std::string_view token, const char *text);
+
+	// What strtod makes of the start of the token, which is 0 for one that
+	// is not a number at all.
+	static double ToFloat (std::string_view token);
+
+private:
+	bool SkipSpace ();
+
+	const char *Start;
+	const char *Ptr;
+	const char *End;
+};
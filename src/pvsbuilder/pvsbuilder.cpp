@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "framework/zdray.h"
+#include "rejectbuilder/portalflow.h"
+#include "pvsbuilder/pvsbuilder.h"
+
+// The flow keeps two bit sets for every portal. Do not start it if they would
+// take more memory than this.
+static const double MAX_FLOW_MEMORY = 1024. * 1024 * 1024;
+
+FPVSBuilder::FPVSBuilder (FLevel &level, double maxdistance, double timelimit)
+	: Level (level), MaxDistance (maxdistance), TimeLimit (timelimit)
+{
+}
+
+uint8_t *FPVSBuilder::GetPVS (int &size)
+{
+	int numleaves = Level.NumGLSubsectors;
+	int rowsize = (numleaves + 7) / 8;
+
+	// Every seg with a partner might become a portal.
+	int numportals = 0;
+	for (int i = 0; i < Level.NumGLSegs; ++i)
+	{
+		if (Level.GLSegs[i].partner != NO_INDEX)
+		{
+			numportals++;
+		}
+	}
+	if (2. * numportals * ((numleaves + 31) / 32) * sizeof(uint32_t) > MAX_FLOW_MEMORY ||
+		(double)numleaves * rowsize > 0x7fffffff)
+	{
+		printf ("   The map has too many subsectors for a GL_PVS.\n");
+		size = 0;
+		return nullptr;
+	}
+
+	TArray<int> leafcluster;
+	leafcluster.Resize (numleaves);
+	for (int i = 0; i < numleaves; ++i)
+	{
+		leafcluster[i] = i;
+	}
+	FPortalFlow flow (Level, leafcluster, numleaves, MaxDistance, TimeLimit);
+
+	size = numleaves * rowsize;
+	uint8_t *pvs = new uint8_t[size];
+	int64_t seen = 0;
+
+	memset (pvs, 0, size);
+	for (int i = 0; i < numleaves; ++i)
+	{
+		uint8_t *row = pvs + i * rowsize;
+		for (int j = 0; j < numleaves; ++j)
+		{
+			// As with the reject, a pair can see each other if either
+			// direction says so.
+			if (flow.IsVisible (i, j) || flow.IsVisible (j, i))
+			{
+				row[j >> 3] |= 1 << (j & 7);
+				seen++;
+			}
+		}
+	}
+
+	if (flow.GetNumRushed () > 0)
+	{
+		printf ("   Ran out of time for %d portals. Their subsectors see more than they should.\n", flow.GetNumRushed ());
+	}
+	printf ("   %lld of %lld subsector pairs can see each other.\n", (long long)seen, (long long)numleaves * numleaves);
+	return pvs;
+}
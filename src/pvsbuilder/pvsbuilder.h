@@ -0,0 +1,26 @@
+#pragma once
+
+#include "level/doomdata.h"
+#include "framework/tarray.h"
+
+// Builds a GL_PVS lump: which GL subsectors can see each other, found the same
+// way as the REJECT, with every subsector a cluster of its own. There is one
+// row of (NumGLSubsectors+7)/8 bytes per subsector, and bit j of row i is set
+// if subsector i can see subsector j.
+class FPVSBuilder
+{
+public:
+	// Subsectors further apart than maxdistance map units never see each
+	// other. After timelimit seconds, whatever is left gets a rough guess
+	// that sees more than it should. Zero means no limit for either.
+	FPVSBuilder (FLevel &level, double maxdistance, double timelimit);
+
+	// Returns a new table of size bytes, or nullptr if the map is too big for
+	// one. The caller owns it.
+	uint8_t *GetPVS (int &size);
+
+private:
+	FLevel &Level;
+	double MaxDistance;
+	double TimeLimit;
+};
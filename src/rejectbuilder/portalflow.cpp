@@ -0,0 +1,543 @@
+#include <string.h>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#include "framework/zdray.h"
+#include "framework/threadpool.h"
+#include "rejectbuilder/portalflow.h"
+
+// How far, in map units, a point may lie behind a line and still count as in
+// front of it. Leaning this way can only make more clusters visible.
+static const double SIDE_EPSILON = 1. / 64;
+
+static const int PORTALS_PER_TASK = 256;
+static const unsigned int FLOWS_PER_BATCH = 64;
+
+// Calls func(index, slot) for every index below count. slot is a number below
+// the pool's worker count plus one that no other thread uses at the same time.
+
+template<class Func>
+static void ParallelFor (ThreadPool *pool, int count, int pertask, Func &&func)
+{
+	if (pool == nullptr)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			func (i, 0);
+		}
+		return;
+	}
+
+	std::atomic<int> remaining ((count + pertask - 1) / pertask);
+
+	for (int start = 0; start < count; start += pertask)
+	{
+		int end = MIN (start + pertask, count);
+
+		pool->Submit ([pool, &func, &remaining, start, end]()
+		{
+			int slot = pool->GetCurrentSlot ();
+			for (int i = start; i < end; ++i)
+			{
+				func (i, slot);
+			}
+			remaining--;
+		});
+	}
+	pool->WaitUntil ([&remaining]() { return remaining == 0; });
+}
+
+// Distance of p from the line, positive on its left side.
+static double PointSide (const DVector2 &start, const DVector2 &end, const DVector2 &p)
+{
+	DVector2 d = end - start;
+	double len = d.Length ();
+	if (len == 0)
+	{
+		return 0;
+	}
+	return (d.X * (p.Y - start.Y) - d.Y * (p.X - start.X)) / len;
+}
+
+static double PointDistance (const DVector2 &p, const DVector2 &start, const DVector2 &end)
+{
+	DVector2 d = end - start;
+	double lensq = d.LengthSquared ();
+	double frac = lensq > 0 ? ((p - start) | d) / lensq : 0;
+	frac = MIN (MAX (frac, 0.), 1.);
+	return (p - (start + d * frac)).Length ();
+}
+
+FPortalFlow::FPortalFlow (const FLevel &level, const TArray<int> &leafcluster, int numclusters, double maxdistance, double timelimit)
+	: Level (level), NumClusters (numclusters), MaxDistance (maxdistance), TimeLimit (timelimit), LeafCluster (leafcluster)
+{
+	NumWords = (NumClusters + 31) / 32;
+	StartTime = std::chrono::steady_clock::now ();
+	NumRushed = 0;
+
+	FindPortals ();
+	FillLeafClusters ();
+
+	int numleaves = Level.NumGLSubsectors;
+	int numportals = Portals.Size ();
+	int threads = ThreadPool::GetThreadCount (NumThreads);
+	std::unique_ptr<ThreadPool> pool;
+	if (threads > 1)
+	{
+		pool.reset (new ThreadPool (threads - 1));
+	}
+	int numslots = pool ? pool->GetWorkerCount () + 1 : 1;
+
+	// First find everything each portal could see if nothing but its own
+	// line were in the way. This caps how far a flow through it can reach.
+	MightSee.Resize (numportals * NumWords);
+	PortalVis.Resize (numportals * NumWords);
+	PortalDone.Resize (numportals);
+	if (numportals > 0)
+	{
+		memset (&MightSee[0], 0, MightSee.Size() * sizeof(uint32_t));
+		memset (&PortalVis[0], 0, PortalVis.Size() * sizeof(uint32_t));
+		memset (&PortalDone[0], 0, numportals);
+	}
+	{
+		TArray<TArray<int>> queues (numslots, true);
+		TArray<TArray<unsigned int>> marks (numslots, true);
+		TArray<unsigned int> lastmark (numslots, true);
+		for (int i = 0; i < numslots; ++i)
+		{
+			marks[i].Resize (numleaves);
+			if (numleaves > 0)
+			{
+				memset (&marks[i][0], 0, numleaves * sizeof(unsigned int));
+			}
+			lastmark[i] = 0;
+		}
+		ParallelFor (pool.get(), numportals, PORTALS_PER_TASK, [&](int portal, int slot)
+		{
+			BaseFlow (portal, queues[slot], marks[slot], ++lastmark[slot]);
+		});
+	}
+
+	// A line of sight from one cluster to another leaves the first one for
+	// the last time through one of its portals, so only the portals that lead
+	// out of a cluster need a full flow. Those that might see the least go
+	// first, so the others can be cut short by their results. The flows run
+	// in batches that only use results from earlier batches, which keeps the
+	// output the same no matter how many threads there are.
+	TArray<int> sources;
+	TArray<int> mightcount;
+	mightcount.Resize (numportals);
+	for (int i = 0; i < numportals; ++i)
+	{
+		int cluster = LeafCluster[Portals[i].FromLeaf];
+		if (cluster >= 0 && LeafCluster[Portals[i].ToLeaf] != cluster)
+		{
+			sources.Push (i);
+		}
+		mightcount[i] = CountBits (&MightSee[i * NumWords]);
+	}
+	std::stable_sort (sources.begin(), sources.end(), [&](int a, int b) { return mightcount[a] < mightcount[b]; });
+
+	{
+		TArray<FFlow> flows (numslots, true);
+		for (int i = 0; i < numslots; ++i)
+		{
+			flows[i].OnPath.Resize (numleaves);
+			if (numleaves > 0)
+			{
+				memset (&flows[i].OnPath[0], 0, numleaves);
+			}
+		}
+		for (unsigned int start = 0; start < sources.Size(); start += FLOWS_PER_BATCH)
+		{
+			int count = MIN (FLOWS_PER_BATCH, sources.Size() - start);
+			ParallelFor (pool.get(), count, 1, [&](int i, int slot)
+			{
+				PortalFlow (sources[start + i], flows[slot]);
+			});
+			for (int i = 0; i < count; ++i)
+			{
+				PortalDone[sources[start + i]] = 1;
+			}
+		}
+	}
+
+	// Each cluster sees itself and whatever its portals see.
+	Visible.Resize (NumClusters * NumWords);
+	if (NumClusters > 0)
+	{
+		memset (&Visible[0], 0, Visible.Size() * sizeof(uint32_t));
+	}
+	for (int i = 0; i < NumClusters; ++i)
+	{
+		Visible[i * NumWords + (i >> 5)] |= 1u << (i & 31);
+	}
+	for (unsigned int i = 0; i < sources.Size(); ++i)
+	{
+		uint32_t *visible = &Visible[LeafCluster[Portals[sources[i]].FromLeaf] * NumWords];
+		const uint32_t *portalvis = &PortalVis[sources[i] * NumWords];
+		for (int j = 0; j < NumWords; ++j)
+		{
+			visible[j] |= portalvis[j];
+		}
+	}
+}
+
+bool FPortalFlow::IsVisible (int from, int to) const
+{
+	return (Visible[from * NumWords + (to >> 5)] & (1u << (to & 31))) != 0;
+}
+
+int FPortalFlow::CountBits (const uint32_t *bits) const
+{
+	int count = 0;
+	for (int i = 0; i < NumWords; ++i)
+	{
+		for (uint32_t word = bits[i]; word != 0; word &= word - 1)
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+// Every seg with a partner in another subsector is a portal. Portals are
+// stored in the order of their subsectors, so each subsector's are together.
+
+void FPortalFlow::FindPortals ()
+{
+	int numleaves = Level.NumGLSubsectors;
+	TArray<int> segleaf;
+
+	segleaf.Resize (Level.NumGLSegs);
+	if (Level.NumGLSegs > 0)
+	{
+		memset (&segleaf[0], 0xff, Level.NumGLSegs * sizeof(int));
+	}
+	for (int i = 0; i < numleaves; ++i)
+	{
+		const MapSubsectorEx &sub = Level.GLSubsectors[i];
+		for (uint32_t j = 0; j < sub.numlines; ++j)
+		{
+			segleaf[sub.firstline + j] = i;
+		}
+	}
+
+	LeafPortalStart.Resize (numleaves + 1);
+	for (int i = 0; i < numleaves; ++i)
+	{
+		const MapSubsectorEx &sub = Level.GLSubsectors[i];
+
+		LeafPortalStart[i] = Portals.Size();
+		for (uint32_t j = sub.firstline; j < sub.firstline + sub.numlines; ++j)
+		{
+			const MapSegGLEx &seg = Level.GLSegs[j];
+
+			if (seg.partner == NO_INDEX || seg.partner >= (uint32_t)Level.NumGLSegs || segleaf[seg.partner] < 0 || segleaf[seg.partner] == i)
+			{
+				continue;
+			}
+
+			FPortal portal;
+			const WideVertex &v1 = Level.GLVertices[seg.v1];
+			const WideVertex &v2 = Level.GLVertices[seg.v2];
+			portal.Winding.Start = DVector2 (v1.x / 65536., v1.y / 65536.);
+			portal.Winding.End = DVector2 (v2.x / 65536., v2.y / 65536.);
+			portal.FromLeaf = i;
+			portal.ToLeaf = segleaf[seg.partner];
+			Portals.Push (portal);
+		}
+	}
+	LeafPortalStart[numleaves] = Portals.Size();
+}
+
+// A subsector without a cluster gets the cluster of a neighbor.
+
+void FPortalFlow::FillLeafClusters ()
+{
+	bool changed;
+	do
+	{
+		changed = false;
+		for (unsigned int i = 0; i < Portals.Size(); ++i)
+		{
+			if (LeafCluster[Portals[i].ToLeaf] < 0 && LeafCluster[Portals[i].FromLeaf] >= 0)
+			{
+				LeafCluster[Portals[i].ToLeaf] = LeafCluster[Portals[i].FromLeaf];
+				changed = true;
+			}
+		}
+	} while (changed);
+}
+
+// Floods out from the portal, passing only through portals that are at least
+// partly in front of it and that it is at least partly behind. Any line of
+// sight through the portal can only pass through such portals.
+
+void FPortalFlow::BaseFlow (int portal, TArray<int> &queue, TArray<unsigned int> &marks, unsigned int mark)
+{
+	const FPortal &p = Portals[portal];
+	uint32_t *might = &MightSee[portal * NumWords];
+	unsigned int head = 0;
+
+	queue.Clear ();
+	marks[p.FromLeaf] = mark;
+	marks[p.ToLeaf] = mark;
+	queue.Push (p.ToLeaf);
+
+	while (head < queue.Size())
+	{
+		int leaf = queue[head++];
+		int cluster = LeafCluster[leaf];
+		if (cluster >= 0)
+		{
+			might[cluster >> 5] |= 1u << (cluster & 31);
+		}
+
+		for (int i = LeafPortalStart[leaf]; i < LeafPortalStart[leaf + 1]; ++i)
+		{
+			const FPortal &q = Portals[i];
+			if (marks[q.ToLeaf] == mark)
+			{
+				continue;
+			}
+			if (PointSide (p.Winding.Start, p.Winding.End, q.Winding.Start) < -SIDE_EPSILON &&
+				PointSide (p.Winding.Start, p.Winding.End, q.Winding.End) < -SIDE_EPSILON)
+			{
+				continue;
+			}
+			if (PointSide (q.Winding.Start, q.Winding.End, p.Winding.Start) > SIDE_EPSILON &&
+				PointSide (q.Winding.Start, q.Winding.End, p.Winding.End) > SIDE_EPSILON)
+			{
+				continue;
+			}
+			if (TooFar (p.Winding, q.Winding))
+			{
+				continue;
+			}
+			marks[q.ToLeaf] = mark;
+			queue.Push (q.ToLeaf);
+		}
+	}
+}
+
+void FPortalFlow::PortalFlow (int portal, FFlow &flow)
+{
+	const FPortal &p = Portals[portal];
+
+	flow.Vis = &PortalVis[portal * NumWords];
+	if (TimeLimit > 0 && std::chrono::duration<double> (std::chrono::steady_clock::now () - StartTime).count () > TimeLimit)
+	{
+		// Out of time, so settle for everything the portal might see.
+		memcpy (flow.Vis, &MightSee[portal * NumWords], NumWords * sizeof(uint32_t));
+		NumRushed++;
+		return;
+	}
+
+	flow.Might.Resize (NumWords);
+	memcpy (&flow.Might[0], &MightSee[portal * NumWords], NumWords * sizeof(uint32_t));
+	MarkVisible (flow, p.ToLeaf);
+
+	flow.OnPath[p.FromLeaf] = 1;
+	flow.OnPath[p.ToLeaf] = 1;
+	for (int i = LeafPortalStart[p.ToLeaf]; i < LeafPortalStart[p.ToLeaf + 1]; ++i)
+	{
+		const FPortal &q = Portals[i];
+		if (flow.OnPath[q.ToLeaf])
+		{
+			continue;
+		}
+
+		// Any two portals of a subsector can see each other, so only what
+		// is behind the source needs to be cut away.
+		FWinding pass = q.Winding;
+		if (!ClipToFront (p.Winding, pass) || TooFar (p.Winding, pass))
+		{
+			continue;
+		}
+		MarkVisible (flow, q.ToLeaf);
+		if (NarrowMight (flow, 0, i))
+		{
+			RecursiveFlow (flow, q.ToLeaf, p.Winding, pass, 1);
+		}
+	}
+	flow.OnPath[p.FromLeaf] = 0;
+	flow.OnPath[p.ToLeaf] = 0;
+}
+
+// Looks through each portal of the leaf for what a line through both the
+// source and the pass could reach. Both ends of the line of sight are
+// narrowed to what can still see each other before going on.
+
+void FPortalFlow::RecursiveFlow (FFlow &flow, int leaf, const FWinding &source, const FWinding &pass, int depth)
+{
+	flow.OnPath[leaf] = 1;
+
+	for (int i = LeafPortalStart[leaf]; i < LeafPortalStart[leaf + 1]; ++i)
+	{
+		const FPortal &t = Portals[i];
+		if (flow.OnPath[t.ToLeaf])
+		{
+			continue;
+		}
+
+		FWinding target = t.Winding;
+		if (!ClipToFront (pass, target) ||
+			!ClipToFront (source, target) ||
+			!ClipToSeparators (source, pass, target))
+		{
+			continue;
+		}
+
+		FWinding newsource = source;
+		if (!ClipToSeparators (target, pass, newsource) || TooFar (newsource, target))
+		{
+			continue;
+		}
+
+		MarkVisible (flow, t.ToLeaf);
+		if (NarrowMight (flow, depth, i))
+		{
+			RecursiveFlow (flow, t.ToLeaf, newsource, target, depth + 1);
+		}
+	}
+
+	flow.OnPath[leaf] = 0;
+}
+
+// A line of sight that goes on through the portal can only reach what
+// every portal on its way might see. Works that out for the next step and
+// returns whether it holds anything the flow has not seen yet.
+
+bool FPortalFlow::NarrowMight (FFlow &flow, int depth, int portal)
+{
+	const uint32_t *bound = PortalDone[portal] ? &PortalVis[portal * NumWords] : &MightSee[portal * NumWords];
+	uint32_t more = 0;
+
+	if (flow.Might.Size() < (unsigned int)((depth + 2) * NumWords))
+	{
+		flow.Might.Resize ((depth + 2) * NumWords);
+	}
+	const uint32_t *might = &flow.Might[depth * NumWords];
+	uint32_t *next = &flow.Might[(depth + 1) * NumWords];
+	for (int i = 0; i < NumWords; ++i)
+	{
+		next[i] = might[i] & bound[i];
+		more |= next[i] & ~flow.Vis[i];
+	}
+	return more != 0;
+}
+
+void FPortalFlow::MarkVisible (const FFlow &flow, int leaf) const
+{
+	int cluster = LeafCluster[leaf];
+	if (cluster >= 0)
+	{
+		flow.Vis[cluster >> 5] |= 1u << (cluster & 31);
+	}
+}
+
+// Whether every point of a is further than MaxDistance from every point of b.
+// Any line of sight through both is then too long to matter.
+
+bool FPortalFlow::TooFar (const FWinding &a, const FWinding &b) const
+{
+	if (MaxDistance <= 0)
+	{
+		return false;
+	}
+
+	// Segments that cross are no distance apart.
+	double a1 = PointSide (b.Start, b.End, a.Start), a2 = PointSide (b.Start, b.End, a.End);
+	double b1 = PointSide (a.Start, a.End, b.Start), b2 = PointSide (a.Start, a.End, b.End);
+	if ((a1 <= 0) != (a2 <= 0) && (b1 <= 0) != (b2 <= 0))
+	{
+		return false;
+	}
+
+	double dist = MIN (MIN (PointDistance (a.Start, b.Start, b.End), PointDistance (a.End, b.Start, b.End)),
+		MIN (PointDistance (b.Start, a.Start, a.End), PointDistance (b.End, a.Start, a.End)));
+	return dist > MaxDistance;
+}
+
+// Cuts away the part of w that lies behind the line. Returns false if
+// nothing is left.
+
+bool FPortalFlow::ClipToFront (const FWinding &line, FWinding &w)
+{
+	if (line.Start == line.End)
+	{
+		return true;
+	}
+
+	double d1 = PointSide (line.Start, line.End, w.Start);
+	double d2 = PointSide (line.Start, line.End, w.End);
+
+	if (d1 >= -SIDE_EPSILON && d2 >= -SIDE_EPSILON)
+	{
+		return true;
+	}
+	if (d1 < -SIDE_EPSILON && d2 < -SIDE_EPSILON)
+	{
+		return false;
+	}
+
+	// Cut at the edge of the slack, not on the line itself.
+	double frac = (d1 + SIDE_EPSILON) / (d1 - d2);
+	DVector2 mid = w.Start + (w.End - w.Start) * frac;
+	if (d1 < -SIDE_EPSILON)
+	{
+		w.Start = mid;
+	}
+	else
+	{
+		w.End = mid;
+	}
+	return true;
+}
+
+// A line through an end of the source and an end of the pass that has the
+// source on one side and the pass on the other bounds everything a line of
+// sight through both can reach: it crosses over once, between the two, and
+// stays on the pass's side from there on. Cuts away the part of the target
+// outside such lines. Returns false if nothing is left.
+
+bool FPortalFlow::ClipToSeparators (const FWinding &source, const FWinding &pass, FWinding &target)
+{
+	const DVector2 *s[2] = { &source.Start, &source.End };
+	const DVector2 *p[2] = { &pass.Start, &pass.End };
+
+	for (int i = 0; i < 2; ++i)
+	{
+		for (int j = 0; j < 2; ++j)
+		{
+			FWinding sep = { *s[i], *p[j] };
+			if ((sep.End - sep.Start).LengthSquared() < SIDE_EPSILON * SIDE_EPSILON)
+			{
+				continue;
+			}
+
+			double sourceside = PointSide (sep.Start, sep.End, *s[1 - i]);
+			double passside = PointSide (sep.Start, sep.End, *p[1 - j]);
+
+			if (passside > SIDE_EPSILON && sourceside < SIDE_EPSILON)
+			{
+				if (!ClipToFront (sep, target))
+				{
+					return false;
+				}
+			}
+			else if (passside < -SIDE_EPSILON && sourceside > -SIDE_EPSILON)
+			{
+				std::swap (sep.Start, sep.End);
+				if (!ClipToFront (sep, target))
+				{
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
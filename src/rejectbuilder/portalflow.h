@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "level/doomdata.h"
+#include "framework/tarray.h"
+#include "framework/vectors.h"
+
+// Works out which groups of GL subsectors, called clusters, can see each
+// other. The REJECT builder uses sectors as clusters and the GL_PVS builder
+// uses the subsectors themselves.
+//
+// The subsectors are convex, so a line of sight can only pass from one to the
+// next through a seg they share: a miniseg or a two-sided line. These segs are
+// the portals. For every portal leading out of a cluster, the flow follows
+// the portals a straight line could pass through in turn, narrowing both ends
+// as it goes, and marks every cluster it reaches. Heights are ignored, so the
+// result is conservative: two clusters only count as hidden from each other
+// if no straight line on the map connects them.
+class FPortalFlow
+{
+public:
+	// leafcluster holds the cluster of each GL subsector. Subsectors set to -1
+	// take the cluster of a neighbor. With a maxdistance, clusters further
+	// apart than that many map units do not see each other. With a timelimit,
+	// flows that have not started after that many seconds settle for a rough
+	// guess that sees more than it should.
+	FPortalFlow (const FLevel &level, const TArray<int> &leafcluster, int numclusters, double maxdistance = 0, double timelimit = 0);
+
+	bool IsVisible (int from, int to) const;
+	int GetLeafCluster (int leaf) const { return LeafCluster[leaf]; }
+
+	// Number of flows the time limit cut short
+	int GetNumRushed () const { return NumRushed; }
+
+private:
+	struct FWinding
+	{
+		DVector2 Start, End;
+	};
+
+	// A seg that leads from one subsector to another. The subsector it leads
+	// to is on its left side, looking from Start to End.
+	struct FPortal
+	{
+		FWinding Winding;
+		int FromLeaf, ToLeaf;
+	};
+
+	// Scratch space for one thread following a portal out of a cluster
+	struct FFlow
+	{
+		uint32_t *Vis;				// What the portal being followed sees
+		TArray<uint8_t> OnPath;		// Leaves the line of sight has already passed through
+		TArray<uint32_t> Might;		// What can still be seen at each step, NumWords per step
+	};
+
+	const FLevel &Level;
+	int NumClusters;
+	int NumWords;				// Words in one cluster bit set
+	double MaxDistance;
+	double TimeLimit;
+	std::chrono::steady_clock::time_point StartTime;
+	std::atomic<int> NumRushed;
+
+	TArray<FPortal> Portals;
+	TArray<int> LeafCluster;
+	TArray<int> LeafPortalStart;	// The portals out of leaf i are Portals[LeafPortalStart[i]] up to, but not including, Portals[LeafPortalStart[i+1]]
+	TArray<uint32_t> MightSee;		// The clusters each portal could possibly see into, NumWords per portal
+	TArray<uint32_t> PortalVis;		// The clusters each portal out of a cluster does see, NumWords per portal
+	TArray<uint8_t> PortalDone;		// Set once a portal's PortalVis is complete
+	TArray<uint32_t> Visible;		// The clusters each cluster sees, NumWords per cluster
+
+	void FindPortals ();
+	void FillLeafClusters ();
+	int CountBits (const uint32_t *bits) const;
+	void BaseFlow (int portal, TArray<int> &queue, TArray<unsigned int> &marks, unsigned int mark);
+	void PortalFlow (int portal, FFlow &flow);
+	void RecursiveFlow (FFlow &flow, int leaf, const FWinding &source, const FWinding &pass, int depth);
+	bool NarrowMight (FFlow &flow, int depth, int portal);
+	void MarkVisible (const FFlow &flow, int leaf) const;
+	bool TooFar (const FWinding &a, const FWinding &b) const;
+
+	static bool ClipToFront (const FWinding &line, FWinding &w);
+	static bool ClipToSeparators (const FWinding &source, const FWinding &pass, FWinding &target);
+};
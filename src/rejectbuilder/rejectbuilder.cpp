@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "framework/zdray.h"
+#include "rejectbuilder/rejectbuilder.h"
+
+FRejectBuilder::FRejectBuilder (FLevel &level)
+	: Level (level), Flow (level, FindLeafSectors (level), level.NumSectors ())
+{
+}
+
+// A subsector's sector comes from any of its segs that lie on a line. A
+// subsector made only of minisegs is left for the flow to give the sector of
+// a neighbor.
+
+TArray<int> FRejectBuilder::FindLeafSectors (const FLevel &level)
+{
+	int numleaves = level.NumGLSubsectors;
+	int numsectors = level.NumSectors ();
+	TArray<int> leafsector;
+
+	leafsector.Resize (numleaves);
+	for (int i = 0; i < numleaves; ++i)
+	{
+		const MapSubsectorEx &sub = level.GLSubsectors[i];
+
+		leafsector[i] = -1;
+		for (uint32_t j = sub.firstline; j < sub.firstline + sub.numlines; ++j)
+		{
+			const MapSegGLEx &seg = level.GLSegs[j];
+			if (seg.linedef != NO_INDEX && seg.linedef < (uint32_t)level.NumLines() && seg.side < 2)
+			{
+				uint32_t side = level.Lines[seg.linedef].sidenum[seg.side];
+				if (side < (uint32_t)level.NumSides() && level.Sides[side].sector >= 0 && level.Sides[side].sector < numsectors)
+				{
+					leafsector[i] = level.Sides[side].sector;
+					break;
+				}
+			}
+		}
+	}
+	return leafsector;
+}
+
+uint8_t *FRejectBuilder::GetReject ()
+{
+	int numsectors = Level.NumSectors ();
+	int size = (numsectors * numsectors + 7) / 8;
+	uint8_t *reject = new uint8_t[size];
+	int seen = 0;
+
+	memset (reject, 0, size);
+
+	// Sectors without subsectors cannot hold anything, but reject nothing
+	// for them in case the map uses them some other way.
+	TArray<uint8_t> hasleaves;
+	hasleaves.Resize (numsectors);
+	if (numsectors > 0)
+	{
+		memset (&hasleaves[0], 0, numsectors);
+	}
+	for (int i = 0; i < Level.NumGLSubsectors; ++i)
+	{
+		if (Flow.GetLeafCluster (i) >= 0)
+		{
+			hasleaves[Flow.GetLeafCluster (i)] = 1;
+		}
+	}
+
+	for (int i = 0; i < numsectors; ++i)
+	{
+		for (int j = 0; j < numsectors; ++j)
+		{
+			// The flow may end up a little different in each direction, so a
+			// pair can see each other if either flow says so.
+			if (!hasleaves[i] || !hasleaves[j] || Flow.IsVisible (i, j) || Flow.IsVisible (j, i))
+			{
+				seen++;
+			}
+			else
+			{
+				int pnum = i * numsectors + j;
+				reject[pnum >> 3] |= 1 << (pnum & 7);
+			}
+		}
+	}
+
+	printf ("   %d of %d sector pairs can see each other.\n", seen, numsectors * numsectors);
+	return reject;
+}
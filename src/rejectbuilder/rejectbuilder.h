@@ -0,0 +1,23 @@
+#pragma once
+
+#include "level/doomdata.h"
+#include "framework/tarray.h"
+#include "rejectbuilder/portalflow.h"
+
+// Builds the REJECT lump from the GL subsectors and segs, which must already
+// have been built. Each sector is one cluster for FPortalFlow, so a pair is
+// only rejected if no straight line on the map connects the two sectors.
+class FRejectBuilder
+{
+public:
+	FRejectBuilder (FLevel &level);
+
+	// Returns a new table the size of Level.RejectSize. The caller owns it.
+	uint8_t *GetReject ();
+
+private:
+	FLevel &Level;
+	FPortalFlow Flow;
+
+	static TArray<int> FindLeafSectors (const FLevel &level);
+};
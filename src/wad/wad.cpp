@@ -17,7 +17,24 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 
 */
+#include <stdint.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "wad.h"
+#include "framework/templates.h"
 
 static const char MapLumpNames[12][9] =
 {
@@ -61,7 +78,7 @@ static const char GLLumpNames[5][9] =
 };
 
 FWadReader::FWadReader (const char *filename)
-	: Lumps (nullptr), File (nullptr)
+	: Lumps (nullptr), File (nullptr), Mapping (nullptr), MappingSize (0)
 {
 	File = fopen (filename, "rb");
 	if (File == nullptr)
@@ -96,14 +113,118 @@ FWadReader::FWadReader (const char *filename)
 		Lumps[i].FilePos = LittleLong(Lumps[i].FilePos);
 		Lumps[i].Size = LittleLong(Lumps[i].Size);
 	}
+
+	MapFile ();
 }
 
 FWadReader::~FWadReader ()
 {
+	for (unsigned int i = 0; i < LumpBuffers.Size(); ++i)
+	{
+		if (LumpBuffers[i])	delete[] LumpBuffers[i];
+	}
+	UnmapFile ();
 	if (File)	fclose (File);
 	if (Lumps)	delete[] Lumps;
 }
 
+// Maps the whole file into memory, so lumps can be used where they are
+// instead of being read into buffers first. If that fails, for instance
+// because the file does not fit in the address space, File is used instead.
+
+void FWadReader::MapFile ()
+{
+#ifdef _WIN32
+	HANDLE file = (HANDLE)_get_osfhandle (_fileno (File));
+	LARGE_INTEGER filesize;
+
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx (file, &filesize) ||
+		filesize.QuadPart <= 0 || (uint64_t)filesize.QuadPart > SIZE_MAX)
+	{
+		return;
+	}
+	HANDLE mapping = CreateFileMappingA (file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		return;
+	}
+	// The view keeps the mapping open by itself.
+	void *view = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle (mapping);
+	if (view == nullptr)
+	{
+		return;
+	}
+	MappingSize = (size_t)filesize.QuadPart;
+#else
+	struct stat info;
+
+	if (fstat (fileno (File), &info) != 0 || info.st_size <= 0 || (uint64_t)info.st_size > SIZE_MAX)
+	{
+		return;
+	}
+	void *view = mmap (nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fileno (File), 0);
+	if (view == MAP_FAILED)
+	{
+		return;
+	}
+	MappingSize = (size_t)info.st_size;
+#endif
+	Mapping = (const uint8_t *)view;
+}
+
+void FWadReader::UnmapFile ()
+{
+	if (Mapping != nullptr)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile (Mapping);
+#else
+		munmap ((void *)Mapping, MappingSize);
+#endif
+		Mapping = nullptr;
+		MappingSize = 0;
+	}
+}
+
+const uint8_t *FWadReader::MappedLump (int index) const
+{
+	const WadLump &lump = Lumps[index];
+
+	if (lump.FilePos < 0 || lump.Size < 0 || (size_t)lump.FilePos + (size_t)lump.Size > MappingSize)
+	{
+		throw std::runtime_error("Failed to read");
+	}
+	return Mapping + lump.FilePos;
+}
+
+const uint8_t *FWadReader::LumpData (int lump, int &size)
+{
+	if ((unsigned)lump >= (unsigned)Header.NumLumps)
+	{
+		size = 0;
+		return nullptr;
+	}
+	if (Mapping != nullptr)
+	{
+		size = Lumps[lump].Size;
+		return MappedLump (lump);
+	}
+
+	std::lock_guard<std::recursive_mutex> lock (FileLock);
+	if (LumpBuffers.Size() == 0)
+	{
+		LumpBuffers.Resize (Header.NumLumps);
+		memset (&LumpBuffers[0], 0, Header.NumLumps * sizeof(uint8_t *));
+	}
+	if (LumpBuffers[lump] == nullptr)
+	{
+		ReadLump<uint8_t> (*this, lump, LumpBuffers[lump], size);
+	}
+	size = Lumps[lump].Size;
+	return LumpBuffers[lump];
+}
+
 bool FWadReader::IsIWAD () const
 {
 	return Header.Magic[0] == 'I';
@@ -149,7 +270,7 @@ int FWadReader::FindMapLump (const char *name, int map) const
 
 	for (j = k = 0; j < 12; ++j)
 	{
-		if (strnicmp (Lumps[map+k].Name, MapLumpNames[j], 8) == 0)
+		if (map+k < Header.NumLumps && strnicmp (Lumps[map+k].Name, MapLumpNames[j], 8) == 0)
 		{
 			if (i == j)
 			{
@@ -165,7 +286,7 @@ bool FWadReader::isUDMF (int index) const
 {
 	index++;
 
-	if (strnicmp(Lumps[index].Name, "TEXTMAP", 8) == 0)
+	if (index < Header.NumLumps && strnicmp(Lumps[index].Name, "TEXTMAP", 8) == 0)
 	{
 		// UDMF map
 		return true;
@@ -184,7 +305,7 @@ bool FWadReader::IsMap (int index) const
 
 	for (i = j = 0; i < 12; ++i)
 	{
-		if (strnicmp (Lumps[index+j].Name, MapLumpNames[i], 8) != 0)
+		if (index+j >= Header.NumLumps || strnicmp (Lumps[index+j].Name, MapLumpNames[i], 8) != 0)
 		{
 			if (MapLumpRequired[i])
 			{
@@ -334,15 +455,19 @@ void FWadReader::SafeRead (void *buffer, size_t size)
 
 const char *FWadReader::LumpName (int lump)
 {
-	static char name[9];
+	static thread_local char name[9];
 	strncpy (name, Lumps[lump].Name, 8);
 	name[8] = 0;
 	return name;
 }
 
 FWadWriter::FWadWriter (const char *filename, bool iwad)
-	: File (nullptr)
+	: File (nullptr), CopyMode (ECM_CopyFileRange)
 {
+	Pending.Wad = nullptr;
+	Pending.Start = 0;
+	Pending.Size = 0;
+
 	File = fopen (filename, "wb");
 	if (File == nullptr)
 	{
@@ -380,6 +505,8 @@ void FWadWriter::Close ()
 	{
 		int32_t head[2];
 
+		FlushCopy ();
+
 		head[0] = LittleLong(Lumps.Size());
 		head[1] = LittleLong(ftell (File));
 
@@ -395,6 +522,7 @@ void FWadWriter::CreateLabel (const char *name)
 {
 	WadLump lump;
 
+	FlushCopy ();
 	strncpy (lump.Name, name, 8);
 	lump.FilePos = LittleLong(ftell (File));
 	lump.Size = 0;
@@ -405,6 +533,7 @@ void FWadWriter::WriteLump (const char *name, const void *data, int len)
 {
 	WadLump lump;
 
+	FlushCopy ();
 	strncpy (lump.Name, name, 8);
 	lump.FilePos = LittleLong(ftell (File));
 	lump.Size = LittleLong(len);
@@ -413,16 +542,146 @@ void FWadWriter::WriteLump (const char *name, const void *data, int len)
 	SafeWrite (data, len);
 }
 
+// The lump is only added to the directory here. Its data is copied by
+// FlushCopy, along with any lumps right after it in the input that are
+// copied next.
+
 void FWadWriter::CopyLump (FWadReader &wad, int lump)
 {
-	uint8_t *data;
-	int size;
+	if ((unsigned)lump >= (unsigned)wad.NumLumps())
+	{
+		return;
+	}
 
-	ReadLump<uint8_t> (wad, lump, data, size);
-	if (data != nullptr)
+	const WadLump &in = wad.Lumps[lump];
+	WadLump out;
+
+	if (in.Size > 0 && (Pending.Wad != &wad || Pending.Start + Pending.Size != in.FilePos))
+	{
+		FlushCopy ();
+		Pending.Wad = &wad;
+		Pending.Start = in.FilePos;
+	}
+	strncpy (out.Name, wad.LumpName (lump), 8);
+	out.FilePos = LittleLong(ftell (File) + Pending.Size);
+	out.Size = LittleLong(in.Size);
+	Lumps.Push (out);
+	if (in.Size > 0)
+	{
+		Pending.Size += in.Size;
+	}
+}
+
+void FWadWriter::FlushCopy ()
+{
+	if (Pending.Size == 0)
+	{
+		return;
+	}
+
+	FWadReader &wad = *Pending.Wad;
+	long start = Pending.Start;
+	long size = Pending.Size;
+	Pending.Size = 0;
+
+	if (start < 0)
+	{
+		throw std::runtime_error("Failed to read");
+	}
+	long done = KernelCopy (wad, start, size);
+	if (done < size)
+	{
+		BufferedCopy (wad, start + done, size - done);
+	}
+}
+
+// Lets the kernel copy as much of the run as it will, without it passing
+// through this process. Returns how much it copied. Each way of doing it
+// that fails is not tried again for this file.
+
+long FWadWriter::KernelCopy (FWadReader &wad, long start, long size)
+{
+	long done = 0;
+
+#ifdef __linux__
+	if (CopyMode == ECM_Buffered || fflush (File) != 0)
+	{
+		return 0;
+	}
+
+	int infd = fileno (wad.File);
+	int outfd = fileno (File);
+	long outpos = ftell (File);
+
+	while (done < size && CopyMode != ECM_Buffered)
+	{
+		ssize_t copied;
+
+		if (CopyMode == ECM_CopyFileRange)
+		{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+			loff_t inpos = start + done;
+			copied = copy_file_range (infd, &inpos, outfd, nullptr, size - done, 0);
+#else
+			copied = -1;
+			errno = ENOSYS;
+#endif
+		}
+		else
+		{
+			off_t inpos = start + done;
+			copied = sendfile (outfd, infd, &inpos, size - done);
+		}
+
+		if (copied > 0)
+		{
+			done += copied;
+		}
+		else if (copied == 0)
+		{
+			// The input ended early. Let BufferedCopy report it.
+			break;
+		}
+		else if (errno != EINTR)
+		{
+			CopyMode = CopyMode == ECM_CopyFileRange ? ECM_SendFile : ECM_Buffered;
+		}
+	}
+
+	// The kernel moved the file position, so make sure File knows about it.
+	fseek (File, outpos + done, SEEK_SET);
+#else
+	CopyMode = ECM_Buffered;
+#endif
+	return done;
+}
+
+void FWadWriter::BufferedCopy (FWadReader &wad, long start, long size)
+{
+	if (wad.Mapping != nullptr)
+	{
+		if ((size_t)start + (size_t)size > wad.MappingSize)
+		{
+			throw std::runtime_error("Failed to read");
+		}
+		SafeWrite (wad.Mapping + start, size);
+		return;
+	}
+
+	TArray<uint8_t> buffer;
+	buffer.Resize ((unsigned)MIN<long> (size, 1 << 20));
+
+	std::lock_guard<std::recursive_mutex> lock (wad.FileLock);
+	if (fseek (wad.File, start, SEEK_SET))
+	{
+		throw std::runtime_error("Failed to seek");
+	}
+	while (size > 0)
 	{
-		WriteLump (wad.LumpName (lump), data, size);
-		delete[] data;
+		long chunk = MIN<long> (size, buffer.Size());
+		wad.SafeRead (&buffer[0], chunk);
+		SafeWrite (&buffer[0], chunk);
+		size -= chunk;
 	}
 }
 
@@ -433,6 +692,7 @@ void FWadWriter::StartWritingLump (const char *name)
 
 void FWadWriter::AddToLump (const void *data, int len)
 {
+	FlushCopy ();
 	SafeWrite (data, len);
 	Lumps[Lumps.Size()-1].Size += len;
 }
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <mutex>
 
 #include "framework/zdray.h"
 #include "framework/tarray.h"
@@ -43,14 +44,30 @@ public:
 
 	void SafeRead (void *buffer, size_t size);
 
+	// Returns the lump's data, or nullptr if there is no such lump. If the
+	// wad could be mapped into memory, this points into the mapping and
+	// nothing is copied. If not, the lump is read into a buffer the reader
+	// keeps. Either way, the data lasts as long as the reader.
+	const uint8_t *LumpData (int lump, int &size);
+	bool IsMapped () const { return Mapping != nullptr; }
+
 // VC++ 6 does not support template member functions in non-template classes!
 	template<class T>
 	friend void ReadLump (FWadReader &wad, int index, T *&data, int &size);
+	friend class FWadWriter;
 
 private:
 	WadHeader Header;
 	WadLump *Lumps;
 	FILE *File;
+	const uint8_t *Mapping;		// The whole file, or nullptr if it is read through File
+	size_t MappingSize;
+	TArray<uint8_t *> LumpBuffers;	// Lumps LumpData had to read through File
+	std::recursive_mutex FileLock;	// Maps built at the same time share File and LumpBuffers
+
+	void MapFile ();
+	void UnmapFile ();
+	const uint8_t *MappedLump (int index) const;
 };
 
 
@@ -63,6 +80,15 @@ void ReadLump (FWadReader &wad, int index, T *&data, int &size)
 		size = 0;
 		return;
 	}
+	if (wad.Mapping != nullptr)
+	{
+		const uint8_t *lumpdata = wad.MappedLump (index);
+		size = wad.Lumps[index].Size / sizeof(T);
+		data = new T[size];
+		memcpy (data, lumpdata, size*sizeof(T));
+		return;
+	}
+	std::lock_guard<std::recursive_mutex> lock (wad.FileLock);
 	if (fseek (wad.File, wad.Lumps[index].FilePos, SEEK_SET))
 	{
 		throw std::runtime_error("Failed to seek");
@@ -101,8 +127,30 @@ public:
 	FWadWriter &operator << (fixed_t);
 
 private:
+	enum ECopyMode
+	{
+		ECM_CopyFileRange,
+		ECM_SendFile,
+		ECM_Buffered
+	};
+
+	// Lumps copied by CopyLump that lie one after another in the input are
+	// not written right away. They pile up here, so the whole run can be
+	// copied at once when something else needs to be written.
+	struct FPendingCopy
+	{
+		FWadReader *Wad;
+		long Start;			// Where the run starts in the input
+		long Size;
+	};
+
 	TArray<WadLump> Lumps;
 	FILE *File;
+	FPendingCopy Pending;
+	ECopyMode CopyMode;
 
 	void SafeWrite (const void *buffer, size_t size);
+	void FlushCopy ();
+	long KernelCopy (FWadReader &wad, long start, long size);
+	void BufferedCopy (FWadReader &wad, long start, long size);
 };